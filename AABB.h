@@ -0,0 +1,82 @@
+#pragma once
+
+#include "glm/glm.hpp"
+
+// Axis aligned bounding box, used by the acceleration structures to cull groups of objects
+// that a ray cannot possibly hit.
+class AABB {
+  public:
+    // An empty box has min > max so that extending it by any point gives a box around that point
+    AABB():
+      min(std::numeric_limits<float>::infinity()),
+      max(-std::numeric_limits<float>::infinity())
+    {}
+
+    AABB(const glm::vec3 &mn, const glm::vec3 &mx):
+      min(mn),
+      max(mx)
+    {}
+
+    glm::vec3 min;
+    glm::vec3 max;
+
+    void Extend(const glm::vec3 &point) {
+      min = glm::min(min, point);
+      max = glm::max(max, point);
+    }
+
+    void Extend(const AABB &box) {
+      min = glm::min(min, box.min);
+      max = glm::max(max, box.max);
+    }
+
+    bool IsEmpty() const { return min.x > max.x || min.y > max.y || min.z > max.z; }
+
+    glm::vec3 Centroid() const { return 0.5f * (min + max); }
+
+    glm::vec3 Extent() const { return max - min; }
+
+    /* Surface area of the box, this is what the SAH uses as the probability of a ray hitting it */
+    float SurfaceArea() const {
+      if (IsEmpty()) {
+        return 0.0f;
+      }
+      glm::vec3 d = Extent();
+      return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+    }
+
+    /* The axis along which the box is longest, 0 = x, 1 = y, 2 = z */
+    int LongestAxis() const {
+      glm::vec3 d = Extent();
+      if (d.x > d.y && d.x > d.z) {
+        return 0;
+      }
+      return d.y > d.z ? 1 : 2;
+    }
+
+    /*
+    ** Slab test against a ray given by its origin and the reciprocal of its direction.
+    ** Returns true if the ray enters the box somewhere in the interval [0, tMax].
+    */
+    bool IntersectRay(const glm::vec3 &origin, const glm::vec3 &invDirection, float tMax) const {
+      float tEnter = 0.0f;
+      float tExit = tMax;
+      for (int axis = 0; axis < 3; ++axis) {
+        float tNear = (min[axis] - origin[axis]) * invDirection[axis];
+        float tFar = (max[axis] - origin[axis]) * invDirection[axis];
+        if (tNear > tFar) {
+          float tmp = tNear;
+          tNear = tFar;
+          tFar = tmp;
+        }
+        // pad the exit slightly so rounding can never make us miss a box the ray grazes
+        tFar *= 1.0f + 1e-6f;
+        tEnter = tNear > tEnter ? tNear : tEnter;
+        tExit = tFar < tExit ? tFar : tExit;
+        if (tEnter > tExit) {
+          return false;
+        }
+      }
+      return true;
+    }
+};
@@ -0,0 +1,1450 @@
+#include "BVH.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+
+namespace {
+    // number of buckets the centroids are binned into when searching for the best split
+    const int SAH_BINS = 16;
+    // relative cost of visiting a node compared to intersecting one primitive
+    const float TRAVERSAL_COST = 1.0f;
+    // below this depth splits are chosen with the SAH, deeper than this the builder falls back
+    // to median splits so the tree always fits in the traversal stack
+    const int MAX_SAH_DEPTH = 64;
+    // the parent of the root in BVH::refitNodes, and of a primitive that is in no leaf
+    const uint32_t NO_NODE = 0xffffffff;
+
+    struct Bin {
+        AABB bounds;
+        int count;
+        Bin(): count(0) {}
+    };
+}
+
+static_assert(sizeof(WideBVHNode) == 64, "a wide node should fill exactly one cache line");
+
+bool BVH::buildWideNodes = false;
+bool BVH::buildLinear = false;
+int BVH::treeletPasses = 0;
+ThreadPool *BVH::buildPool = NULL;
+
+BVH::BVH():
+    nodeData(NULL),
+    numNodes(0),
+    indexData(NULL),
+    leafSize(4),
+    refitMark(0),
+    unusedWideNodes(0)
+  {}
+
+BVH::BVH(const BVH &other):
+    nodes(other.nodes),
+    indices(other.indices),
+    wideNodes(other.wideNodes),
+    nodeData(other.nodeData),
+    numNodes(other.numNodes),
+    indexData(other.indexData),
+    leafSize(other.leafSize),
+    refitNodes(other.refitNodes),
+    primitiveLeaf(other.primitiveLeaf),
+    refitMark(other.refitMark),
+    wideOf(other.wideOf),
+    unusedWideNodes(other.unusedWideNodes)
+{
+    if (other.nodeData == other.nodes.data()) {
+        UseOwnNodes();
+    }
+}
+
+BVH &BVH::operator =(const BVH &other) {
+    nodes = other.nodes;
+    indices = other.indices;
+    wideNodes = other.wideNodes;
+    nodeData = other.nodeData;
+    numNodes = other.numNodes;
+    indexData = other.indexData;
+    leafSize = other.leafSize;
+    refitNodes = other.refitNodes;
+    primitiveLeaf = other.primitiveLeaf;
+    refitMark = other.refitMark;
+    wideOf = other.wideOf;
+    unusedWideNodes = other.unusedWideNodes;
+    if (other.nodeData == other.nodes.data()) {
+        UseOwnNodes();
+    }
+    return *this;
+}
+
+void BVH::UseOwnNodes() {
+    nodeData = nodes.empty() ? NULL : &nodes[0];
+    numNodes = nodes.size();
+    indexData = indices.empty() ? NULL : &indices[0];
+}
+
+void BVH::DropIndices() {
+    std::vector<uint32_t>().swap(indices);
+    indexData = NULL;
+}
+
+void BVH::UseNodes(const BVHNode *data, size_t count, const uint32_t *indexList) {
+    nodes.clear();
+    indices.clear();
+    wideNodes.clear();
+    wideOf.clear();
+    refitNodes.clear();
+    primitiveLeaf.clear();
+    nodeData = count > 0 ? data : NULL;
+    numNodes = count;
+    indexData = indexList;
+    if (buildWideNodes) {
+        Widen();
+    }
+}
+
+void BVH::Build(const std::vector<AABB> &primitiveBounds, int maxLeafSize) {
+    if (buildLinear) {
+        BuildLinear(primitiveBounds, maxLeafSize, buildPool, treeletPasses);
+        return;
+    }
+    nodes.clear();
+    indices.clear();
+    wideNodes.clear();
+    wideOf.clear();
+    refitNodes.clear();
+    primitiveLeaf.clear();
+    leafSize = maxLeafSize;
+    UseOwnNodes();
+    if (primitiveBounds.empty()) {
+        return;
+    }
+
+    std::vector<BuildReference> references(primitiveBounds.size());
+    for (size_t i = 0; i < primitiveBounds.size(); ++i) {
+        references[i].bounds = primitiveBounds[i];
+        references[i].centroid = primitiveBounds[i].Centroid();
+        references[i].index = (uint32_t)i;
+    }
+
+    // a binary tree with n leaves has 2n - 1 nodes
+    nodes.reserve(2 * primitiveBounds.size() - 1);
+    indices.reserve(primitiveBounds.size());
+    BuildRecursive(references, 0, (int)references.size(), 0, std::max(1, std::min(maxLeafSize, 0xffff)));
+    UseOwnNodes();
+    if (buildWideNodes) {
+        Widen();
+    }
+}
+
+void BVH::Update(const std::vector<AABB> &primitiveBounds, const std::vector<uint32_t> &changed, float rebuildThreshold) {
+    // nodes in a scene cache can not be changed, and a different number of primitives needs a new tree anyway
+    if (numNodes == 0 || nodes.empty() || indices.empty() || nodeData != &nodes[0] || indices.size() != primitiveBounds.size()) {
+        Build(primitiveBounds, leafSize);
+        return;
+    }
+    if (changed.empty()) {
+        return;
+    }
+    if (refitNodes.size() != numNodes) {
+        PrepareRefit(primitiveBounds.size());
+    }
+
+    // every node above a changed primitive, each one once
+    ++refitMark;
+    std::vector<uint32_t> touched;
+    for (size_t i = 0; i < changed.size(); ++i) {
+        if (changed[i] >= primitiveLeaf.size()) {
+            continue;
+        }
+        for (uint32_t node = primitiveLeaf[changed[i]]; node != NO_NODE && refitNodes[node].mark != refitMark; node = refitNodes[node].parent) {
+            refitNodes[node].mark = refitMark;
+            touched.push_back(node);
+        }
+    }
+    // children always come after their parents, so going backwards refits every child before its parent
+    std::sort(touched.begin(), touched.end());
+    for (size_t i = touched.size(); i-- > 0;) {
+        RefitNodeBounds(touched[i], primitiveBounds);
+    }
+
+    // going forwards, the first subtree found to have got too expensive is rebuilt along with
+    // everything in it. If the new subtree does not fit in the old one's place its parent is tried.
+    uint32_t rebuiltEnd = 0;
+    std::vector<uint32_t> rebuilt;
+    for (size_t i = 0; i < touched.size(); ++i) {
+        uint32_t node = touched[i];
+        if (node < rebuiltEnd || refitNodes[node].cost <= rebuildThreshold * refitNodes[node].builtCost) {
+            continue;
+        }
+        while (!RebuildSubtree(node, primitiveBounds)) {
+            if (node == 0) {
+                Build(primitiveBounds, leafSize);
+                return;
+            }
+            node = refitNodes[node].parent;
+        }
+        rebuiltEnd = SubtreeEnd(node);
+        for (uint32_t parent = refitNodes[node].parent; parent != NO_NODE; parent = refitNodes[parent].parent) {
+            refitNodes[parent].cost = NodeCost(parent);
+        }
+        // a subtree rebuilt after failing in a child's place takes in whatever was rebuilt below it
+        rebuilt.erase(std::remove_if(rebuilt.begin(), rebuilt.end(), [&](uint32_t root) {
+            return root >= node && root < rebuiltEnd;
+        }), rebuilt.end());
+        rebuilt.push_back(node);
+    }
+    if (!wideNodes.empty()) {
+        UpdateWideNodes(touched, rebuilt);
+    }
+}
+
+/*
+** Brings the wide nodes up to date after Update(): each wide node a rebuilt subtree starts in is
+** widened again along with everything below it, and the others above what moved are quantized
+** again around their refitted boxes, keeping the children they had. Once more wide nodes are left
+** unused than are in use the whole tree is widened again to get rid of them.
+*/
+void BVH::UpdateWideNodes(const std::vector<uint32_t> &touched, std::vector<uint32_t> &rebuilt) {
+    for (size_t i = 0; i < rebuilt.size(); ++i) {
+        while (wideOf[rebuilt[i]] == NO_NODE) {
+            rebuilt[i] = refitNodes[rebuilt[i]].parent;
+        }
+    }
+    std::sort(rebuilt.begin(), rebuilt.end());
+    // the binary subtrees widened again, each one a run of nodes, in order
+    std::vector<std::pair<uint32_t, uint32_t> > widened;
+    for (size_t i = 0; i < rebuilt.size(); ++i) {
+        uint32_t root = rebuilt[i];
+        if (!widened.empty() && root < widened.back().second) {
+            continue;
+        }
+        uint32_t end = SubtreeEnd(root);
+        for (uint32_t node = root; node < end; ++node) {
+            if (wideOf[node] != NO_NODE) {
+                wideOf[node] = NO_NODE;
+                ++unusedWideNodes;
+            }
+        }
+        uint32_t wideIndex = WidenRecursive(root);
+        // the traversals start at the first wide node
+        if (root == 0) {
+            wideNodes[0] = wideNodes[wideIndex];
+            wideOf[0] = 0;
+        }
+        widened.push_back(std::make_pair(root, end));
+    }
+    if (unusedWideNodes > wideNodes.size() / 2) {
+        Widen();
+        return;
+    }
+
+    size_t next = 0;
+    for (size_t i = 0; i < touched.size(); ++i) {
+        uint32_t node = touched[i];
+        while (next < widened.size() && widened[next].second <= node) {
+            ++next;
+        }
+        if ((next < widened.size() && node >= widened[next].first) || wideOf[node] == NO_NODE) {
+            continue;
+        }
+        RefitWideNode(node);
+    }
+}
+
+void BVH::PrepareRefit(size_t numPrimitives) {
+    RefitNode unreached = { NO_NODE, 0.0f, 0.0f, 0 };
+    refitNodes.assign(numNodes, unreached);
+    primitiveLeaf.assign(numPrimitives, NO_NODE);
+    refitMark = 0;
+    PrepareRefitSubtree(0);
+}
+
+/* Works out the parents, leaves and costs below root, whose own parent is already known */
+void BVH::PrepareRefitSubtree(uint32_t root) {
+    std::vector<uint32_t> reached;
+    std::vector<uint32_t> stack(1, root);
+    while (!stack.empty()) {
+        uint32_t node = stack.back();
+        stack.pop_back();
+        reached.push_back(node);
+        const BVHNode &n = nodes[node];
+        if (n.count > 0) {
+            for (uint32_t i = n.offset; i < n.offset + n.count; ++i) {
+                primitiveLeaf[indices[i]] = node;
+            }
+        } else {
+            refitNodes[node + 1].parent = node;
+            refitNodes[n.offset].parent = node;
+            stack.push_back(node + 1);
+            stack.push_back(n.offset);
+        }
+    }
+    std::sort(reached.begin(), reached.end());
+    for (size_t i = reached.size(); i-- > 0;) {
+        RefitNode &refit = refitNodes[reached[i]];
+        refit.cost = NodeCost(reached[i]);
+        refit.builtCost = refit.cost;
+        refit.mark = refitMark;
+    }
+}
+
+/* The SAH cost of the node's subtree, in the units the builder uses, given its children's costs */
+float BVH::NodeCost(uint32_t node) const {
+    const BVHNode &n = nodes[node];
+    if (n.count > 0) {
+        return n.bounds.SurfaceArea() * n.count;
+    }
+    return TRAVERSAL_COST * n.bounds.SurfaceArea() + refitNodes[node + 1].cost + refitNodes[n.offset].cost;
+}
+
+void BVH::RefitNodeBounds(uint32_t node, const std::vector<AABB> &primitiveBounds) {
+    BVHNode &n = nodes[node];
+    if (n.count > 0) {
+        n.bounds = AABB();
+        for (uint32_t i = n.offset; i < n.offset + n.count; ++i) {
+            n.bounds.Extend(primitiveBounds[indices[i]]);
+        }
+    } else {
+        n.bounds = nodes[node + 1].bounds;
+        n.bounds.Extend(nodes[n.offset].bounds);
+    }
+    refitNodes[node].cost = NodeCost(node);
+}
+
+/* One past the last node of the subtree, which is where its parent's second child starts if it is a first child */
+uint32_t BVH::SubtreeEnd(uint32_t node) const {
+    while (node != 0) {
+        uint32_t parent = refitNodes[node].parent;
+        if (node == parent + 1) {
+            return nodes[parent].offset;
+        }
+        node = parent;
+    }
+    return (uint32_t)numNodes;
+}
+
+/*
+** Builds the subtree at root again over the same primitives, in the nodes and the run of the index
+** list it had. Returns false if its leaves did not share one run of the index list, which treelet
+** reoptimization can leave behind, or if the new subtree needs more nodes than the old one had or
+** would make the tree too deep for the traversal stack.
+*/
+bool BVH::RebuildSubtree(uint32_t root, const std::vector<AABB> &primitiveBounds) {
+    uint32_t end = SubtreeEnd(root);
+    std::vector<uint32_t> primitives;
+    uint32_t first = NO_NODE, last = 0;
+    std::vector<uint32_t> stack(1, root);
+    while (!stack.empty()) {
+        const BVHNode &n = nodes[stack.back()];
+        stack.pop_back();
+        if (n.count > 0) {
+            primitives.insert(primitives.end(), indices.begin() + n.offset, indices.begin() + n.offset + n.count);
+            first = std::min(first, n.offset);
+            last = std::max(last, n.offset + n.count);
+        } else {
+            stack.push_back((uint32_t)(&n - &nodes[0]) + 1);
+            stack.push_back(n.offset);
+        }
+    }
+    if (last - first != primitives.size()) {
+        return false;
+    }
+
+    std::vector<AABB> subtreeBounds(primitives.size());
+    for (size_t i = 0; i < primitives.size(); ++i) {
+        subtreeBounds[i] = primitiveBounds[primitives[i]];
+    }
+    BVH subtree;
+    subtree.Build(subtreeBounds, leafSize);
+    if (subtree.nodes.size() > end - root) {
+        return false;
+    }
+    // the subtree was built as a tree of its own, so it only knows to fit the traversal stack from
+    // its own root, which here is depth nodes further down
+    uint32_t depth = 0;
+    for (uint32_t node = root; node != 0; node = refitNodes[node].parent) {
+        ++depth;
+    }
+    std::vector<uint32_t> height(subtree.nodes.size(), 1);
+    for (size_t i = subtree.nodes.size(); i-- > 0;) {
+        const BVHNode &n = subtree.nodes[i];
+        if (n.count == 0) {
+            height[i] = 1 + std::max(height[i + 1], height[n.offset]);
+        }
+    }
+    if (depth + height[0] > (uint32_t)STACK_SIZE) {
+        return false;
+    }
+    for (size_t i = 0; i < subtree.nodes.size(); ++i) {
+        BVHNode n = subtree.nodes[i];
+        n.offset += n.count > 0 ? first : root;
+        nodes[root + i] = n;
+    }
+    for (size_t i = 0; i < primitives.size(); ++i) {
+        indices[first + i] = primitives[subtree.indices[i]];
+    }
+    // nothing points at the nodes left over any more, they are given boxes no ray can hit all the same
+    for (uint32_t i = root + (uint32_t)subtree.nodes.size(); i < end; ++i) {
+        nodes[i].bounds = AABB();
+        nodes[i].offset = first;
+        nodes[i].count = 1;
+        nodes[i].axis = 0;
+    }
+    PrepareRefitSubtree(root);
+    return true;
+}
+
+void BVH::Widen() {
+    wideNodes.clear();
+    wideOf.clear();
+    unusedWideNodes = 0;
+    if (numNodes == 0) {
+        return;
+    }
+    // each wide node takes the place of up to three binary interior nodes
+    wideNodes.reserve(numNodes / 3 + 1);
+    wideOf.assign(numNodes, NO_NODE);
+    WidenRecursive(0);
+}
+
+namespace {
+    /*
+    ** Quantizes [low, high] to steps of scale from origin, rounding outwards so the steps contain it.
+    ** Returns false if it needs more than 255 steps.
+    */
+    bool QuantizeSide(float origin, float scale, float low, float high, uint8_t &quantizedLow, uint8_t &quantizedHigh) {
+        int lowStep = std::max(0, (int)std::floor((low - origin) / scale));
+        while (lowStep > 0 && origin + lowStep * scale > low) {
+            --lowStep;
+        }
+        int highStep = std::max(lowStep, (int)std::ceil((high - origin) / scale));
+        while (highStep <= 255 && origin + highStep * scale < high) {
+            ++highStep;
+        }
+        if (highStep > 255) {
+            return false;
+        }
+        quantizedLow = (uint8_t)lowStep;
+        quantizedHigh = (uint8_t)highStep;
+        return true;
+    }
+}
+
+uint32_t BVH::WidenRecursive(uint32_t binaryIndex) {
+    const BVHNode &node = nodeData[binaryIndex];
+    // start with the two children and keep opening up the interior child with the biggest box,
+    // which is the one most rays would otherwise have to take an extra step down into
+    uint32_t children[WideBVHNode::WIDTH];
+    int numChildren = 0;
+    if (node.count > 0) {
+        children[numChildren++] = binaryIndex;
+    } else {
+        children[numChildren++] = binaryIndex + 1;
+        children[numChildren++] = node.offset;
+        while (numChildren < WideBVHNode::WIDTH) {
+            int biggest = -1;
+            float biggestArea = -1.0f;
+            for (int i = 0; i < numChildren; ++i) {
+                const BVHNode &child = nodeData[children[i]];
+                if (child.count == 0 && child.bounds.SurfaceArea() > biggestArea) {
+                    biggest = i;
+                    biggestArea = child.bounds.SurfaceArea();
+                }
+            }
+            if (biggest < 0) {
+                break;
+            }
+            uint32_t opened = children[biggest];
+            children[biggest] = opened + 1;
+            children[numChildren++] = nodeData[opened].offset;
+        }
+    }
+
+    uint32_t wideIndex = (uint32_t)wideNodes.size();
+    wideNodes.push_back(WideBVHNode());
+    wideOf[binaryIndex] = wideIndex;
+    WideBVHNode wide;
+    QuantizeWideNode(binaryIndex, children, numChildren, wide);
+    for (int i = 0; i < numChildren; ++i) {
+        const BVHNode &child = nodeData[children[i]];
+        if (child.count > 0) {
+            wide.child[i] = child.offset;
+            wide.count[i] = child.count;
+        } else {
+            wide.child[i] = WidenRecursive(children[i]);
+            wide.count[i] = 0;
+        }
+    }
+    wideNodes[wideIndex] = wide;
+    return wideIndex;
+}
+
+/* Sets up everything in the wide node but where its children are, from the binary node and the children it was given */
+void BVH::QuantizeWideNode(uint32_t binaryIndex, const uint32_t *children, int numChildren, WideBVHNode &wide) const {
+    const BVHNode &node = nodeData[binaryIndex];
+    memset(&wide, 0, sizeof(wide));
+    wide.numChildren = (uint8_t)numChildren;
+    uint8_t *low[3] = { wide.lowX, wide.lowY, wide.lowZ };
+    uint8_t *high[3] = { wide.highX, wide.highY, wide.highZ };
+    for (int axis = 0; axis < 3; ++axis) {
+        float origin = node.bounds.min[axis];
+        // the smallest power of two that covers the node's box in 255 steps, or the next one up
+        // if rounding the children's boxes outwards takes them over
+        int exponent;
+        std::frexp((node.bounds.max[axis] - origin) / 255.0f, &exponent);
+        exponent = std::max(exponent, -126);
+        while (true) {
+            float scale = WideScale((int8_t)exponent);
+            bool fits = true;
+            for (int i = 0; i < numChildren && fits; ++i) {
+                const AABB &box = nodeData[children[i]].bounds;
+                fits = QuantizeSide(origin, scale, box.min[axis], box.max[axis], low[axis][i], high[axis][i]);
+            }
+            if (fits) {
+                break;
+            }
+            ++exponent;
+        }
+        wide.origin[axis] = origin;
+        wide.exponent[axis] = (int8_t)exponent;
+    }
+}
+
+/* Quantizes the wide node made for the binary node again around the refitted boxes, with the same children */
+void BVH::RefitWideNode(uint32_t binaryIndex) {
+    const BVHNode &node = nodeData[binaryIndex];
+    uint32_t children[WideBVHNode::WIDTH];
+    int numChildren = 0;
+    if (node.count > 0) {
+        children[numChildren++] = binaryIndex;
+    } else {
+        children[numChildren++] = binaryIndex + 1;
+        children[numChildren++] = node.offset;
+        // the interior children without a wide node of their own were opened up into this one
+        for (int i = 0; i < numChildren;) {
+            uint32_t opened = children[i];
+            if (nodeData[opened].count == 0 && wideOf[opened] == NO_NODE) {
+                children[i] = opened + 1;
+                children[numChildren++] = nodeData[opened].offset;
+            } else {
+                ++i;
+            }
+        }
+    }
+
+    WideBVHNode &wide = wideNodes[wideOf[binaryIndex]];
+    QuantizeWideNode(binaryIndex, children, numChildren, wide);
+    for (int i = 0; i < numChildren; ++i) {
+        const BVHNode &child = nodeData[children[i]];
+        wide.child[i] = child.count > 0 ? child.offset : wideOf[children[i]];
+        wide.count[i] = child.count;
+    }
+}
+
+void BVH::MakeLeaf(BVHNode &node, std::vector<BuildReference> &references, int begin, int end) {
+    node.offset = (uint32_t)indices.size();
+    node.count = (uint16_t)(end - begin);
+    node.axis = 0;
+    for (int i = begin; i < end; ++i) {
+        indices.push_back(references[i].index);
+    }
+}
+
+void BVH::BuildRecursive(std::vector<BuildReference> &references, int begin, int end, int depth, int maxLeafSize) {
+    uint32_t nodeIndex = (uint32_t)nodes.size();
+    nodes.push_back(BVHNode());
+
+    AABB bounds, centroidBounds;
+    for (int i = begin; i < end; ++i) {
+        bounds.Extend(references[i].bounds);
+        centroidBounds.Extend(references[i].centroid);
+    }
+    nodes[nodeIndex].bounds = bounds;
+
+    int count = end - begin;
+    if (count == 1) {
+        MakeLeaf(nodes[nodeIndex], references, begin, end);
+        return;
+    }
+
+    int axis = centroidBounds.LongestAxis();
+    float axisMin = centroidBounds.min[axis];
+    float axisExtent = centroidBounds.max[axis] - axisMin;
+    int mid = begin + count / 2;
+
+    if (axisExtent <= 0.0f) {
+        // every centroid is in the same place, there is no useful split so only split if we have to
+        if (count <= maxLeafSize) {
+            MakeLeaf(nodes[nodeIndex], references, begin, end);
+            return;
+        }
+    } else if (depth >= MAX_SAH_DEPTH) {
+        std::nth_element(references.begin() + begin, references.begin() + mid, references.begin() + end,
+            [axis](const BuildReference &a, const BuildReference &b) { return a.centroid[axis] < b.centroid[axis]; });
+    } else {
+        // bin the centroids along the axis and evaluate the SAH at every bin boundary
+        Bin bins[SAH_BINS];
+        float binScale = SAH_BINS / axisExtent;
+        for (int i = begin; i < end; ++i) {
+            int b = std::min(SAH_BINS - 1, (int)((references[i].centroid[axis] - axisMin) * binScale));
+            bins[b].count++;
+            bins[b].bounds.Extend(references[i].bounds);
+        }
+
+        float leftArea[SAH_BINS - 1];
+        int leftCount[SAH_BINS - 1];
+        AABB sweep;
+        int sweepCount = 0;
+        for (int b = 0; b < SAH_BINS - 1; ++b) {
+            sweep.Extend(bins[b].bounds);
+            sweepCount += bins[b].count;
+            leftArea[b] = sweep.SurfaceArea();
+            leftCount[b] = sweepCount;
+        }
+
+        float bestCost = std::numeric_limits<float>::infinity();
+        int bestSplit = -1;
+        sweep = AABB();
+        sweepCount = 0;
+        for (int b = SAH_BINS - 1; b > 0; --b) {
+            sweep.Extend(bins[b].bounds);
+            sweepCount += bins[b].count;
+            if (leftCount[b - 1] == 0 || sweepCount == 0) {
+                continue;
+            }
+            float cost = leftArea[b - 1] * leftCount[b - 1] + sweep.SurfaceArea() * sweepCount;
+            if (cost < bestCost) {
+                bestCost = cost;
+                bestSplit = b;
+            }
+        }
+
+        float parentArea = bounds.SurfaceArea();
+        float splitCost = parentArea > 0.0f ? TRAVERSAL_COST + bestCost / parentArea : TRAVERSAL_COST;
+        if (count <= maxLeafSize && (bestSplit < 0 || splitCost >= count)) {
+            MakeLeaf(nodes[nodeIndex], references, begin, end);
+            return;
+        }
+
+        if (bestSplit >= 0) {
+            BuildReference *split = std::partition(&references[begin], &references[begin] + count,
+                [=](const BuildReference &r) {
+                    int b = std::min(SAH_BINS - 1, (int)((r.centroid[axis] - axisMin) * binScale));
+                    return b < bestSplit;
+                });
+            mid = (int)(split - &references[0]);
+        } else {
+            std::nth_element(references.begin() + begin, references.begin() + mid, references.begin() + end,
+                [axis](const BuildReference &a, const BuildReference &b) { return a.centroid[axis] < b.centroid[axis]; });
+        }
+    }
+
+    // the first child always directly follows its parent
+    BuildRecursive(references, begin, mid, depth + 1, maxLeafSize);
+    nodes[nodeIndex].offset = (uint32_t)nodes.size();
+    nodes[nodeIndex].count = 0;
+    nodes[nodeIndex].axis = (uint16_t)axis;
+    BuildRecursive(references, mid, end, depth + 1, maxLeafSize);
+}
+
+namespace {
+    // spatial splits are only searched for where the children of the best object split overlap by
+    // more than this share of the root's surface area
+    const float SPATIAL_SPLIT_OVERLAP = 1e-5f;
+
+    struct SpatialBin {
+        AABB bounds;
+        int entries;    // references whose box starts in this bin
+        int exits;      // and ends in it
+        SpatialBin(): entries(0), exits(0) {}
+    };
+
+    AABB Clip(const AABB &box, const AABB &limit) {
+        return AABB(glm::max(box.min, limit.min), glm::min(box.max, limit.max));
+    }
+}
+
+struct BVH::SpatialBuild {
+    const SplitFunction *splitPrimitive;
+    int maxLeafSize;
+    float rootArea;
+
+    /* Cuts a reference in two at position along axis, leaving each half inside its own box and side */
+    void Split(const BuildReference &reference, int axis, float position, BuildReference &left, BuildReference &right) const {
+        AABB leftBox = reference.bounds, rightBox = reference.bounds;
+        if (*splitPrimitive) {
+            (*splitPrimitive)(reference.index, reference.bounds, axis, position, leftBox, rightBox);
+        }
+        leftBox = Clip(leftBox, reference.bounds);
+        rightBox = Clip(rightBox, reference.bounds);
+        leftBox.max[axis] = std::min(leftBox.max[axis], position);
+        rightBox.min[axis] = std::max(rightBox.min[axis], position);
+        left.bounds = leftBox;
+        left.centroid = leftBox.Centroid();
+        left.index = reference.index;
+        right.bounds = rightBox;
+        right.centroid = rightBox.Centroid();
+        right.index = reference.index;
+    }
+};
+
+void BVH::BuildSpatial(const std::vector<AABB> &primitiveBounds, const SplitFunction &splitPrimitive, int maxLeafSize, float duplicationBudget) {
+    nodes.clear();
+    indices.clear();
+    wideNodes.clear();
+    wideOf.clear();
+    refitNodes.clear();
+    primitiveLeaf.clear();
+    leafSize = maxLeafSize;
+    UseOwnNodes();
+    if (primitiveBounds.empty()) {
+        return;
+    }
+
+    std::vector<BuildReference> references(primitiveBounds.size());
+    AABB bounds;
+    for (size_t i = 0; i < primitiveBounds.size(); ++i) {
+        references[i].bounds = primitiveBounds[i];
+        references[i].centroid = primitiveBounds[i].Centroid();
+        references[i].index = (uint32_t)i;
+        bounds.Extend(primitiveBounds[i]);
+    }
+    SpatialBuild build;
+    build.splitPrimitive = &splitPrimitive;
+    build.maxLeafSize = std::max(1, std::min(maxLeafSize, 0xffff));
+    build.rootArea = bounds.SurfaceArea();
+    BuildSpatialRecursive(references, 0, (size_t)(std::max(0.0f, duplicationBudget) * primitiveBounds.size()), build);
+    UseOwnNodes();
+    if (buildWideNodes) {
+        Widen();
+    }
+}
+
+/*
+** budget is how many more references the subtree may make. Whatever a split leaves of it is shared
+** out between the children by how many references each one gets, so the first subtrees built
+** do not use it all up before the rest get a chance.
+*/
+void BVH::BuildSpatialRecursive(std::vector<BuildReference> &references, int depth, size_t budget, SpatialBuild &build) {
+    uint32_t nodeIndex = (uint32_t)nodes.size();
+    nodes.push_back(BVHNode());
+
+    int count = (int)references.size();
+    AABB bounds, centroidBounds;
+    for (int i = 0; i < count; ++i) {
+        bounds.Extend(references[i].bounds);
+        centroidBounds.Extend(references[i].centroid);
+    }
+    nodes[nodeIndex].bounds = bounds;
+    if (count == 1) {
+        MakeLeaf(nodes[nodeIndex], references, 0, count);
+        return;
+    }
+
+    // the best object split, binned along the longest axis of the centroids the same way as Build()
+    int objectAxis = centroidBounds.LongestAxis();
+    float axisMin = centroidBounds.min[objectAxis];
+    float axisExtent = centroidBounds.max[objectAxis] - axisMin;
+    float binScale = axisExtent > 0.0f ? SAH_BINS / axisExtent : 0.0f;
+    float objectCost = std::numeric_limits<float>::infinity();
+    int objectSplit = -1;
+    AABB objectLeft, objectRight;
+    if (axisExtent > 0.0f && depth < MAX_SAH_DEPTH) {
+        Bin bins[SAH_BINS];
+        for (int i = 0; i < count; ++i) {
+            int b = std::min(SAH_BINS - 1, (int)((references[i].centroid[objectAxis] - axisMin) * binScale));
+            bins[b].count++;
+            bins[b].bounds.Extend(references[i].bounds);
+        }
+        AABB leftBounds[SAH_BINS - 1];
+        int leftCount[SAH_BINS - 1];
+        AABB sweep;
+        int sweepCount = 0;
+        for (int b = 0; b < SAH_BINS - 1; ++b) {
+            sweep.Extend(bins[b].bounds);
+            sweepCount += bins[b].count;
+            leftBounds[b] = sweep;
+            leftCount[b] = sweepCount;
+        }
+        sweep = AABB();
+        sweepCount = 0;
+        for (int b = SAH_BINS - 1; b > 0; --b) {
+            sweep.Extend(bins[b].bounds);
+            sweepCount += bins[b].count;
+            if (leftCount[b - 1] == 0 || sweepCount == 0) {
+                continue;
+            }
+            float cost = leftBounds[b - 1].SurfaceArea() * leftCount[b - 1] + sweep.SurfaceArea() * sweepCount;
+            if (cost < objectCost) {
+                objectCost = cost;
+                objectSplit = b;
+                objectLeft = leftBounds[b - 1];
+                objectRight = sweep;
+            }
+        }
+    }
+
+    // the best spatial split, searched for when the object split leaves children that overlap.
+    // Only the node's longest axis is tried: searching all three finds splits that look cheaper
+    // here but spend the duplication budget on cutting up big flat primitives along their thin side.
+    int spatialAxis = bounds.LongestAxis();
+    float binWidth = (bounds.max[spatialAxis] - bounds.min[spatialAxis]) / SAH_BINS;
+    float spatialCost = std::numeric_limits<float>::infinity();
+    float spatialPosition = 0.0f;
+    AABB spatialLeft, spatialRight;
+    int spatialLeftCount = 0, spatialRightCount = 0;
+    AABB overlap = objectSplit >= 0 ? Clip(objectLeft, objectRight) : bounds;
+    if (depth < MAX_SAH_DEPTH && budget > 0 && binWidth > 0.0f && !overlap.IsEmpty()
+        && overlap.SurfaceArea() > SPATIAL_SPLIT_OVERLAP * build.rootArea) {
+        // each reference is cut at every bin boundary it crosses and the pieces go into their bins
+        SpatialBin bins[SAH_BINS];
+        for (int i = 0; i < count; ++i) {
+            const BuildReference &reference = references[i];
+            int first = std::max(0, std::min(SAH_BINS - 1, (int)((reference.bounds.min[spatialAxis] - bounds.min[spatialAxis]) / binWidth)));
+            int last = std::max(first, std::min(SAH_BINS - 1, (int)((reference.bounds.max[spatialAxis] - bounds.min[spatialAxis]) / binWidth)));
+            BuildReference rest = reference;
+            for (int b = first; b < last; ++b) {
+                BuildReference left, right;
+                build.Split(rest, spatialAxis, bounds.min[spatialAxis] + (b + 1) * binWidth, left, right);
+                bins[b].bounds.Extend(left.bounds);
+                rest = right;
+            }
+            bins[last].bounds.Extend(rest.bounds);
+            bins[first].entries++;
+            bins[last].exits++;
+        }
+
+        AABB leftBounds[SAH_BINS - 1];
+        int leftCount[SAH_BINS - 1];
+        AABB sweep;
+        int sweepCount = 0;
+        for (int b = 0; b < SAH_BINS - 1; ++b) {
+            sweep.Extend(bins[b].bounds);
+            sweepCount += bins[b].entries;
+            leftBounds[b] = sweep;
+            leftCount[b] = sweepCount;
+        }
+        sweep = AABB();
+        sweepCount = 0;
+        for (int b = SAH_BINS - 1; b > 0; --b) {
+            sweep.Extend(bins[b].bounds);
+            sweepCount += bins[b].exits;
+            // every reference counted on both sides is one more than there was
+            size_t duplicates = (size_t)(leftCount[b - 1] + sweepCount - count);
+            if (leftCount[b - 1] == 0 || sweepCount == 0 || duplicates > budget) {
+                continue;
+            }
+            float cost = leftBounds[b - 1].SurfaceArea() * leftCount[b - 1] + sweep.SurfaceArea() * sweepCount;
+            if (cost < spatialCost) {
+                spatialCost = cost;
+                spatialPosition = bounds.min[spatialAxis] + b * binWidth;
+                spatialLeft = leftBounds[b - 1];
+                spatialRight = sweep;
+                spatialLeftCount = leftCount[b - 1];
+                spatialRightCount = sweepCount;
+            }
+        }
+    }
+
+    float bestCost = std::min(objectCost, spatialCost);
+    float parentArea = bounds.SurfaceArea();
+    float splitCost = parentArea > 0.0f ? TRAVERSAL_COST + bestCost / parentArea : TRAVERSAL_COST;
+    if (count <= build.maxLeafSize && (bestCost == std::numeric_limits<float>::infinity() || splitCost >= count)) {
+        MakeLeaf(nodes[nodeIndex], references, 0, count);
+        return;
+    }
+
+    std::vector<BuildReference> left, right;
+    int axis = objectAxis;
+    if (spatialCost < objectCost) {
+        axis = spatialAxis;
+        float leftArea = spatialLeft.SurfaceArea(), rightArea = spatialRight.SurfaceArea();
+        for (int i = 0; i < count; ++i) {
+            const BuildReference &reference = references[i];
+            if (reference.bounds.max[axis] <= spatialPosition) {
+                left.push_back(reference);
+            } else if (reference.bounds.min[axis] >= spatialPosition) {
+                right.push_back(reference);
+            } else {
+                // a reference across the plane is only cut if that is cheaper than moving all of it to one side
+                AABB leftWith = spatialLeft, rightWith = spatialRight;
+                leftWith.Extend(reference.bounds);
+                rightWith.Extend(reference.bounds);
+                float cutCost = leftArea * spatialLeftCount + rightArea * spatialRightCount;
+                float leftOnlyCost = leftWith.SurfaceArea() * spatialLeftCount + rightArea * (spatialRightCount - 1);
+                float rightOnlyCost = leftArea * (spatialLeftCount - 1) + rightWith.SurfaceArea() * spatialRightCount;
+                if (leftOnlyCost < cutCost && leftOnlyCost <= rightOnlyCost) {
+                    left.push_back(reference);
+                } else if (rightOnlyCost < cutCost) {
+                    right.push_back(reference);
+                } else {
+                    BuildReference leftPart, rightPart;
+                    build.Split(reference, axis, spatialPosition, leftPart, rightPart);
+                    if (leftPart.bounds.IsEmpty()) {
+                        right.push_back(reference);
+                    } else if (rightPart.bounds.IsEmpty()) {
+                        left.push_back(reference);
+                    } else {
+                        left.push_back(leftPart);
+                        right.push_back(rightPart);
+                    }
+                }
+            }
+        }
+        if (left.empty() || right.empty()) {
+            // everything ended up on one side after all, split the objects instead
+            left.clear();
+            right.clear();
+            axis = objectAxis;
+        }
+    }
+    if (left.empty()) {
+        if (objectSplit >= 0) {
+            for (int i = 0; i < count; ++i) {
+                int b = std::min(SAH_BINS - 1, (int)((references[i].centroid[axis] - axisMin) * binScale));
+                (b < objectSplit ? left : right).push_back(references[i]);
+            }
+        } else {
+            // no useful split, or too deep for the SAH, so split in the middle to keep the tree within the stack
+            int mid = count / 2;
+            std::nth_element(references.begin(), references.begin() + mid, references.end(),
+                [axis](const BuildReference &a, const BuildReference &b) { return a.centroid[axis] < b.centroid[axis]; });
+            left.assign(references.begin(), references.begin() + mid);
+            right.assign(references.begin() + mid, references.end());
+        }
+    }
+    size_t duplicates = left.size() + right.size() - count;
+    budget -= std::min(budget, duplicates);
+    size_t leftBudget = (size_t)((double)budget * left.size() / (left.size() + right.size()));
+    std::vector<BuildReference>().swap(references);
+
+    // the first child always directly follows its parent
+    BuildSpatialRecursive(left, depth + 1, leftBudget, build);
+    nodes[nodeIndex].offset = (uint32_t)nodes.size();
+    nodes[nodeIndex].count = 0;
+    nodes[nodeIndex].axis = (uint16_t)axis;
+    BuildSpatialRecursive(right, depth + 1, budget - leftBudget, build);
+}
+
+namespace {
+    // primitives up to this many are sorted by 30 bit Morton codes, more than that by 63 bit ones
+    // so that big meshes do not end up with long runs of primitives sharing a code
+    const size_t SHORT_CODE_LIMIT = 1 << 20;
+    // the radix sort places this many bits of the code per pass
+    const int RADIX_BITS = 11;
+    const int RADIX_BUCKETS = 1 << RADIX_BITS;
+    // treelets are grown to this many leaves before the best tree over them is searched for
+    const int TREELET_SIZE = 7;
+    // subtrees with fewer primitives than this are left as they are by the first treelet pass, and
+    // every pass after that doubles it, since the small treelets gain the least and are the most work
+    const uint32_t TREELET_MIN_PRIMITIVES = 32;
+
+    /* Runs work(i) for i in [0, count), on the pool if there is one */
+    void RunChunks(ThreadPool *pool, int count, const std::function<void(int)> &work) {
+        if (pool && count > 1) {
+            pool->ParallelFor(count, work);
+        } else {
+            for (int i = 0; i < count; ++i) {
+                work(i);
+            }
+        }
+    }
+
+    /* Spreads the low 21 bits of value out so there are two zero bits between each of them */
+    uint64_t SpreadBits(uint64_t value) {
+        value &= 0x1fffff;
+        value = (value | value << 32) & 0x1f00000000ffffULL;
+        value = (value | value << 16) & 0x1f0000ff0000ffULL;
+        value = (value | value << 8) & 0x100f00f00f00f00fULL;
+        value = (value | value << 4) & 0x10c30c30c30c30c3ULL;
+        value = (value | value << 2) & 0x1249249249249249ULL;
+        return value;
+    }
+
+    int LeadingZeros(uint64_t value) {
+#if defined(__GNUC__)
+        return value == 0 ? 64 : __builtin_clzll(value);
+#else
+        int zeros = 0;
+        for (uint64_t bit = 1ULL << 63; bit && !(value & bit); bit >>= 1) {
+            ++zeros;
+        }
+        return zeros;
+#endif
+    }
+
+    /*
+    ** Sorts keys, and values along with them, by the low bits of the keys. Each pass is a counting
+    ** sort of one digit: every chunk counts its digits, the counts give every chunk its own place to
+    ** write each digit to, and the chunks scatter into those places, so the sort stays stable.
+    */
+    void RadixSort(std::vector<uint64_t> &keys, std::vector<uint32_t> &values, int bits, ThreadPool *pool) {
+        size_t count = keys.size();
+        int numChunks = pool ? (int)std::min<size_t>(pool->NumThreads() * 4, count / 4096 + 1) : 1;
+        std::vector<uint64_t> keyBuffer(count);
+        std::vector<uint32_t> valueBuffer(count);
+        std::vector<size_t> offsets((size_t)numChunks * RADIX_BUCKETS);
+        for (int shift = 0; shift < bits; shift += RADIX_BITS) {
+            RunChunks(pool, numChunks, [&](int chunk) {
+                size_t *chunkOffsets = &offsets[(size_t)chunk * RADIX_BUCKETS];
+                std::fill(chunkOffsets, chunkOffsets + RADIX_BUCKETS, 0);
+                for (size_t i = count * chunk / numChunks; i < count * (chunk + 1) / numChunks; ++i) {
+                    chunkOffsets[(keys[i] >> shift) & (RADIX_BUCKETS - 1)]++;
+                }
+            });
+            size_t total = 0;
+            for (int digit = 0; digit < RADIX_BUCKETS; ++digit) {
+                for (int chunk = 0; chunk < numChunks; ++chunk) {
+                    size_t digitCount = offsets[(size_t)chunk * RADIX_BUCKETS + digit];
+                    offsets[(size_t)chunk * RADIX_BUCKETS + digit] = total;
+                    total += digitCount;
+                }
+            }
+            RunChunks(pool, numChunks, [&](int chunk) {
+                size_t *chunkOffsets = &offsets[(size_t)chunk * RADIX_BUCKETS];
+                for (size_t i = count * chunk / numChunks; i < count * (chunk + 1) / numChunks; ++i) {
+                    size_t to = chunkOffsets[(keys[i] >> shift) & (RADIX_BUCKETS - 1)]++;
+                    keyBuffer[to] = keys[i];
+                    valueBuffer[to] = values[i];
+                }
+            });
+            keys.swap(keyBuffer);
+            values.swap(valueBuffer);
+        }
+    }
+
+    /*
+    ** The tree of a linear BVH while it is being built. Every interior node splits the sorted
+    ** primitives between two neighbours s and s + 1, and no two nodes split in the same place, so the
+    ** node splitting at s is stored at nodes[s] and any subtree can be built without knowing where
+    ** the rest of the tree goes. A leaf is referred to as firstLeaf plus its first sorted primitive.
+    ** The tree is written out in the usual layout once it is finished.
+    */
+    class LinearBuilder {
+      public:
+        LinearBuilder(const std::vector<AABB> &primitiveBounds, int maxLeafSize, ThreadPool *pool);
+
+        /* Sorts the primitives and builds the tree over them, returning the root */
+        uint32_t Build();
+        /* One round of treelet reoptimization over the subtrees with at least minPrimitives primitives */
+        void Optimize(uint32_t root, uint32_t minPrimitives);
+        /* Writes the finished tree out as BVHNodes and the index list they refer to */
+        void Write(uint32_t root, std::vector<BVHNode> &out, std::vector<uint32_t> &outIndices);
+
+      private:
+        struct Node {
+            AABB bounds;
+            uint32_t left, right;
+            uint32_t primitives;    // number of primitives below the node
+            uint32_t size;          // number of nodes in the subtree, counting this one
+            uint32_t height;        // number of nodes on the longest path down to a leaf
+            float cost;             // SAH cost of the subtree
+        };
+
+        struct Task {
+            uint32_t node;
+            uint32_t first, last;   // Build: the range of primitives below the node, Write: first is where it goes
+            int depth;
+        };
+
+        const std::vector<AABB> &primitiveBounds;
+        int maxLeafSize;
+        ThreadPool *pool;
+        // subtrees starting this deep are handed to the pool, the nodes above them are done in order
+        int parallelDepth;
+        uint32_t treeletMinPrimitives;
+
+        std::vector<uint64_t> codes;
+        std::vector<uint32_t> order;        // the primitives sorted by code
+        std::vector<uint16_t> leafCounts;   // indexed by the first primitive of each leaf
+        std::vector<Node> nodes;
+        uint32_t firstLeaf;
+
+        bool IsLeaf(uint32_t node) const { return node >= firstLeaf; }
+        AABB Bounds(uint32_t node) const;
+        float Cost(uint32_t node) const;
+        uint32_t Primitives(uint32_t node) const { return IsLeaf(node) ? leafCounts[node - firstLeaf] : nodes[node].primitives; }
+        uint32_t Size(uint32_t node) const { return IsLeaf(node) ? 1 : nodes[node].size; }
+        uint32_t Height(uint32_t node) const { return IsLeaf(node) ? 1 : nodes[node].height; }
+
+        void SortPrimitives();
+        int FindSplit(uint32_t first, uint32_t last) const;
+        uint32_t BuildRange(uint32_t first, uint32_t last, int depth, std::vector<Task> *tasks, std::vector<uint32_t> *above);
+        void Finish(uint32_t node);
+        void OptimizeSubtree(uint32_t node, int depth, std::vector<Task> *tasks, std::vector<Task> *above);
+        void OptimizeTreelet(uint32_t root, int depth);
+        void WriteSubtree(uint32_t node, uint32_t position, int depth, BVHNode *out, std::vector<Task> *tasks) const;
+    };
+
+    LinearBuilder::LinearBuilder(const std::vector<AABB> &primitiveBounds, int maxLeafSize, ThreadPool *pool):
+        primitiveBounds(primitiveBounds),
+        maxLeafSize(maxLeafSize),
+        pool(pool),
+        parallelDepth(0),
+        treeletMinPrimitives(0),
+        firstLeaf((uint32_t)primitiveBounds.size() - 1)
+    {
+        // enough subtrees for every thread to have a few to balance out the uneven ones
+        if (pool && pool->NumThreads() > 1) {
+            while ((1 << parallelDepth) < pool->NumThreads() * 8) {
+                ++parallelDepth;
+            }
+        }
+    }
+
+    AABB LinearBuilder::Bounds(uint32_t node) const {
+        if (!IsLeaf(node)) {
+            return nodes[node].bounds;
+        }
+        AABB box;
+        uint32_t first = node - firstLeaf;
+        for (uint32_t i = first; i < first + leafCounts[first]; ++i) {
+            box.Extend(primitiveBounds[order[i]]);
+        }
+        return box;
+    }
+
+    float LinearBuilder::Cost(uint32_t node) const {
+        if (!IsLeaf(node)) {
+            return nodes[node].cost;
+        }
+        return Bounds(node).SurfaceArea() * leafCounts[node - firstLeaf];
+    }
+
+    void LinearBuilder::SortPrimitives() {
+        size_t count = primitiveBounds.size();
+        int numChunks = pool ? (int)std::min<size_t>(pool->NumThreads() * 4, count / 4096 + 1) : 1;
+        std::vector<AABB> chunkBounds(numChunks);
+        RunChunks(pool, numChunks, [&](int chunk) {
+            for (size_t i = count * chunk / numChunks; i < count * (chunk + 1) / numChunks; ++i) {
+                chunkBounds[chunk].Extend(primitiveBounds[i].Centroid());
+            }
+        });
+        AABB centroidBounds;
+        for (int chunk = 0; chunk < numChunks; ++chunk) {
+            centroidBounds.Extend(chunkBounds[chunk]);
+        }
+
+        int bitsPerAxis = count <= SHORT_CODE_LIMIT ? 10 : 21;
+        float cells = (float)(1 << bitsPerAxis);
+        glm::vec3 extent = centroidBounds.max - centroidBounds.min;
+        glm::vec3 scale;
+        for (int axis = 0; axis < 3; ++axis) {
+            scale[axis] = extent[axis] > 0.0f ? cells / extent[axis] : 0.0f;
+        }
+        codes.resize(count);
+        order.resize(count);
+        RunChunks(pool, numChunks, [&](int chunk) {
+            for (size_t i = count * chunk / numChunks; i < count * (chunk + 1) / numChunks; ++i) {
+                glm::vec3 cell = (primitiveBounds[i].Centroid() - centroidBounds.min) * scale;
+                uint64_t x = (uint64_t)std::min(cell.x, cells - 1.0f);
+                uint64_t y = (uint64_t)std::min(cell.y, cells - 1.0f);
+                uint64_t z = (uint64_t)std::min(cell.z, cells - 1.0f);
+                codes[i] = SpreadBits(x) << 2 | SpreadBits(y) << 1 | SpreadBits(z);
+                order[i] = (uint32_t)i;
+            }
+        });
+        RadixSort(codes, order, 3 * bitsPerAxis, pool);
+    }
+
+    /*
+    ** Finds where to split the sorted primitives first to last: after the last one that shares more
+    ** leading bits with the first than the last does. Runs of equal codes are split in the middle.
+    */
+    int LinearBuilder::FindSplit(uint32_t first, uint32_t last) const {
+        uint64_t firstCode = codes[first];
+        uint64_t lastCode = codes[last];
+        if (firstCode == lastCode) {
+            return (int)((first + last) / 2);
+        }
+        int commonBits = LeadingZeros(firstCode ^ lastCode);
+        uint32_t split = first;
+        uint32_t step = last - first;
+        do {
+            step = (step + 1) / 2;
+            uint32_t next = split + step;
+            if (next < last && LeadingZeros(firstCode ^ codes[next]) > commonBits) {
+                split = next;
+            }
+        } while (step > 1);
+        return (int)split;
+    }
+
+    /*
+    ** Builds the subtree over the sorted primitives first to last and returns it. Given tasks, the
+    ** subtrees starting at parallelDepth are only queued there and the nodes above them are added to
+    ** above instead of being finished, children before parents.
+    */
+    uint32_t LinearBuilder::BuildRange(uint32_t first, uint32_t last, int depth, std::vector<Task> *tasks, std::vector<uint32_t> *above) {
+        if ((int)(last - first) < maxLeafSize) {
+            leafCounts[first] = (uint16_t)(last - first + 1);
+            return firstLeaf + first;
+        }
+        uint32_t split = (uint32_t)FindSplit(first, last);
+        if (tasks && depth == parallelDepth) {
+            Task task = { split, first, last, depth };
+            tasks->push_back(task);
+            return split;
+        }
+        nodes[split].left = BuildRange(first, split, depth + 1, tasks, above);
+        nodes[split].right = BuildRange(split + 1, last, depth + 1, tasks, above);
+        if (above) {
+            above->push_back(split);
+        } else {
+            Finish(split);
+        }
+        return split;
+    }
+
+    /* Works out everything kept about a node from its children */
+    void LinearBuilder::Finish(uint32_t node) {
+        Node &n = nodes[node];
+        n.bounds = Bounds(n.left);
+        n.bounds.Extend(Bounds(n.right));
+        n.primitives = Primitives(n.left) + Primitives(n.right);
+        n.size = 1 + Size(n.left) + Size(n.right);
+        n.height = 1 + std::max(Height(n.left), Height(n.right));
+        n.cost = TRAVERSAL_COST * n.bounds.SurfaceArea() + Cost(n.left) + Cost(n.right);
+    }
+
+    uint32_t LinearBuilder::Build() {
+        SortPrimitives();
+        size_t count = primitiveBounds.size();
+        nodes.resize(count - 1);
+        leafCounts.resize(count);
+
+        std::vector<Task> tasks;
+        std::vector<uint32_t> above;
+        uint32_t root = BuildRange(0, (uint32_t)count - 1, 0, &tasks, &above);
+        RunChunks(pool, (int)tasks.size(), [&](int i) {
+            BuildRange(tasks[i].first, tasks[i].last, tasks[i].depth, NULL, NULL);
+        });
+        for (size_t i = 0; i < above.size(); ++i) {
+            Finish(above[i]);
+        }
+        return root;
+    }
+
+    /* Visits the subtree children first, queueing and collecting the nodes the same way as BuildRange */
+    void LinearBuilder::OptimizeSubtree(uint32_t node, int depth, std::vector<Task> *tasks, std::vector<Task> *above) {
+        if (IsLeaf(node)) {
+            return;
+        }
+        Task task = { node, 0, 0, depth };
+        if (tasks && depth == parallelDepth) {
+            tasks->push_back(task);
+            return;
+        }
+        // a treelet only ever rearranges nodes below its root, so the right child is still the
+        // right child once the left one has been optimized
+        uint32_t right = nodes[node].right;
+        OptimizeSubtree(nodes[node].left, depth + 1, tasks, above);
+        OptimizeSubtree(right, depth + 1, tasks, above);
+        if (above) {
+            above->push_back(task);
+        } else {
+            // the children's height and cost may have changed, and the treelet goes by both
+            Finish(node);
+            OptimizeTreelet(node, depth);
+        }
+    }
+
+    void LinearBuilder::Optimize(uint32_t root, uint32_t minPrimitives) {
+        treeletMinPrimitives = minPrimitives;
+        std::vector<Task> tasks, above;
+        OptimizeSubtree(root, 0, &tasks, &above);
+        RunChunks(pool, (int)tasks.size(), [&](int i) {
+            OptimizeSubtree(tasks[i].node, tasks[i].depth, NULL, NULL);
+        });
+        for (size_t i = 0; i < above.size(); ++i) {
+            Finish(above[i].node);
+            OptimizeTreelet(above[i].node, above[i].depth);
+        }
+    }
+
+    /*
+    ** Treelet reoptimization: the treelet is grown from root by opening up the child with the
+    ** biggest box until it has TREELET_SIZE leaves, then the tree over those leaves with the lowest
+    ** SAH cost is found by trying every way of splitting every subset of them in two, and it replaces
+    ** the treelet if it is cheaper. The treelet's own interior nodes are reused for the new tree.
+    */
+    void LinearBuilder::OptimizeTreelet(uint32_t root, int depth) {
+        if (nodes[root].primitives < treeletMinPrimitives) {
+            return;
+        }
+        uint32_t leaves[TREELET_SIZE];
+        uint32_t interior[TREELET_SIZE - 1];
+        int numLeaves = 0, numInterior = 0;
+        interior[numInterior++] = root;
+        leaves[numLeaves++] = nodes[root].left;
+        leaves[numLeaves++] = nodes[root].right;
+        while (numLeaves < TREELET_SIZE) {
+            int biggest = -1;
+            float biggestArea = -1.0f;
+            for (int i = 0; i < numLeaves; ++i) {
+                if (!IsLeaf(leaves[i]) && nodes[leaves[i]].bounds.SurfaceArea() > biggestArea) {
+                    biggest = i;
+                    biggestArea = nodes[leaves[i]].bounds.SurfaceArea();
+                }
+            }
+            if (biggest < 0) {
+                break;
+            }
+            uint32_t opened = leaves[biggest];
+            interior[numInterior++] = opened;
+            leaves[biggest] = nodes[opened].left;
+            leaves[numLeaves++] = nodes[opened].right;
+        }
+        if (numLeaves < 3) {
+            return;
+        }
+
+        // subsets of the leaves are bit masks, a subset is always bigger than any subset of it
+        const int SUBSETS = 1 << TREELET_SIZE;
+        int all = (1 << numLeaves) - 1;
+        AABB bounds[SUBSETS];
+        float cost[SUBSETS];
+        uint32_t height[SUBSETS];
+        int partition[SUBSETS];
+        for (int subset = 1; subset <= all; ++subset) {
+            int lowest = subset & -subset;
+            if (subset == lowest) {
+                int leaf = 0;
+                while ((1 << leaf) != subset) {
+                    ++leaf;
+                }
+                bounds[subset] = Bounds(leaves[leaf]);
+                cost[subset] = Cost(leaves[leaf]);
+                height[subset] = Height(leaves[leaf]);
+                partition[subset] = 0;
+                continue;
+            }
+            bounds[subset] = bounds[subset & (subset - 1)];
+            bounds[subset].Extend(bounds[lowest]);
+            // every split in two, counted once by keeping the lowest leaf on the left
+            float bestCost = std::numeric_limits<float>::infinity();
+            for (int left = (subset - 1) & subset; left; left = (left - 1) & subset) {
+                if ((left & lowest) && cost[left] + cost[subset ^ left] < bestCost) {
+                    bestCost = cost[left] + cost[subset ^ left];
+                    partition[subset] = left;
+                }
+            }
+            cost[subset] = TRAVERSAL_COST * bounds[subset].SurfaceArea() + bestCost;
+            height[subset] = 1 + std::max(height[partition[subset]], height[subset ^ partition[subset]]);
+        }
+        // only take clear improvements, and never let the tree outgrow the traversal stack
+        if (cost[all] >= nodes[root].cost * 0.9999f || depth + height[all] > (uint32_t)BVH::STACK_SIZE) {
+            return;
+        }
+
+        // hand the interior nodes out again from the root down, then finish them from the bottom up
+        int stackSubset[TREELET_SIZE];
+        uint32_t stackNode[TREELET_SIZE];
+        uint32_t visited[TREELET_SIZE - 1];
+        int stackSize = 0, numVisited = 0, used = 1;
+        stackSubset[stackSize] = all;
+        stackNode[stackSize++] = root;
+        while (stackSize > 0) {
+            --stackSize;
+            int subset = stackSubset[stackSize];
+            uint32_t node = stackNode[stackSize];
+            visited[numVisited++] = node;
+            int halves[2] = { partition[subset], subset ^ partition[subset] };
+            uint32_t children[2];
+            for (int side = 0; side < 2; ++side) {
+                if ((halves[side] & (halves[side] - 1)) == 0) {
+                    int leaf = 0;
+                    while ((1 << leaf) != halves[side]) {
+                        ++leaf;
+                    }
+                    children[side] = leaves[leaf];
+                } else {
+                    children[side] = interior[used++];
+                    stackSubset[stackSize] = halves[side];
+                    stackNode[stackSize++] = children[side];
+                }
+            }
+            nodes[node].left = children[0];
+            nodes[node].right = children[1];
+        }
+        for (int i = numVisited - 1; i >= 0; --i) {
+            Finish(visited[i]);
+        }
+    }
+
+    /*
+    ** Writes the subtree with its root at out[position] and its first child straight after, the
+    ** same layout the SAH builder makes. Given tasks, subtrees at parallelDepth are only queued.
+    */
+    void LinearBuilder::WriteSubtree(uint32_t node, uint32_t position, int depth, BVHNode *out, std::vector<Task> *tasks) const {
+        BVHNode &written = out[position];
+        if (IsLeaf(node)) {
+            written.bounds = Bounds(node);
+            written.offset = node - firstLeaf;
+            written.count = leafCounts[node - firstLeaf];
+            written.axis = 0;
+            return;
+        }
+        if (tasks && depth == parallelDepth) {
+            Task task = { node, position, 0, depth };
+            tasks->push_back(task);
+            return;
+        }
+        // the traversals visit the first child first when the ray heads along the positive axis, so
+        // take the axis the children are furthest apart on and put the lower child first
+        uint32_t left = nodes[node].left, right = nodes[node].right;
+        glm::vec3 apart = Bounds(right).Centroid() - Bounds(left).Centroid();
+        int axis = 0;
+        for (int i = 1; i < 3; ++i) {
+            if (std::abs(apart[i]) > std::abs(apart[axis])) {
+                axis = i;
+            }
+        }
+        if (apart[axis] < 0.0f) {
+            std::swap(left, right);
+        }
+        written.bounds = nodes[node].bounds;
+        written.offset = position + 1 + Size(left);
+        written.count = 0;
+        written.axis = (uint16_t)axis;
+        WriteSubtree(left, position + 1, depth + 1, out, tasks);
+        WriteSubtree(right, written.offset, depth + 1, out, tasks);
+    }
+
+    void LinearBuilder::Write(uint32_t root, std::vector<BVHNode> &out, std::vector<uint32_t> &outIndices) {
+        out.resize(Size(root));
+        std::vector<Task> tasks;
+        WriteSubtree(root, 0, 0, &out[0], &tasks);
+        RunChunks(pool, (int)tasks.size(), [&](int i) {
+            WriteSubtree(tasks[i].node, tasks[i].first, tasks[i].depth, &out[0], NULL);
+        });
+        // the leaves refer to ranges of the sorted primitives
+        outIndices.swap(order);
+    }
+}
+
+void BVH::BuildLinear(const std::vector<AABB> &primitiveBounds, int maxLeafSize, ThreadPool *pool, int treeletPasses) {
+    nodes.clear();
+    indices.clear();
+    wideNodes.clear();
+    wideOf.clear();
+    refitNodes.clear();
+    primitiveLeaf.clear();
+    leafSize = maxLeafSize;
+    UseOwnNodes();
+    if (primitiveBounds.empty()) {
+        return;
+    }
+
+    LinearBuilder builder(primitiveBounds, std::max(1, std::min(maxLeafSize, 0xffff)), pool);
+    uint32_t root = builder.Build();
+    for (int pass = 0; pass < treeletPasses; ++pass) {
+        builder.Optimize(root, TREELET_MIN_PRIMITIVES << std::min(pass, 20));
+    }
+    builder.Write(root, nodes, indices);
+    UseOwnNodes();
+    if (buildWideNodes) {
+        Widen();
+    }
+}
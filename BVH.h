@@ -0,0 +1,769 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <stdint.h>
+
+#include "AABB.h"
+#include "Ray.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define BVH_USE_SSE
+#endif
+
+class ThreadPool;
+
+// A node of the flattened hierarchy. The first child of an interior node is always stored
+// directly after it, so only the index of the second child needs to be kept.
+struct BVHNode {
+    AABB bounds;
+    uint32_t offset;    // leaf: first entry in BVH::indices, interior: index of the second child
+    uint16_t count;     // number of primitives in a leaf, 0 for an interior node
+    uint16_t axis;      // split axis of an interior node, used to visit the nearer child first
+};
+
+/*
+** A node of the four wide hierarchy the binary nodes can be collapsed into, one 64 byte cache line.
+** The boxes of the children are stored as a structure of arrays so one SIMD slab test checks all of
+** them, and each side of each box is quantized to 8 bits: a child's box on an axis runs from
+** origin + low * 2^exponent to origin + high * 2^exponent, rounded outwards so it always contains
+** the child's real box.
+*/
+struct WideBVHNode {
+    static const int WIDTH = 4;
+
+    float origin[3];
+    int8_t exponent[3];
+    uint8_t numChildren;
+    uint8_t lowX[WIDTH], lowY[WIDTH], lowZ[WIDTH];
+    uint8_t highX[WIDTH], highY[WIDTH], highZ[WIDTH];
+    uint32_t child[WIDTH];    // leaf: first entry in BVH::indices, interior: index of the child's wide node
+    uint16_t count[WIDTH];    // number of primitives in a leaf, 0 for an interior child
+};
+
+/*
+** Bounding volume hierarchy built with the surface area heuristic.
+** The BVH only knows about the bounding boxes of the primitives it was built from, the actual
+** intersection test is done by the caller through the function given to Intersect(), which is
+** called with the index of each primitive in the leaves the ray reaches.
+*/
+class BVH {
+  public:
+    static const int STACK_SIZE = 128;
+
+    BVH();
+    BVH(const BVH &other);
+    BVH &operator =(const BVH &other);
+
+    /* Builds the hierarchy, primitiveBounds[i] is the bounding box of primitive i */
+    void Build(const std::vector<AABB> &primitiveBounds, int maxLeafSize = 4);
+
+    /*
+    ** Builds a linear BVH instead: the primitives are sorted by the Morton codes of their centroids
+    ** and the tree is cut out of the sorted list wherever the codes first differ, with every step
+    ** shared out over pool when there is one. It builds many times faster than the SAH tree but
+    ** traces slower, and each of the treeletPasses rounds of treelet reoptimization afterwards wins
+    ** back part of the difference.
+    */
+    void BuildLinear(const std::vector<AABB> &primitiveBounds, int maxLeafSize = 4, ThreadPool *pool = NULL, int treeletPasses = 0);
+
+    /*
+    ** Brings the hierarchy up to date after the primitives listed in changed have moved, with
+    ** primitiveBounds holding the current box of every primitive. The boxes from each changed
+    ** primitive's leaf up to the root are refitted, which only touches the nodes above what moved.
+    ** Refitting never changes the shape of the tree though, so any subtree whose SAH cost has
+    ** grown past rebuildThreshold times its cost when it was built is built again in the space it
+    ** takes up. Needs the index list, and falls back to building everything again for nodes kept
+    ** somewhere else. A widened tree only has the wide nodes above what moved or was rebuilt redone.
+    */
+    void Update(const std::vector<AABB> &primitiveBounds, const std::vector<uint32_t> &changed, float rebuildThreshold = 1.5f);
+
+    /*
+    ** Cuts a primitive in two for a spatial split: given box, the part of primitive index that the
+    ** node being split holds, sets left and right to the boxes around what is on either side of
+    ** position along axis. The results are clipped to box and to their side of the plane afterwards.
+    */
+    typedef std::function<void(uint32_t index, const AABB &box, int axis, float position, AABB &left, AABB &right)> SplitFunction;
+
+    /*
+    ** Builds a spatial split BVH (SBVH), slower to build than Build() but quicker to trace where
+    ** big primitives lie next to small ones. Besides splitting the primitives into two groups, a
+    ** node may split space, with each primitive that crosses the plane going into both children
+    ** and only the part of it on that side counting towards the child's box, so long thin triangles
+    ** no longer make the boxes of their neighbours overlap. splitPrimitive cuts the primitives
+    ** exactly, without it their boxes are cut. At most duplicationBudget times as many references
+    ** again as there are primitives are made, and since a leaf can list a primitive that other leaves
+    ** list as well the index list can be longer than the number of primitives.
+    */
+    void BuildSpatial(const std::vector<AABB> &primitiveBounds, const SplitFunction &splitPrimitive = SplitFunction(),
+                      int maxLeafSize = 4, float duplicationBudget = 0.5f);
+
+    // When set, Build() makes a linear BVH on buildPool with treeletPasses rounds of reoptimization, set by -b lbvh
+    static bool buildLinear;
+    static int treeletPasses;
+    static ThreadPool *buildPool;
+
+    /*
+    ** Frees the index list, for callers that have sorted their primitives into leaf order so the
+    ** leaves refer to them directly. Only the Leaves traversals can be used after this.
+    */
+    void DropIndices();
+
+    /*
+    ** Traverses count nodes kept somewhere else, such as in a mapped scene cache, instead of
+    ** building them, along with the index list their leaves refer to. The memory has to outlive
+    ** the BVH. Without an index list only the Leaves traversals can be used.
+    */
+    void UseNodes(const BVHNode *data, size_t count, const uint32_t *indexList = NULL);
+
+    /*
+    ** Collapses the binary nodes into a four wide hierarchy with quantized boxes, which the single ray
+    ** traversals walk from then on: each node fetched holds four children in one cache line and the
+    ** wide nodes take about half the memory of the binary ones. The binary nodes are kept,
+    ** the packet traversals still walk them since a packet already shares each node it fetches
+    ** between its rays, and the scene cache stores them.
+    */
+    void Widen();
+    bool IsWide() const { return !wideNodes.empty(); }
+
+    // When set, every BVH is widened as soon as it is built or given its nodes, set by -a wide
+    static bool buildWideNodes;
+
+    bool Empty() const { return numNodes == 0; }
+    AABB Bounds() const { return numNodes == 0 ? AABB() : nodeData[0].bounds; }
+
+    /* The nodes and indices the traversals use, either the built ones or the ones given to UseNodes() */
+    const BVHNode *NodeData() const { return nodeData; }
+    size_t NumNodes() const { return numNodes; }
+    const uint32_t *IndexData() const { return indexData; }
+
+    /*
+    ** Finds the closest hit. intersectPrimitive(index, tMax) must test the primitive and return true
+    ** if it was hit closer than tMax, in which case it also lowers tMax to the new hit time so the
+    ** remaining nodes further away can be skipped.
+    */
+    template<typename PrimitiveFunction>
+    bool Intersect(const Ray &ray, float &tMax, PrimitiveFunction intersectPrimitive) const;
+
+    /*
+    ** Any hit query for shadow rays. occludedPrimitive(index, tMax) returns true if the primitive
+    ** blocks the ray before tMax, the traversal stops at the first one that does.
+    */
+    template<typename PrimitiveFunction>
+    bool Occluded(const Ray &ray, float tMax, PrimitiveFunction occludedPrimitive) const;
+
+    /*
+    ** The same two traversals, but the function is called once per leaf with the leaf node, for
+    ** callers that keep their primitives in BVH order and test a whole leaf at once.
+    */
+    template<typename LeafFunction>
+    bool IntersectLeaves(const Ray &ray, float &tMax, LeafFunction intersectLeaf) const;
+    template<typename LeafFunction>
+    bool OccludedLeaves(const Ray &ray, float tMax, LeafFunction occludedLeaf) const;
+
+    /*
+    ** Packet versions of the traversals, for the rays of a RayPacket whose bits are set in mask.
+    ** tMax[lane] is each ray's own closest hit so far. The rays walk the tree together: a node is
+    ** skipped for the whole packet when the range of rays in it cannot reach the node's box, and
+    ** otherwise visited as long as any of the rays still reaches it. The function is called with a
+    ** leaf and the mask of the rays that reach its box, and intersectLeaf(leaf, lanes) lowers tMax
+    ** for the rays it hits. Packets whose rays go different ways fall back to one ray at a time.
+    ** Packets always walk the binary nodes, even once the BVH has been widened.
+    */
+    template<typename LeafFunction>
+    void IntersectPacketLeaves(const RayPacket &packet, float *tMax, uint32_t mask, LeafFunction intersectLeaf) const;
+    /*
+    ** occludedLeaf(leaf, lanes) returns the mask of the rays it found blocked, which take no further
+    ** part in the traversal. Returns the mask of every ray that was blocked.
+    */
+    template<typename LeafFunction>
+    uint32_t OccludedPacketLeaves(const RayPacket &packet, const float *tMax, uint32_t mask, LeafFunction occludedLeaf) const;
+    /* The same, called once per primitive of each leaf, as intersectPrimitive(index, lanes) */
+    template<typename PrimitiveFunction>
+    void IntersectPacket(const RayPacket &packet, float *tMax, uint32_t mask, PrimitiveFunction intersectPrimitive) const;
+    template<typename PrimitiveFunction>
+    uint32_t OccludedPacket(const RayPacket &packet, const float *tMax, uint32_t mask, PrimitiveFunction occludedPrimitive) const;
+
+    std::vector<BVHNode> nodes;
+    // primitive indices referenced by the leaves, each leaf owns a contiguous range
+    std::vector<uint32_t> indices;
+    // the four wide hierarchy made by Widen(), empty until then
+    std::vector<WideBVHNode> wideNodes;
+
+  private:
+    const BVHNode *nodeData;
+    size_t numNodes;
+    const uint32_t *indexData;
+
+    // points the traversals back at the nodes and indices vectors, after building or copying
+    void UseOwnNodes();
+
+    // the leaf size the nodes were built with, which rebuilt subtrees keep to
+    int leafSize;
+
+    // what Update() keeps about each node, worked out the first time it is called after a build
+    struct RefitNode {
+        uint32_t parent;
+        float cost;         // SAH cost of the subtree
+        float builtCost;    // and what it was when the subtree was built
+        uint32_t mark;      // the Update() that last refitted the node
+    };
+    std::vector<RefitNode> refitNodes;
+    std::vector<uint32_t> primitiveLeaf;    // the leaf each primitive is in
+    uint32_t refitMark;
+    // the wide node made for each binary node by Widen(), or NO_NODE for the ones opened up into
+    // their parent's wide node, so Update() can bring just the wide nodes above what moved up to date
+    std::vector<uint32_t> wideOf;
+    // wide nodes nothing points at any more since parts of the tree were widened again
+    size_t unusedWideNodes;
+
+    void PrepareRefit(size_t numPrimitives);
+    void PrepareRefitSubtree(uint32_t root);
+    void RefitNodeBounds(uint32_t node, const std::vector<AABB> &primitiveBounds);
+    float NodeCost(uint32_t node) const;
+    uint32_t SubtreeEnd(uint32_t node) const;
+    bool RebuildSubtree(uint32_t root, const std::vector<AABB> &primitiveBounds);
+
+    struct BuildReference {
+        AABB bounds;
+        glm::vec3 centroid;
+        uint32_t index;
+    };
+
+    void BuildRecursive(std::vector<BuildReference> &references, int begin, int end, int depth, int maxLeafSize);
+    void MakeLeaf(BVHNode &node, std::vector<BuildReference> &references, int begin, int end);
+
+    struct SpatialBuild;
+    void BuildSpatialRecursive(std::vector<BuildReference> &references, int depth, size_t budget, SpatialBuild &build);
+
+    struct PacketStackEntry {
+        uint32_t node;
+        // the rays before this one in the packet were already found to miss the node's parent
+        int first;
+    };
+
+    uint32_t WidenRecursive(uint32_t binaryIndex);
+    void QuantizeWideNode(uint32_t binaryIndex, const uint32_t *children, int numChildren, WideBVHNode &wide) const;
+    void RefitWideNode(uint32_t binaryIndex);
+    void UpdateWideNodes(const std::vector<uint32_t> &touched, std::vector<uint32_t> &rebuilt);
+
+    // a child of a wide node waiting on the stack, with the time the ray enters its box
+    struct WideStackEntry {
+        uint32_t child;
+        uint32_t count;
+        float tEnter;
+    };
+    // every wide node visited can leave three more children on the stack than it takes off
+    static const int WIDE_STACK_SIZE = 4 * STACK_SIZE;
+
+    template<typename LeafFunction>
+    bool IntersectLeavesWide(const Ray &ray, float &tMax, LeafFunction intersectLeaf) const;
+    template<typename LeafFunction>
+    bool OccludedLeavesWide(const Ray &ray, float tMax, LeafFunction occludedLeaf) const;
+    static uint32_t WideHitMask(const WideBVHNode &node, const glm::vec3 &origin, const glm::vec3 &invDirection,
+                                const bool *directionIsNegative, float tMax, float *tEnter);
+    static BVHNode WideLeaf(uint32_t offset, uint32_t count);
+
+    static bool PacketMayHit(const AABB &box, const RayPacket &packet, float maxTime);
+    static uint32_t PacketHitMask(const AABB &box, const RayPacket &packet, const float *tMax, int first, uint32_t mask, bool stopAtFirst);
+};
+
+/*
+** Interval arithmetic culling for a coherent packet: the time each ray enters and leaves the box's
+** slabs is bounded using the range of origins and reciprocal directions in the packet. Returns false
+** only if no ray of the packet can hit the box before maxTime.
+*/
+inline bool BVH::PacketMayHit(const AABB &box, const RayPacket &packet, float maxTime) {
+    float tEnter = 0.0f;
+    float tExit = maxTime;
+    for (int axis = 0; axis < 3; ++axis) {
+        float invMin = packet.invDirectionMin[axis], invMax = packet.invDirectionMax[axis];
+        // the ranges of (slab - origin) / direction for the near and far slab over the whole packet
+        float nearSlab = packet.directionIsNegative[axis] ? box.max[axis] : box.min[axis];
+        float farSlab = packet.directionIsNegative[axis] ? box.min[axis] : box.max[axis];
+        float nearLow = nearSlab - packet.originMax[axis], nearHigh = nearSlab - packet.originMin[axis];
+        float farLow = farSlab - packet.originMax[axis], farHigh = farSlab - packet.originMin[axis];
+        float nearTimes[4] = { nearLow * invMin, nearLow * invMax, nearHigh * invMin, nearHigh * invMax };
+        float farTimes[4] = { farLow * invMin, farLow * invMax, farHigh * invMin, farHigh * invMax };
+        float earliestNear = std::min(std::min(nearTimes[0], nearTimes[1]), std::min(nearTimes[2], nearTimes[3]));
+        float latestFar = std::max(std::max(farTimes[0], farTimes[1]), std::max(farTimes[2], farTimes[3]));
+        // the same padding as AABB::IntersectRay, so this never culls a box one of the rays would hit
+        latestFar *= 1.0f + 1e-6f;
+        tEnter = earliestNear > tEnter ? earliestNear : tEnter;
+        tExit = latestFar < tExit ? latestFar : tExit;
+        if (tEnter > tExit) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+** The slab test of AABB::IntersectRay for each ray of the packet from first on that is in mask,
+** four at a time with SSE. With stopAtFirst it returns as soon as a group of four has a hit.
+*/
+inline uint32_t BVH::PacketHitMask(const AABB &box, const RayPacket &packet, const float *tMax, int first, uint32_t mask, bool stopAtFirst) {
+    mask &= ~((1u << first) - 1);
+    uint32_t hits = 0;
+#ifdef BVH_USE_SSE
+    __m128 minX = _mm_set1_ps(box.min.x), minY = _mm_set1_ps(box.min.y), minZ = _mm_set1_ps(box.min.z);
+    __m128 maxX = _mm_set1_ps(box.max.x), maxY = _mm_set1_ps(box.max.y), maxZ = _mm_set1_ps(box.max.z);
+    __m128 pad = _mm_set1_ps(1.0f + 1e-6f), zero = _mm_setzero_ps();
+    for (int group = first & ~3; group < packet.size; group += 4) {
+        if (((mask >> group) & 15) == 0) {
+            continue;
+        }
+        __m128 ox = _mm_load_ps(packet.originX + group), oy = _mm_load_ps(packet.originY + group), oz = _mm_load_ps(packet.originZ + group);
+        __m128 ix = _mm_load_ps(packet.invDirectionX + group), iy = _mm_load_ps(packet.invDirectionY + group), iz = _mm_load_ps(packet.invDirectionZ + group);
+        __m128 x0 = _mm_mul_ps(_mm_sub_ps(minX, ox), ix), x1 = _mm_mul_ps(_mm_sub_ps(maxX, ox), ix);
+        __m128 y0 = _mm_mul_ps(_mm_sub_ps(minY, oy), iy), y1 = _mm_mul_ps(_mm_sub_ps(maxY, oy), iy);
+        __m128 z0 = _mm_mul_ps(_mm_sub_ps(minZ, oz), iz), z1 = _mm_mul_ps(_mm_sub_ps(maxZ, oz), iz);
+        __m128 tEnter = _mm_max_ps(_mm_max_ps(_mm_min_ps(x0, x1), _mm_min_ps(y0, y1)), _mm_max_ps(_mm_min_ps(z0, z1), zero));
+        __m128 tExit = _mm_mul_ps(_mm_min_ps(_mm_min_ps(_mm_max_ps(x0, x1), _mm_max_ps(y0, y1)), _mm_max_ps(z0, z1)), pad);
+        tExit = _mm_min_ps(tExit, _mm_loadu_ps(tMax + group));
+        hits |= ((uint32_t)_mm_movemask_ps(_mm_cmple_ps(tEnter, tExit)) << group) & mask;
+        if (stopAtFirst && hits) {
+            break;
+        }
+    }
+#else
+    for (int lane = first; lane < packet.size; ++lane) {
+        if ((mask >> lane & 1) && box.IntersectRay(glm::vec3(packet.originX[lane], packet.originY[lane], packet.originZ[lane]),
+                glm::vec3(packet.invDirectionX[lane], packet.invDirectionY[lane], packet.invDirectionZ[lane]), tMax[lane])) {
+            hits |= 1u << lane;
+            if (stopAtFirst) {
+                break;
+            }
+        }
+    }
+#endif
+    return hits;
+}
+
+/* 2^exponent, made straight from the bits of the float. Widen() keeps the exponents in the normal range */
+inline float WideScale(int8_t exponent) {
+    uint32_t bits = (uint32_t)(exponent + 127) << 23;
+    float scale;
+    memcpy(&scale, &bits, sizeof(scale));
+    return scale;
+}
+
+inline BVHNode BVH::WideLeaf(uint32_t offset, uint32_t count) {
+    // the leaf functions only look at where the leaf's primitives are
+    BVHNode leaf;
+    leaf.offset = offset;
+    leaf.count = (uint16_t)count;
+    leaf.axis = 0;
+    return leaf;
+}
+
+/*
+** The reciprocal of a direction for the wide slab test. Its times are q * scale / d + offset, and
+** with d = 0 that is 0 * infinity for a side at q = 0, so tiny components are kept off 0 and the
+** ray still gets a huge but finite time for the slabs it runs parallel to.
+*/
+inline glm::vec3 WideInverseDirection(const glm::vec3 &direction) {
+    glm::vec3 inverse;
+    for (int axis = 0; axis < 3; ++axis) {
+        float d = direction[axis];
+        inverse[axis] = 1.0f / (std::fabs(d) > 1e-20f ? d : (d < 0 ? -1e-20f : 1e-20f));
+    }
+    return inverse;
+}
+
+#ifdef BVH_USE_SSE
+/* Four quantized box sides as floats */
+inline __m128 LoadQuantized(const uint8_t *quantized) {
+    int32_t packed;
+    memcpy(&packed, quantized, sizeof(packed));
+    __m128i zero = _mm_setzero_si128();
+    __m128i wide = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero), zero);
+    return _mm_cvtepi32_ps(wide);
+}
+#endif
+
+/*
+** The slab test of one ray against all the children of a wide node at once. Along each axis the time
+** the ray reaches side q of a child is q * (scale / d) + (origin - o) / d, so the boxes never have to be
+** decoded. Returns the mask of the children hit before tMax and the times the ray enters them.
+*/
+inline uint32_t BVH::WideHitMask(const WideBVHNode &node, const glm::vec3 &origin, const glm::vec3 &invDirection,
+                                 const bool *directionIsNegative, float tMax, float *tEnter) {
+    const uint8_t *low[3] = { node.lowX, node.lowY, node.lowZ };
+    const uint8_t *high[3] = { node.highX, node.highY, node.highZ };
+#ifdef BVH_USE_SSE
+    __m128 enter = _mm_setzero_ps();
+    __m128 exit = _mm_set1_ps(tMax);
+    __m128 pad = _mm_set1_ps(1.0f + 1e-6f);
+    for (int axis = 0; axis < 3; ++axis) {
+        __m128 slope = _mm_set1_ps(WideScale(node.exponent[axis]) * invDirection[axis]);
+        __m128 offset = _mm_set1_ps((node.origin[axis] - origin[axis]) * invDirection[axis]);
+        const uint8_t *nearSide = directionIsNegative[axis] ? high[axis] : low[axis];
+        const uint8_t *farSide = directionIsNegative[axis] ? low[axis] : high[axis];
+        __m128 tNear = _mm_add_ps(_mm_mul_ps(LoadQuantized(nearSide), slope), offset);
+        __m128 tFar = _mm_mul_ps(_mm_add_ps(_mm_mul_ps(LoadQuantized(farSide), slope), offset), pad);
+        enter = _mm_max_ps(tNear, enter);
+        exit = _mm_min_ps(tFar, exit);
+    }
+    _mm_storeu_ps(tEnter, enter);
+    return (uint32_t)_mm_movemask_ps(_mm_cmple_ps(enter, exit)) & ((1u << node.numChildren) - 1);
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < node.numChildren; ++i) {
+        float enter = 0.0f, exit = tMax;
+        for (int axis = 0; axis < 3; ++axis) {
+            float slope = WideScale(node.exponent[axis]) * invDirection[axis];
+            float offset = (node.origin[axis] - origin[axis]) * invDirection[axis];
+            float tNear = (directionIsNegative[axis] ? high[axis][i] : low[axis][i]) * slope + offset;
+            float tFar = ((directionIsNegative[axis] ? low[axis][i] : high[axis][i]) * slope + offset) * (1.0f + 1e-6f);
+            enter = tNear > enter ? tNear : enter;
+            exit = tFar < exit ? tFar : exit;
+        }
+        tEnter[i] = enter;
+        if (enter <= exit) {
+            mask |= 1u << i;
+        }
+    }
+    return mask;
+#endif
+}
+
+template<typename LeafFunction>
+bool BVH::IntersectLeavesWide(const Ray &ray, float &tMax, LeafFunction intersectLeaf) const {
+    glm::vec3 invDirection = WideInverseDirection(ray.direction);
+    bool directionIsNegative[3] = { invDirection.x < 0, invDirection.y < 0, invDirection.z < 0 };
+
+    WideStackEntry stack[WIDE_STACK_SIZE];
+    int stackSize = 0;
+    WideStackEntry root = { 0, 0, 0.0f };
+    stack[stackSize++] = root;
+    bool hit = false;
+
+    while (stackSize > 0) {
+        WideStackEntry entry = stack[--stackSize];
+        // a closer hit may have been found since the child was put on the stack
+        if (entry.tEnter > tMax) {
+            continue;
+        }
+        if (entry.count > 0) {
+            if (intersectLeaf(WideLeaf(entry.child, entry.count), tMax)) {
+                hit = true;
+            }
+            continue;
+        }
+        const WideBVHNode &node = wideNodes[entry.child];
+        float tEnter[WideBVHNode::WIDTH];
+        uint32_t mask = WideHitMask(node, ray.origin, invDirection, directionIsNegative, tMax, tEnter);
+        // put the children on the stack furthest first, so the nearest one is visited next
+        int order[WideBVHNode::WIDTH];
+        int numHit = 0;
+        for (uint32_t bits = mask; bits; bits &= bits - 1) {
+            int child = LowestLane(bits);
+            int position = numHit++;
+            while (position > 0 && tEnter[order[position - 1]] < tEnter[child]) {
+                order[position] = order[position - 1];
+                --position;
+            }
+            order[position] = child;
+        }
+        for (int i = 0; i < numHit; ++i) {
+            WideStackEntry next = { node.child[order[i]], node.count[order[i]], tEnter[order[i]] };
+            stack[stackSize++] = next;
+        }
+    }
+    return hit;
+}
+
+template<typename LeafFunction>
+bool BVH::OccludedLeavesWide(const Ray &ray, float tMax, LeafFunction occludedLeaf) const {
+    glm::vec3 invDirection = WideInverseDirection(ray.direction);
+    bool directionIsNegative[3] = { invDirection.x < 0, invDirection.y < 0, invDirection.z < 0 };
+
+    WideStackEntry stack[WIDE_STACK_SIZE];
+    int stackSize = 0;
+    WideStackEntry root = { 0, 0, 0.0f };
+    stack[stackSize++] = root;
+
+    while (stackSize > 0) {
+        WideStackEntry entry = stack[--stackSize];
+        if (entry.count > 0) {
+            if (occludedLeaf(WideLeaf(entry.child, entry.count), tMax)) {
+                return true;
+            }
+            continue;
+        }
+        const WideBVHNode &node = wideNodes[entry.child];
+        float tEnter[WideBVHNode::WIDTH];
+        for (uint32_t bits = WideHitMask(node, ray.origin, invDirection, directionIsNegative, tMax, tEnter); bits; bits &= bits - 1) {
+            int child = LowestLane(bits);
+            WideStackEntry next = { node.child[child], node.count[child], tEnter[child] };
+            stack[stackSize++] = next;
+        }
+    }
+    return false;
+}
+
+template<typename LeafFunction>
+bool BVH::IntersectLeaves(const Ray &ray, float &tMax, LeafFunction intersectLeaf) const {
+    if (numNodes == 0) {
+        return false;
+    }
+    if (!wideNodes.empty()) {
+        return IntersectLeavesWide(ray, tMax, intersectLeaf);
+    }
+    glm::vec3 invDirection = 1.0f / ray.direction;
+    bool directionIsNegative[3] = { invDirection.x < 0, invDirection.y < 0, invDirection.z < 0 };
+
+    uint32_t stack[STACK_SIZE];
+    int stackSize = 0;
+    uint32_t current = 0;
+    bool hit = false;
+
+    while (true) {
+        const BVHNode &node = nodeData[current];
+        if (node.bounds.IntersectRay(ray.origin, invDirection, tMax)) {
+            if (node.count > 0) {
+                if (intersectLeaf(node, tMax)) {
+                    hit = true;
+                }
+            } else {
+                // visit the child on the side the ray comes from first, so tMax shrinks sooner
+                if (directionIsNegative[node.axis]) {
+                    stack[stackSize++] = current + 1;
+                    current = node.offset;
+                } else {
+                    stack[stackSize++] = node.offset;
+                    current = current + 1;
+                }
+                continue;
+            }
+        }
+        if (stackSize == 0) {
+            break;
+        }
+        current = stack[--stackSize];
+    }
+    return hit;
+}
+
+template<typename LeafFunction>
+bool BVH::OccludedLeaves(const Ray &ray, float tMax, LeafFunction occludedLeaf) const {
+    if (numNodes == 0) {
+        return false;
+    }
+    if (!wideNodes.empty()) {
+        return OccludedLeavesWide(ray, tMax, occludedLeaf);
+    }
+    glm::vec3 invDirection = 1.0f / ray.direction;
+
+    uint32_t stack[STACK_SIZE];
+    int stackSize = 0;
+    uint32_t current = 0;
+
+    while (true) {
+        const BVHNode &node = nodeData[current];
+        if (node.bounds.IntersectRay(ray.origin, invDirection, tMax)) {
+            if (node.count > 0) {
+                if (occludedLeaf(node, tMax)) {
+                    return true;
+                }
+            } else {
+                // any blocker will do, so the order the children are visited in does not matter
+                stack[stackSize++] = node.offset;
+                current = current + 1;
+                continue;
+            }
+        }
+        if (stackSize == 0) {
+            break;
+        }
+        current = stack[--stackSize];
+    }
+    return false;
+}
+
+template<typename PrimitiveFunction>
+bool BVH::Intersect(const Ray &ray, float &tMax, PrimitiveFunction intersectPrimitive) const {
+    return IntersectLeaves(ray, tMax, [&](const BVHNode &leaf, float &closestTime) {
+        bool hit = false;
+        for (uint32_t i = leaf.offset; i < leaf.offset + leaf.count; ++i) {
+            if (intersectPrimitive(indexData[i], closestTime)) {
+                hit = true;
+            }
+        }
+        return hit;
+    });
+}
+
+template<typename PrimitiveFunction>
+bool BVH::Occluded(const Ray &ray, float tMax, PrimitiveFunction occludedPrimitive) const {
+    return OccludedLeaves(ray, tMax, [&](const BVHNode &leaf, float maxTime) {
+        for (uint32_t i = leaf.offset; i < leaf.offset + leaf.count; ++i) {
+            if (occludedPrimitive(indexData[i], maxTime)) {
+                return true;
+            }
+        }
+        return false;
+    });
+}
+
+template<typename LeafFunction>
+void BVH::IntersectPacketLeaves(const RayPacket &packet, float *tMax, uint32_t mask, LeafFunction intersectLeaf) const {
+    if (numNodes == 0 || mask == 0) {
+        return;
+    }
+    if (!packet.coherent) {
+        // rays going different ways would part at almost every node, so they go one at a time
+        for (int lane = 0; lane < packet.size; ++lane) {
+            if (mask >> lane & 1) {
+                // the leaf function lowers tMax[lane] itself, which is the tMax this traversal culls with
+                IntersectLeaves(packet.Get(lane), tMax[lane], [&](const BVHNode &leaf, float &) {
+                    intersectLeaf(leaf, 1u << lane);
+                    return false;
+                });
+            }
+        }
+        return;
+    }
+    // tMax only ever shrinks, so the furthest one now bounds the packet for the whole traversal
+    float maxTime = 0.0f;
+    int first = -1;
+    for (int lane = 0; lane < packet.size; ++lane) {
+        if (mask >> lane & 1) {
+            maxTime = std::max(maxTime, tMax[lane]);
+            first = first < 0 ? lane : first;
+        }
+    }
+
+    PacketStackEntry stack[STACK_SIZE];
+    int stackSize = 0;
+    uint32_t current = 0;
+
+    while (true) {
+        const BVHNode &node = nodeData[current];
+        if (PacketMayHit(node.bounds, packet, maxTime)) {
+            if (node.count > 0) {
+                uint32_t lanes = PacketHitMask(node.bounds, packet, tMax, first, mask, false);
+                if (lanes) {
+                    intersectLeaf(node, lanes);
+                }
+            } else {
+                // only the first ray that reaches the node is searched for, the rays after it are
+                // tested again further down
+                uint32_t lanes = PacketHitMask(node.bounds, packet, tMax, first, mask, true);
+                if (lanes) {
+                    int firstHit = LowestLane(lanes);
+                    // every ray goes the same way along the axis, so they all want the same child first
+                    PacketStackEntry far;
+                    far.first = firstHit;
+                    if (packet.directionIsNegative[node.axis]) {
+                        far.node = current + 1;
+                        current = node.offset;
+                    } else {
+                        far.node = node.offset;
+                        current = current + 1;
+                    }
+                    stack[stackSize++] = far;
+                    first = firstHit;
+                    continue;
+                }
+            }
+        }
+        if (stackSize == 0) {
+            break;
+        }
+        --stackSize;
+        current = stack[stackSize].node;
+        first = stack[stackSize].first;
+    }
+}
+
+template<typename LeafFunction>
+uint32_t BVH::OccludedPacketLeaves(const RayPacket &packet, const float *tMax, uint32_t mask, LeafFunction occludedLeaf) const {
+    if (numNodes == 0 || mask == 0) {
+        return 0;
+    }
+    uint32_t occluded = 0;
+    if (!packet.coherent) {
+        for (int lane = 0; lane < packet.size; ++lane) {
+            if ((mask >> lane & 1) && OccludedLeaves(packet.Get(lane), tMax[lane], [&](const BVHNode &leaf, float) {
+                    return occludedLeaf(leaf, 1u << lane) != 0;
+                })) {
+                occluded |= 1u << lane;
+            }
+        }
+        return occluded;
+    }
+    float maxTime = 0.0f;
+    int first = -1;
+    for (int lane = 0; lane < packet.size; ++lane) {
+        if (mask >> lane & 1) {
+            maxTime = std::max(maxTime, tMax[lane]);
+            first = first < 0 ? lane : first;
+        }
+    }
+
+    PacketStackEntry stack[STACK_SIZE];
+    int stackSize = 0;
+    uint32_t current = 0;
+    // the rays still looking for a blocker
+    uint32_t active = mask;
+
+    while (true) {
+        const BVHNode &node = nodeData[current];
+        if (PacketMayHit(node.bounds, packet, maxTime)) {
+            if (node.count > 0) {
+                uint32_t lanes = PacketHitMask(node.bounds, packet, tMax, first, active, false);
+                if (lanes) {
+                    occluded |= occludedLeaf(node, lanes) & lanes;
+                    active &= ~occluded;
+                    if (active == 0) {
+                        break;
+                    }
+                }
+            } else {
+                uint32_t lanes = PacketHitMask(node.bounds, packet, tMax, first, active, true);
+                if (lanes) {
+                    int firstHit = LowestLane(lanes);
+                    PacketStackEntry other;
+                    other.node = node.offset;
+                    other.first = firstHit;
+                    stack[stackSize++] = other;
+                    current = current + 1;
+                    first = firstHit;
+                    continue;
+                }
+            }
+        }
+        if (stackSize == 0) {
+            break;
+        }
+        --stackSize;
+        current = stack[stackSize].node;
+        first = stack[stackSize].first;
+    }
+    return occluded;
+}
+
+template<typename PrimitiveFunction>
+void BVH::IntersectPacket(const RayPacket &packet, float *tMax, uint32_t mask, PrimitiveFunction intersectPrimitive) const {
+    IntersectPacketLeaves(packet, tMax, mask, [&](const BVHNode &leaf, uint32_t lanes) {
+        for (uint32_t i = leaf.offset; i < leaf.offset + leaf.count; ++i) {
+            intersectPrimitive(indexData[i], lanes);
+        }
+    });
+}
+
+template<typename PrimitiveFunction>
+uint32_t BVH::OccludedPacket(const RayPacket &packet, const float *tMax, uint32_t mask, PrimitiveFunction occludedPrimitive) const {
+    return OccludedPacketLeaves(packet, tMax, mask, [&](const BVHNode &leaf, uint32_t lanes) {
+        uint32_t occluded = 0;
+        for (uint32_t i = leaf.offset; i < leaf.offset + leaf.count && occluded != lanes; ++i) {
+            occluded |= occludedPrimitive(indexData[i], lanes & ~occluded);
+        }
+        return occluded;
+    });
+}
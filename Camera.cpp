@@ -0,0 +1,102 @@
+#include "Camera.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define CAMERA_USE_SSE
+#endif
+
+Camera::Camera(const glm::vec3 &eye, const glm::vec3 &center, const glm::vec3 &up, float fieldOfView, float nearPlane, float farPlane):
+    eye(eye),
+    center(center),
+    up(up),
+    fieldOfView(fieldOfView),
+    nearPlane(nearPlane),
+    farPlane(farPlane)
+  {
+    SetResolution(640, 480);
+}
+
+namespace {
+    glm::vec3 Unproject(const glm::mat4 &inverseViewProj, float x, float y, float z) {
+        glm::vec4 world = inverseViewProj * glm::vec4(x, y, z, 1);
+        return glm::vec3(world.x, world.y, world.z) / world.w;
+    }
+}
+
+void Camera::SetResolution(int width, int height) {
+    glm::mat4 viewMatrix = glm::lookAt(eye, center, up);
+    glm::mat4 projMatrix = glm::perspective(fieldOfView, (float)width / (float)height, nearPlane, farPlane);
+    glm::mat4 inverseViewProj = glm::inverse(viewMatrix) * glm::inverse(projMatrix);
+
+    // the points on the near and far planes at the centre of the screen and one unit along each axis
+    glm::vec3 nearCenter = Unproject(inverseViewProj, 0, 0, -1);
+    glm::vec3 nearAxisX = Unproject(inverseViewProj, 1, 0, -1) - nearCenter;
+    glm::vec3 nearAxisY = Unproject(inverseViewProj, 0, 1, -1) - nearCenter;
+    glm::vec3 farCenter = Unproject(inverseViewProj, 0, 0, 1);
+    glm::vec3 farAxisX = Unproject(inverseViewProj, 1, 0, 1) - farCenter;
+    glm::vec3 farAxisY = Unproject(inverseViewProj, 0, 1, 1) - farCenter;
+
+    // pixel (x, y) is at pixelX = 2 * (x + 0.5) / width - 1 and pixelY = 1 - 2 * (y + 0.5) / height
+    float scaleX = 2.0f / width;
+    float scaleY = -2.0f / height;
+    float offsetX = scaleX * 0.5f - 1.0f;
+    float offsetY = scaleY * 0.5f + 1.0f;
+
+    originBase = nearCenter + offsetX * nearAxisX + offsetY * nearAxisY;
+    originStepX = scaleX * nearAxisX;
+    originStepY = scaleY * nearAxisY;
+
+    glm::vec3 directionCenter = farCenter - nearCenter;
+    glm::vec3 directionAxisX = farAxisX - nearAxisX;
+    glm::vec3 directionAxisY = farAxisY - nearAxisY;
+    directionBase = directionCenter + offsetX * directionAxisX + offsetY * directionAxisY;
+    directionStepX = scaleX * directionAxisX;
+    directionStepY = scaleY * directionAxisY;
+}
+
+Ray Camera::GenerateRay(int x, int y) const {
+    glm::vec3 origin = (originBase + (float)y * originStepY) + (float)x * originStepX;
+    glm::vec3 direction = (directionBase + (float)y * directionStepY) + (float)x * directionStepX;
+    return Ray(origin, glm::normalize(direction));
+}
+
+void Camera::GenerateRays(int x0, int y, int count, RayBatch &rays) const {
+    if (rays.Size() < count) {
+        rays.Resize(count);
+    }
+    // everything that only depends on the row
+    glm::vec3 originRow = originBase + (float)y * originStepY;
+    glm::vec3 directionRow = directionBase + (float)y * directionStepY;
+
+    int i = 0;
+#ifdef CAMERA_USE_SSE
+    __m128 lane = _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f);
+    for (; i + 4 <= count; i += 4) {
+        __m128 x = _mm_add_ps(_mm_set1_ps((float)(x0 + i)), lane);
+
+        _mm_storeu_ps(&rays.originX[i], _mm_add_ps(_mm_set1_ps(originRow.x), _mm_mul_ps(x, _mm_set1_ps(originStepX.x))));
+        _mm_storeu_ps(&rays.originY[i], _mm_add_ps(_mm_set1_ps(originRow.y), _mm_mul_ps(x, _mm_set1_ps(originStepX.y))));
+        _mm_storeu_ps(&rays.originZ[i], _mm_add_ps(_mm_set1_ps(originRow.z), _mm_mul_ps(x, _mm_set1_ps(originStepX.z))));
+
+        __m128 dx = _mm_add_ps(_mm_set1_ps(directionRow.x), _mm_mul_ps(x, _mm_set1_ps(directionStepX.x)));
+        __m128 dy = _mm_add_ps(_mm_set1_ps(directionRow.y), _mm_mul_ps(x, _mm_set1_ps(directionStepX.y)));
+        __m128 dz = _mm_add_ps(_mm_set1_ps(directionRow.z), _mm_mul_ps(x, _mm_set1_ps(directionStepX.z)));
+        // a full precision sqrt and divide, the approximate rsqrt would make the image noisy
+        __m128 length = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz)));
+        _mm_storeu_ps(&rays.directionX[i], _mm_div_ps(dx, length));
+        _mm_storeu_ps(&rays.directionY[i], _mm_div_ps(dy, length));
+        _mm_storeu_ps(&rays.directionZ[i], _mm_div_ps(dz, length));
+    }
+#endif
+    for (; i < count; ++i) {
+        float x = (float)(x0 + i);
+        glm::vec3 origin = originRow + x * originStepX;
+        glm::vec3 direction = glm::normalize(directionRow + x * directionStepX);
+        rays.originX[i] = origin.x;
+        rays.originY[i] = origin.y;
+        rays.originZ[i] = origin.z;
+        rays.directionX[i] = direction.x;
+        rays.directionY[i] = direction.y;
+        rays.directionZ[i] = direction.z;
+    }
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "Ray.h"
+
+/*
+** A perspective camera which turns pixel coordinates into primary rays.
+** The view and projection matrices are only inverted once, in SetResolution(). The near and far
+** plane points of a pixel are affine in its coordinates, so after that a ray is just a few
+** multiply-adds and a normalize, and a whole row of rays can be made four at a time with SSE.
+*/
+class Camera {
+  public:
+    Camera(const glm::vec3 &eye = glm::vec3(-10.0f, 10.0f, 10.0f),
+           const glm::vec3 &center = glm::vec3(0.0f),
+           const glm::vec3 &up = glm::vec3(0.0f, 1.0f, 0.0f),
+           float fieldOfView = 45.0f, float nearPlane = 1.0f, float farPlane = 10000.0f);
+
+    /* Precomputes the ray basis for an image of the given size, call this once per frame */
+    void SetResolution(int width, int height);
+
+    /* The ray through the centre of pixel (x, y), y = 0 is the top row of the image */
+    Ray GenerateRay(int x, int y) const;
+
+    /* Fills rays with the count rays of row y starting at pixel x0, using SIMD where available */
+    void GenerateRays(int x0, int y, int count, RayBatch &rays) const;
+
+    glm::vec3 eye;
+    glm::vec3 center;
+    glm::vec3 up;
+    float fieldOfView; // vertical, in degrees
+    float nearPlane;
+    float farPlane;
+
+  private:
+    // origin(x, y) = originBase + x * originStepX + y * originStepY, and the same for the
+    // unnormalized direction, with x and y in pixels
+    glm::vec3 originBase, originStepX, originStepY;
+    glm::vec3 directionBase, directionStepX, directionStepY;
+};
@@ -0,0 +1,45 @@
+#include "Framebuffer.h"
+
+#include <stdio.h>
+
+bool Framebuffer::SavePPM(const std::string &path) const {
+    FILE *file = fopen(path.c_str(), "wb");
+    if (!file) {
+        return false;
+    }
+    fprintf(file, "P6\n%d %d\n255\n", width, height);
+    std::vector<unsigned char> row(width * 3);
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            const glm::vec3 &color = At(x, y);
+            for (int c = 0; c < 3; ++c) {
+                float value = glm::clamp(color[c], 0.0f, 1.0f);
+                row[x * 3 + c] = (unsigned char)(value * 255.0f + 0.5f);
+            }
+        }
+        fwrite(&row[0], 1, row.size(), file);
+    }
+    return fclose(file) == 0;
+}
+
+bool Framebuffer::SavePFM(const std::string &path) const {
+    FILE *file = fopen(path.c_str(), "wb");
+    if (!file) {
+        return false;
+    }
+    // a negative scale means little endian, which every machine we render on is
+    fprintf(file, "PF\n%d %d\n-1.0\n", width, height);
+    // PFM stores the bottom row first
+    for (int y = height - 1; y >= 0; --y) {
+        fwrite(&At(0, y), sizeof(glm::vec3), width, file);
+    }
+    return fclose(file) == 0;
+}
+
+bool Framebuffer::Save(const std::string &path) const {
+    size_t dot = path.rfind('.');
+    if (dot != std::string::npos && (path.substr(dot) == ".pfm" || path.substr(dot) == ".PFM")) {
+        return SavePFM(path);
+    }
+    return SavePPM(path);
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "glm/glm.hpp"
+
+// The image the ray tracer renders into. The pixels are stored in one contiguous block,
+// row by row starting with the top row of the image, as linear floating point RGB.
+class Framebuffer {
+  public:
+    Framebuffer(int width = 0, int height = 0):
+      width(width),
+      height(height),
+      pixels(width * height)
+    {}
+
+    void Resize(int w, int h) {
+      width = w;
+      height = h;
+      pixels.assign(w * h, glm::vec3(0.0f));
+    }
+
+    glm::vec3 &At(int x, int y) { return pixels[y * width + x]; }
+    const glm::vec3 &At(int x, int y) const { return pixels[y * width + x]; }
+
+    /* Writes an 8 bit binary PPM (P6), colours are clamped to [0, 1] */
+    bool SavePPM(const std::string &path) const;
+    /* Writes a floating point PFM which keeps the unclamped colours */
+    bool SavePFM(const std::string &path) const;
+    /* Picks the format from the extension of the path, anything other than .pfm is saved as PPM */
+    bool Save(const std::string &path) const;
+
+    int width;
+    int height;
+    std::vector<glm::vec3> pixels;
+};
@@ -0,0 +1,197 @@
+#include "Grid.h"
+
+#include <cmath>
+#include <limits>
+
+namespace {
+    // primitives are binned into every cell within this fraction of a cell of their box, so rounding
+    // in the traversal can never step into a cell that is missing a primitive the ray touches
+    const float BIN_PADDING = 1e-4f;
+}
+
+Grid::Grid():
+    cellSize(0.0f),
+    invCellSize(0.0f),
+    cellStartData(NULL),
+    itemData(NULL)
+{
+    resolution[0] = resolution[1] = resolution[2] = 0;
+}
+
+Grid::Grid(const Grid &other):
+    cellStart(other.cellStart),
+    items(other.items),
+    bounds(other.bounds),
+    cellSize(other.cellSize),
+    invCellSize(other.invCellSize),
+    cellStartData(other.cellStartData),
+    itemData(other.itemData)
+{
+    std::copy(other.resolution, other.resolution + 3, resolution);
+    if (other.cellStartData == other.cellStart.data()) {
+        UseOwnArrays();
+    }
+}
+
+Grid &Grid::operator =(const Grid &other) {
+    cellStart = other.cellStart;
+    items = other.items;
+    bounds = other.bounds;
+    std::copy(other.resolution, other.resolution + 3, resolution);
+    cellSize = other.cellSize;
+    invCellSize = other.invCellSize;
+    cellStartData = other.cellStartData;
+    itemData = other.itemData;
+    if (other.cellStartData == other.cellStart.data()) {
+        UseOwnArrays();
+    }
+    return *this;
+}
+
+void Grid::UseOwnArrays() {
+    cellStartData = cellStart.empty() ? NULL : &cellStart[0];
+    itemData = items.empty() ? NULL : &items[0];
+}
+
+void Grid::SetBounds(const AABB &box, const int32_t *cellsPerAxis) {
+    bounds = box;
+    for (int axis = 0; axis < 3; ++axis) {
+        resolution[axis] = cellsPerAxis[axis];
+        cellSize[axis] = (box.max[axis] - box.min[axis]) / cellsPerAxis[axis];
+        // a flat box has one cell across, which every point falls into
+        invCellSize[axis] = cellSize[axis] > 0.0f ? 1.0f / cellSize[axis] : 0.0f;
+    }
+}
+
+void Grid::UseArrays(const AABB &box, const int32_t *cellsPerAxis, const uint32_t *cellStartArray, const uint32_t *itemArray) {
+    cellStart.clear();
+    items.clear();
+    SetBounds(box, cellsPerAxis);
+    cellStartData = cellStartArray;
+    itemData = itemArray;
+}
+
+void Grid::CellRange(const AABB &box, int *first, int *last) const {
+    for (int axis = 0; axis < 3; ++axis) {
+        float low = (box.min[axis] - bounds.min[axis]) * invCellSize[axis] - BIN_PADDING;
+        float high = (box.max[axis] - bounds.min[axis]) * invCellSize[axis] + BIN_PADDING;
+        first[axis] = std::max(0, std::min(resolution[axis] - 1, (int)floorf(low)));
+        last[axis] = std::max(first[axis], std::min(resolution[axis] - 1, (int)floorf(high)));
+    }
+}
+
+void Grid::Build(const std::vector<AABB> &primitiveBounds, float cellsPerPrimitive) {
+    cellStart.clear();
+    items.clear();
+    resolution[0] = resolution[1] = resolution[2] = 0;
+    UseOwnArrays();
+    if (primitiveBounds.empty()) {
+        return;
+    }
+
+    AABB box;
+    for (size_t i = 0; i < primitiveBounds.size(); ++i) {
+        box.Extend(primitiveBounds[i]);
+    }
+    // cubic cells of the size that gives cellsPerPrimitive cells per primitive, with flat sides of
+    // the box counted as a thousandth of the longest side so they do not make the volume 0
+    glm::vec3 extent = box.Extent();
+    float longest = std::max(extent.x, std::max(extent.y, extent.z));
+    glm::vec3 sides = glm::max(extent, glm::vec3(longest * 1e-3f));
+    float side = cbrtf(sides.x * sides.y * sides.z / (std::max(cellsPerPrimitive, 1e-6f) * primitiveBounds.size()));
+    int32_t cellsPerAxis[3];
+    for (int axis = 0; axis < 3; ++axis) {
+        float cells = side > 0.0f ? extent[axis] / side : 1.0f;
+        cellsPerAxis[axis] = (int32_t)std::max(1.0f, std::min((float)MAX_RESOLUTION, ceilf(cells)));
+    }
+    SetBounds(box, cellsPerAxis);
+
+    // count how many primitives each cell lists, then turn the counts into where each list starts
+    size_t numCells = (size_t)resolution[0] * resolution[1] * resolution[2];
+    cellStart.assign(numCells + 1, 0);
+    int first[3], last[3];
+    for (size_t i = 0; i < primitiveBounds.size(); ++i) {
+        CellRange(primitiveBounds[i], first, last);
+        for (int z = first[2]; z <= last[2]; ++z) {
+            for (int y = first[1]; y <= last[1]; ++y) {
+                size_t row = (size_t)resolution[0] * (y + (size_t)resolution[1] * z);
+                for (int x = first[0]; x <= last[0]; ++x) {
+                    cellStart[row + x + 1]++;
+                }
+            }
+        }
+    }
+    for (size_t cell = 0; cell < numCells; ++cell) {
+        cellStart[cell + 1] += cellStart[cell];
+    }
+
+    // then fill the lists in, which leaves each one in the order of the primitives
+    items.resize(cellStart[numCells]);
+    std::vector<uint32_t> fill(cellStart.begin(), cellStart.end() - 1);
+    for (size_t i = 0; i < primitiveBounds.size(); ++i) {
+        CellRange(primitiveBounds[i], first, last);
+        for (int z = first[2]; z <= last[2]; ++z) {
+            for (int y = first[1]; y <= last[1]; ++y) {
+                size_t row = (size_t)resolution[0] * (y + (size_t)resolution[1] * z);
+                for (int x = first[0]; x <= last[0]; ++x) {
+                    items[fill[row + x]++] = (uint32_t)i;
+                }
+            }
+        }
+    }
+    UseOwnArrays();
+}
+
+float Grid::Occupancy() const {
+    size_t numCells = NumCells();
+    if (numCells == 0) {
+        return 0.0f;
+    }
+    size_t occupied = 0;
+    for (size_t cell = 0; cell < numCells; ++cell) {
+        if (cellStartData[cell + 1] != cellStartData[cell]) {
+            occupied++;
+        }
+    }
+    return (float)occupied / numCells;
+}
+
+bool Grid::StartWalk(const Ray &ray, float tMax, int *cell, int *step, glm::vec3 &tNext, glm::vec3 &tDelta) const {
+    glm::vec3 invDirection = 1.0f / ray.direction;
+    // the same slab test as AABB::IntersectRay, keeping the time the ray enters the grid
+    float tEnter = 0.0f;
+    float tExit = tMax;
+    for (int axis = 0; axis < 3; ++axis) {
+        float tNear = (bounds.min[axis] - ray.origin[axis]) * invDirection[axis];
+        float tFar = (bounds.max[axis] - ray.origin[axis]) * invDirection[axis];
+        if (tNear > tFar) {
+            std::swap(tNear, tFar);
+        }
+        tFar *= 1.0f + 1e-6f;
+        tEnter = tNear > tEnter ? tNear : tEnter;
+        tExit = tFar < tExit ? tFar : tExit;
+        if (tEnter > tExit) {
+            return false;
+        }
+    }
+
+    glm::vec3 start = ray(tEnter);
+    for (int axis = 0; axis < 3; ++axis) {
+        cell[axis] = std::max(0, std::min(resolution[axis] - 1, (int)floorf((start[axis] - bounds.min[axis]) * invCellSize[axis])));
+        if (ray.direction[axis] > 0.0f) {
+            step[axis] = 1;
+            tNext[axis] = (bounds.min[axis] + (cell[axis] + 1) * cellSize[axis] - ray.origin[axis]) * invDirection[axis];
+            tDelta[axis] = cellSize[axis] * invDirection[axis];
+        } else if (ray.direction[axis] < 0.0f) {
+            step[axis] = -1;
+            tNext[axis] = (bounds.min[axis] + cell[axis] * cellSize[axis] - ray.origin[axis]) * invDirection[axis];
+            tDelta[axis] = -cellSize[axis] * invDirection[axis];
+        } else {
+            // never leaves its row of cells along this axis
+            step[axis] = 0;
+            tNext[axis] = std::numeric_limits<float>::infinity();
+            tDelta[axis] = 0.0f;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,142 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+
+#include "AABB.h"
+#include "Ray.h"
+
+/*
+** Uniform grid over a set of primitives, the alternative to a BVH for very many primitives of about
+** the same size packed evenly into a box, like particles or the atoms of a molecule.
+** The box around the primitives is cut into equal cells and every cell lists the primitives whose
+** boxes overlap it, with the lists of all the cells stored one after the other. A ray walks the cells
+** it passes through from front to back with a 3D DDA, so the traversal needs no stack and stops in the
+** first cell that holds a hit. Like the BVH it only knows about the boxes of the primitives, the
+** intersection tests are done by the caller through the functions given to the traversals.
+*/
+class Grid {
+  public:
+    // cells on each axis are limited to this, so a thin box of primitives does not make huge slices
+    static const int MAX_RESOLUTION = 1024;
+
+    Grid();
+    Grid(const Grid &other);
+    Grid &operator =(const Grid &other);
+
+    /*
+    ** Builds the grid in linear time by counting the primitives in every cell and then filling in the
+    ** lists. The resolution aims at cellsPerPrimitive cells per primitive, with the cells as close to
+    ** cubes as the box allows.
+    */
+    void Build(const std::vector<AABB> &primitiveBounds, float cellsPerPrimitive = 1.0f);
+
+    /*
+    ** Uses cells that were built earlier and are kept somewhere else, such as in a mapped scene cache,
+    ** instead of building them. cellStart has one entry per cell and one more, cell i lists
+    ** items[cellStart[i]] up to items[cellStart[i + 1]]. Nothing is copied, so the arrays have to
+    ** outlive the grid.
+    */
+    void UseArrays(const AABB &box, const int32_t *cellsPerAxis, const uint32_t *cellStartArray, const uint32_t *itemArray);
+
+    bool IsEmpty() const { return cellStartData == NULL; }
+    AABB Bounds() const { return bounds; }
+    const int32_t *Resolution() const { return resolution; }
+    size_t NumCells() const { return IsEmpty() ? 0 : (size_t)resolution[0] * resolution[1] * resolution[2]; }
+    size_t NumItems() const { return IsEmpty() ? 0 : cellStartData[NumCells()]; }
+    const uint32_t *CellStartData() const { return cellStartData; }
+    const uint32_t *ItemData() const { return itemData; }
+    /* The share of the cells that list at least one primitive */
+    float Occupancy() const;
+
+    /*
+    ** Walks the cells the ray passes through before tMax, nearest first, calling
+    ** intersectCell(items, count, tMax) with the list of each cell that is not empty. The function
+    ** lowers tMax when it finds a closer hit and returns true if it did. A primitive that overlaps
+    ** several cells is in all of their lists, so it can be tested more than once. Returns true if
+    ** any cell found a hit.
+    */
+    template<typename CellFunction>
+    bool IntersectCells(const Ray &ray, float &tMax, CellFunction intersectCell) const;
+    /* Returns true as soon as occludedCell(items, count, tMax) finds a hit closer than tMax */
+    template<typename CellFunction>
+    bool OccludedCells(const Ray &ray, float tMax, CellFunction occludedCell) const;
+
+    // cellStart and items, filled by Build()
+    std::vector<uint32_t> cellStart;
+    std::vector<uint32_t> items;
+
+  private:
+    AABB bounds;
+    int32_t resolution[3];
+    glm::vec3 cellSize;
+    glm::vec3 invCellSize;
+    // what the traversal reads, either the vectors above or arrays given to UseArrays()
+    const uint32_t *cellStartData;
+    const uint32_t *itemData;
+
+    void SetBounds(const AABB &box, const int32_t *cellsPerAxis);
+    void UseOwnArrays();
+    /* The range of cells on each axis that the box overlaps */
+    void CellRange(const AABB &box, int *first, int *last) const;
+
+    /*
+    ** Starts the DDA: clips the ray to the grid, and sets the cell it starts in, the direction it
+    ** steps in on each axis, the time it reaches the next cell boundary on each axis and the time it
+    ** takes to cross one cell on each axis. Returns false if the ray misses the grid before tMax.
+    */
+    bool StartWalk(const Ray &ray, float tMax, int *cell, int *step, glm::vec3 &tNext, glm::vec3 &tDelta) const;
+};
+
+template<typename CellFunction>
+bool Grid::IntersectCells(const Ray &ray, float &tMax, CellFunction intersectCell) const {
+    int cell[3], step[3];
+    glm::vec3 tNext, tDelta;
+    if (IsEmpty() || !StartWalk(ray, tMax, cell, step, tNext, tDelta)) {
+        return false;
+    }
+    bool hit = false;
+    for (;;) {
+        uint32_t index = (uint32_t)(cell[0] + resolution[0] * (cell[1] + resolution[1] * cell[2]));
+        uint32_t first = cellStartData[index], end = cellStartData[index + 1];
+        if (first != end && intersectCell(itemData + first, end - first, tMax)) {
+            hit = true;
+        }
+        // every primitive the ray could still hit closer lies in a cell it has already left
+        int axis = tNext.x < tNext.y ? (tNext.x < tNext.z ? 0 : 2) : (tNext.y < tNext.z ? 1 : 2);
+        if (tNext[axis] >= tMax) {
+            return hit;
+        }
+        cell[axis] += step[axis];
+        if (cell[axis] < 0 || cell[axis] >= resolution[axis]) {
+            return hit;
+        }
+        tNext[axis] += tDelta[axis];
+    }
+}
+
+template<typename CellFunction>
+bool Grid::OccludedCells(const Ray &ray, float tMax, CellFunction occludedCell) const {
+    int cell[3], step[3];
+    glm::vec3 tNext, tDelta;
+    if (IsEmpty() || !StartWalk(ray, tMax, cell, step, tNext, tDelta)) {
+        return false;
+    }
+    for (;;) {
+        uint32_t index = (uint32_t)(cell[0] + resolution[0] * (cell[1] + resolution[1] * cell[2]));
+        uint32_t first = cellStartData[index], end = cellStartData[index + 1];
+        if (first != end && occludedCell(itemData + first, end - first, tMax)) {
+            return true;
+        }
+        int axis = tNext.x < tNext.y ? (tNext.x < tNext.z ? 0 : 2) : (tNext.y < tNext.z ? 1 : 2);
+        if (tNext[axis] >= tMax) {
+            return false;
+        }
+        cell[axis] += step[axis];
+        if (cell[axis] < 0 || cell[axis] >= resolution[axis]) {
+            return false;
+        }
+        tNext[axis] += tDelta[axis];
+    }
+}
@@ -0,0 +1,69 @@
+#include "Instance.h"
+
+Instance::Instance(const Object *geometry, const glm::mat4 &transform):
+    Object(transform, geometry->GetMaterialID()),
+    geometry(geometry)
+{
+    SetTransform(transform);
+}
+
+void Instance::SetTransform(const glm::mat4 &newTransform) {
+    transform = newTransform;
+    inverse = glm::inverse(transform);
+    normalMatrix = glm::transpose(glm::mat3(inverse));
+    // the box around the moved corners of the geometry's box
+    bounds = AABB();
+    AABB local = geometry->Bounds();
+    if (!local.IsEmpty()) {
+        for (int corner = 0; corner < 8; ++corner) {
+            glm::vec3 point((corner & 1) ? local.max.x : local.min.x, (corner & 2) ? local.max.y : local.min.y,
+                            (corner & 4) ? local.max.z : local.min.z);
+            bounds.Extend(glm::vec3(transform * glm::vec4(point, 1.0f)));
+        }
+    }
+}
+
+bool Instance::Intersect(const Ray &ray, HitRecord &hit) const {
+    if (!geometry->Intersect(ToObjectSpace(ray), hit)) {
+        return false;
+    }
+    // the geometry recorded itself and the primitive it hit, but the hit belongs to this placement of it
+    hit.object = this;
+    return true;
+}
+
+void Instance::GetSurface(const Ray &ray, const HitRecord &hit, IntersectInfo &info) const {
+    geometry->GetSurface(ToObjectSpace(ray), hit, info);
+    info.hitPoint = ray(hit.time);
+    info.normal = glm::normalize(normalMatrix * info.normal);
+}
+
+bool Instance::Occluded(const Ray &ray, float tMax) const {
+    return geometry->Occluded(ToObjectSpace(ray), tMax);
+}
+
+void Instance::IntersectPacket(const RayPacket &packet, uint32_t lanes, HitRecord *hits) const {
+    // an affine transform keeps the rays of a coherent packet coherent, so they stay together in object space
+    RayPacket local;
+    local.size = packet.size;
+    for (int lane = 0; lane < packet.size; ++lane) {
+        local.Set(lane, ToObjectSpace(packet.Get(lane)));
+    }
+    local.ComputeBounds();
+    geometry->IntersectPacket(local, lanes, hits);
+    for (int lane = 0; lane < packet.size; ++lane) {
+        if ((lanes >> lane & 1) && hits[lane].object == geometry) {
+            hits[lane].object = this;
+        }
+    }
+}
+
+uint32_t Instance::OccludedPacket(const RayPacket &packet, uint32_t lanes, const float *tMax) const {
+    RayPacket local;
+    local.size = packet.size;
+    for (int lane = 0; lane < packet.size; ++lane) {
+        local.Set(lane, ToObjectSpace(packet.Get(lane)));
+    }
+    local.ComputeBounds();
+    return geometry->OccludedPacket(local, lanes, tMax);
+}
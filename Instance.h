@@ -0,0 +1,46 @@
+#pragma once
+
+#include "Object.h"
+
+/*
+** One placement of a piece of geometry that is shared with other instances.
+** The geometry, usually a triangle mesh or a sphere set with its own BVH, is built once in its own
+** object space and kept in the scene's geometries list rather than its objects. An instance only
+** adds an affine transform and the inverse of it: rays are moved into object space, tested against
+** the shared geometry and its BVH, and only the closest hit is moved back out. The instances are
+** what goes in the scene's BVH, so the scene's BVH sorts the instances and each geometry's own BVH
+** sorts its primitives, and a thousand copies of a model cost a thousand instances and one model.
+*/
+class Instance : public Object {
+  public:
+    /* geometry has to outlive the instance, it is not copied or deleted by it */
+    Instance(const Object *geometry, const glm::mat4 &transform);
+
+    const Object *Geometry() const { return geometry; }
+    const glm::mat4 &Transform() const { return transform; }
+    /* Moves the instance, the scene has to be told with MarkObjectDirty() before the next frame */
+    void SetTransform(const glm::mat4 &newTransform);
+
+    virtual bool Intersect(const Ray &ray, HitRecord &hit) const;
+    virtual void GetSurface(const Ray &ray, const HitRecord &hit, IntersectInfo &info) const;
+    virtual bool Occluded(const Ray &ray, float tMax) const;
+    virtual void IntersectPacket(const RayPacket &packet, uint32_t lanes, HitRecord *hits) const;
+    virtual uint32_t OccludedPacket(const RayPacket &packet, uint32_t lanes, const float *tMax) const;
+    virtual AABB Bounds() const { return bounds; }
+    virtual bool IsBounded() const { return geometry->IsBounded(); }
+
+  private:
+    const Object *geometry;
+    glm::mat4 inverse;
+    // the inverse transpose of the transform, for moving normals out of object space
+    glm::mat3 normalMatrix;
+    AABB bounds;
+
+    /*
+    ** The ray in the geometry's space. The direction is not normalised again, so a point t along
+    ** it is the same point as t along the ray in the world and hit times carry straight across.
+    */
+    Ray ToObjectSpace(const Ray &ray) const {
+        return Ray(glm::vec3(inverse * glm::vec4(ray.origin, 1.0f)), glm::vec3(inverse * glm::vec4(ray.direction, 0.0f)));
+    }
+};
@@ -0,0 +1,15 @@
+#pragma once
+
+#include "glm/glm.hpp"
+
+// A point light. Every light that can see a point adds its diffuse and specular light to it.
+class Light {
+  public:
+    Light(const glm::vec3 &pos = glm::vec3(0.0f), const glm::vec3 &inten = glm::vec3(1.0f))
+      :position(pos)
+      ,intensity(inten)
+      {}
+
+    glm::vec3 position;
+    glm::vec3 intensity;
+};
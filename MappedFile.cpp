@@ -0,0 +1,57 @@
+#include "MappedFile.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// mmap of an empty file fails, so empty files all share this instead
+static const char emptyFile[1] = { 0 };
+
+MappedFile::MappedFile():
+    data(NULL),
+    size(0)
+  {}
+
+MappedFile::~MappedFile() {
+    Close();
+}
+
+bool MappedFile::Open(const std::string &path, bool sequential) {
+    Close();
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        return false;
+    }
+    if (info.st_size == 0) {
+        close(fd);
+        data = emptyFile;
+        return true;
+    }
+    void *mapped = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // the mapping stays valid after the descriptor is closed
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        return false;
+    }
+    // the loaders read the file from start to end, so the system can read well ahead of them
+    if (sequential) {
+        madvise(mapped, (size_t)info.st_size, MADV_SEQUENTIAL);
+    }
+    data = (const char *)mapped;
+    size = (size_t)info.st_size;
+    return true;
+}
+
+void MappedFile::Close() {
+    if (data && data != emptyFile) {
+        munmap((void *)data, size);
+    }
+    data = NULL;
+    size = 0;
+}
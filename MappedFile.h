@@ -0,0 +1,32 @@
+#pragma once
+
+#include <string>
+#include <stddef.h>
+
+/*
+** A read only view of a whole file, mapped into memory with mmap so the loaders can parse it in
+** place without copying it into buffers first. The contents are not null terminated.
+*/
+class MappedFile {
+  public:
+    MappedFile();
+    ~MappedFile();
+
+    /*
+    ** Maps the file, returns false if it could not be opened. sequential tells the system the file
+    ** will be read from start to end, so it can read ahead.
+    */
+    bool Open(const std::string &path, bool sequential = true);
+    void Close();
+
+    const char *Data() const { return data; }
+    size_t Size() const { return size; }
+    const char *End() const { return data + size; }
+
+  private:
+    const char *data;
+    size_t size;
+
+    MappedFile(const MappedFile &);
+    MappedFile &operator =(const MappedFile &);
+};
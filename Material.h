@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "glm/glm.hpp"
+
+class Material {
+  public:
+    Material();
+    glm::vec3 ambient;
+    glm::vec3 diffuse;
+    glm::vec3 specular;
+    float glossiness; //Specular intensity
+    float reflection;
+    float refraction;
+    float refractiveIndex;
+
+    Material(glm::vec3 amb, glm::vec3 diff, glm::vec3 spec, float gloss, float refl, float refr, float refrIndex)
+      :ambient(amb) ,diffuse(diff) ,specular(spec) ,glossiness(gloss) ,reflection(refl), refraction(refr), refractiveIndex(refrIndex)
+      {}
+};
+
+// Objects do not keep a copy of their material, they refer to one in the scene's material table
+// by its index. The table is only read when a hit is shaded.
+typedef uint32_t MaterialID;
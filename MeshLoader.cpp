@@ -0,0 +1,980 @@
+#include "MeshLoader.h"
+#include "MappedFile.h"
+#include "ParseUtil.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <unordered_map>
+
+namespace {
+
+void SetError(std::string *error, const std::string &message) {
+    if (error) {
+        *error = message;
+    }
+}
+
+/* Runs work(i) for i in [0, count), on the pool if there is one */
+void RunChunks(ThreadPool *pool, int count, const std::function<void(int)> &work) {
+    if (pool && count > 1) {
+        pool->ParallelFor(count, work);
+    } else {
+        for (int i = 0; i < count; ++i) {
+            work(i);
+        }
+    }
+}
+
+std::string LineError(const std::string &path, const char *begin, const char *p, const char *message) {
+    char buffer[64];
+    snprintf(buffer, sizeof(buffer), ":%d: ", Parse::LineNumber(begin, p));
+    return path + buffer + message;
+}
+
+/* Converts a count of triangle corners with shared indices into the mesh's index buffer */
+void AppendFan(const uint32_t *polygon, int corners, std::vector<uint32_t> &indices) {
+    for (int i = 1; i + 1 < corners; ++i) {
+        indices.push_back(polygon[0]);
+        indices.push_back(polygon[i]);
+        indices.push_back(polygon[i + 1]);
+    }
+}
+
+// ---------------------------------------------------------------------------------------------
+// OBJ
+
+// the file is cut into chunks of about this size which are parsed in parallel
+const size_t OBJ_CHUNK_SIZE = 4 << 20;
+
+// One corner of a face, as 0 based indices into the position, uv and normal lists, -1 if not given
+struct ObjCorner {
+    long long position;
+    long long uv;
+    long long normal;
+};
+
+struct ObjChunk {
+    const char *begin;
+    const char *end;
+    // how many of each kind of vertex line the chunk has, and how many come before it in the file
+    size_t numPositions, numUVs, numNormals;
+    size_t positionBase, uvBase, normalBase;
+    // three per triangle
+    std::vector<ObjCorner> corners;
+    // where parsing failed, or NULL
+    const char *errorAt;
+    const char *errorMessage;
+
+    // used by MergeObjCorners(): the distinct corners in the order the chunk first has them, which
+    // of them each corner is, and for each distinct corner the chunk and position of the first
+    // one like it in the file and then its vertex in the mesh
+    std::vector<ObjCorner> distinct;
+    std::vector<uint32_t> cornerDistinct;
+    std::vector<uint64_t> firstSeen;
+    std::vector<uint32_t> vertexIds;
+    // the distinct corners in each partition
+    std::vector<std::vector<uint32_t> > partitions;
+
+    ObjChunk(): begin(NULL), end(NULL), numPositions(0), numUVs(0), numNormals(0),
+        positionBase(0), uvBase(0), normalBase(0), errorAt(NULL), errorMessage(NULL) {}
+};
+
+void CountObjChunk(ObjChunk &chunk) {
+    // the keywords have to match exactly as ParseObjChunk() reads them, it fills the arrays sized here
+    for (const char *p = chunk.begin; p < chunk.end; Parse::SkipLine(p, chunk.end)) {
+        Parse::SkipSpaces(p, chunk.end);
+        if (Parse::MatchKeyword(p, chunk.end, "v")) {
+            chunk.numPositions++;
+        } else if (Parse::MatchKeyword(p, chunk.end, "vt")) {
+            chunk.numUVs++;
+        } else if (Parse::MatchKeyword(p, chunk.end, "vn")) {
+            chunk.numNormals++;
+        }
+    }
+}
+
+/* Turns an OBJ index, which counts from 1 or backwards from the last vertex read, into a 0 based one */
+bool ResolveObjIndex(long long index, size_t countSoFar, long long &resolved) {
+    if (index > 0) {
+        resolved = index - 1;
+    } else if (index < 0) {
+        resolved = (long long)countSoFar + index;
+    } else {
+        return false;
+    }
+    return resolved >= 0;
+}
+
+void ParseObjChunk(ObjChunk &chunk, glm::vec3 *positions, glm::vec2 *uvs, glm::vec3 *normals) {
+    size_t nextPosition = chunk.positionBase;
+    size_t nextUV = chunk.uvBase;
+    size_t nextNormal = chunk.normalBase;
+    std::vector<ObjCorner> polygon;
+
+    for (const char *p = chunk.begin; p < chunk.end; Parse::SkipLine(p, chunk.end)) {
+        Parse::SkipSpaces(p, chunk.end);
+        const char *line = p;
+        if (Parse::MatchKeyword(p, chunk.end, "v")) {
+            if (nextPosition >= chunk.positionBase + chunk.numPositions) {
+                chunk.errorAt = line;
+                chunk.errorMessage = "expected three numbers after v";
+                return;
+            }
+            glm::vec3 &position = positions[nextPosition++];
+            if (!Parse::NextFloat(p, chunk.end, position.x) || !Parse::NextFloat(p, chunk.end, position.y) || !Parse::NextFloat(p, chunk.end, position.z)) {
+                chunk.errorAt = line;
+                chunk.errorMessage = "expected three numbers after v";
+                return;
+            }
+        } else if (Parse::MatchKeyword(p, chunk.end, "vt")) {
+            if (nextUV >= chunk.uvBase + chunk.numUVs) {
+                chunk.errorAt = line;
+                chunk.errorMessage = "expected a number after vt";
+                return;
+            }
+            glm::vec2 &uv = uvs[nextUV++];
+            if (!Parse::NextFloat(p, chunk.end, uv.x)) {
+                chunk.errorAt = line;
+                chunk.errorMessage = "expected a number after vt";
+                return;
+            }
+            // the second coordinate is optional
+            if (!Parse::NextFloat(p, chunk.end, uv.y)) {
+                uv.y = 0.0f;
+            }
+        } else if (Parse::MatchKeyword(p, chunk.end, "vn")) {
+            if (nextNormal >= chunk.normalBase + chunk.numNormals) {
+                chunk.errorAt = line;
+                chunk.errorMessage = "expected three numbers after vn";
+                return;
+            }
+            glm::vec3 &normal = normals[nextNormal++];
+            if (!Parse::NextFloat(p, chunk.end, normal.x) || !Parse::NextFloat(p, chunk.end, normal.y) || !Parse::NextFloat(p, chunk.end, normal.z)) {
+                chunk.errorAt = line;
+                chunk.errorMessage = "expected three numbers after vn";
+                return;
+            }
+        } else if (Parse::MatchKeyword(p, chunk.end, "f")) {
+            // each corner is one of p, p/t, p//n or p/t/n
+            polygon.clear();
+            while (true) {
+                Parse::SkipSpaces(p, chunk.end);
+                if (p >= chunk.end || *p == '\n' || *p == '#') {
+                    break;
+                }
+                ObjCorner corner;
+                corner.uv = -1;
+                corner.normal = -1;
+                long long index;
+                bool valid = Parse::ParseInt(p, chunk.end, index) && ResolveObjIndex(index, nextPosition, corner.position);
+                if (valid && p < chunk.end && *p == '/') {
+                    ++p;
+                    if (p < chunk.end && *p != '/') {
+                        valid = Parse::ParseInt(p, chunk.end, index) && ResolveObjIndex(index, nextUV, corner.uv);
+                    }
+                    if (valid && p < chunk.end && *p == '/') {
+                        ++p;
+                        valid = Parse::ParseInt(p, chunk.end, index) && ResolveObjIndex(index, nextNormal, corner.normal);
+                    }
+                }
+                if (!valid) {
+                    chunk.errorAt = line;
+                    chunk.errorMessage = "invalid face index";
+                    return;
+                }
+                polygon.push_back(corner);
+            }
+            for (size_t i = 1; i + 1 < polygon.size(); ++i) {
+                chunk.corners.push_back(polygon[0]);
+                chunk.corners.push_back(polygon[i]);
+                chunk.corners.push_back(polygon[i + 1]);
+            }
+        }
+    }
+}
+
+struct ObjCornerHash {
+    size_t operator()(const ObjCorner &c) const {
+        return (size_t)(c.position * 73856093LL ^ c.uv * 19349663LL ^ c.normal * 83492791LL);
+    }
+};
+
+struct ObjCornerEqual {
+    bool operator()(const ObjCorner &a, const ObjCorner &b) const {
+        return a.position == b.position && a.uv == b.uv && a.normal == b.normal;
+    }
+};
+
+// the distinct corners are shared out between this many partitions per thread by their hash
+const int OBJ_PARTITIONS_PER_THREAD = 4;
+
+/* The partition a corner belongs to, mixing the high bits of the hash in since the maps use the low ones */
+size_t ObjPartition(const ObjCorner &corner, size_t numPartitions) {
+    size_t hash = ObjCornerHash()(corner);
+    return (hash ^ (hash >> 16)) % numPartitions;
+}
+
+/*
+** Makes one vertex per distinct combination of position, uv and normal index, for faces whose
+** attributes are indexed separately. Each chunk first finds its own distinct corners in parallel.
+** Then each partition of the corners goes through the chunks in order, on its own thread, to find
+** which chunk has each corner first. A prefix sum over how many corners each chunk has first gives
+** them their vertices, so the vertices come out in the order the file first uses them, the same as
+** one pass over every corner would give, without that pass.
+*/
+void MergeObjCorners(std::vector<ObjChunk> &chunks, const std::vector<glm::vec3> &positions, const std::vector<glm::vec2> &uvs,
+                     const std::vector<glm::vec3> &normals, bool useUVs, bool useNormals, TriangleMesh &mesh, ThreadPool *pool) {
+    typedef std::unordered_map<ObjCorner, uint32_t, ObjCornerHash, ObjCornerEqual> LocalMap;
+    typedef std::unordered_map<ObjCorner, uint64_t, ObjCornerHash, ObjCornerEqual> FirstMap;
+    size_t numPartitions = pool ? (size_t)pool->NumThreads() * OBJ_PARTITIONS_PER_THREAD : 1;
+
+    RunChunks(pool, (int)chunks.size(), [&](int i) {
+        ObjChunk &chunk = chunks[i];
+        LocalMap seen;
+        // most vertices of a closed mesh are corners of about six triangles
+        seen.reserve(chunk.corners.size() / 4);
+        chunk.cornerDistinct.resize(chunk.corners.size());
+        for (size_t c = 0; c < chunk.corners.size(); ++c) {
+            ObjCorner corner = chunk.corners[c];
+            if (!useUVs) {
+                corner.uv = -1;
+            }
+            if (!useNormals) {
+                corner.normal = -1;
+            }
+            std::pair<LocalMap::iterator, bool> inserted = seen.insert(std::make_pair(corner, (uint32_t)chunk.distinct.size()));
+            if (inserted.second) {
+                chunk.distinct.push_back(corner);
+            }
+            chunk.cornerDistinct[c] = inserted.first->second;
+        }
+        chunk.partitions.assign(numPartitions, std::vector<uint32_t>());
+        for (size_t d = 0; d < chunk.distinct.size(); ++d) {
+            chunk.partitions[ObjPartition(chunk.distinct[d], numPartitions)].push_back((uint32_t)d);
+        }
+        chunk.firstSeen.resize(chunk.distinct.size());
+    });
+
+    // the first chunk to have a corner keeps it, the others note where it was first
+    RunChunks(pool, (int)numPartitions, [&](int partition) {
+        size_t count = 0;
+        for (size_t i = 0; i < chunks.size(); ++i) {
+            count += chunks[i].partitions[partition].size();
+        }
+        FirstMap first;
+        first.reserve(count);
+        for (size_t i = 0; i < chunks.size(); ++i) {
+            ObjChunk &chunk = chunks[i];
+            const std::vector<uint32_t> &list = chunk.partitions[partition];
+            for (size_t j = 0; j < list.size(); ++j) {
+                uint64_t here = (uint64_t)i << 32 | list[j];
+                chunk.firstSeen[list[j]] = first.insert(std::make_pair(chunk.distinct[list[j]], here)).first->second;
+            }
+        }
+    });
+
+    std::vector<size_t> vertexBase(chunks.size() + 1, 0), cornerBase(chunks.size() + 1, 0);
+    RunChunks(pool, (int)chunks.size(), [&](int i) {
+        ObjChunk &chunk = chunks[i];
+        std::vector<std::vector<uint32_t> >().swap(chunk.partitions);
+        for (size_t d = 0; d < chunk.distinct.size(); ++d) {
+            if (chunk.firstSeen[d] == ((uint64_t)i << 32 | d)) {
+                vertexBase[i + 1]++;
+            }
+        }
+    });
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        vertexBase[i + 1] += vertexBase[i];
+        cornerBase[i + 1] = cornerBase[i] + chunks[i].corners.size();
+    }
+    size_t numVertices = vertexBase[chunks.size()];
+    mesh.positions.resize(numVertices);
+    mesh.uvs.resize(useUVs ? numVertices : 0);
+    mesh.normals.resize(useNormals ? numVertices : 0);
+    mesh.indices.resize(cornerBase[chunks.size()]);
+
+    // the corners each chunk has first become vertices, then the others take the vertex of their first
+    RunChunks(pool, (int)chunks.size(), [&](int i) {
+        ObjChunk &chunk = chunks[i];
+        chunk.vertexIds.resize(chunk.distinct.size());
+        uint32_t next = (uint32_t)vertexBase[i];
+        for (size_t d = 0; d < chunk.distinct.size(); ++d) {
+            if (chunk.firstSeen[d] != ((uint64_t)i << 32 | d)) {
+                continue;
+            }
+            const ObjCorner &corner = chunk.distinct[d];
+            mesh.positions[next] = positions[corner.position];
+            if (useUVs) {
+                mesh.uvs[next] = uvs[corner.uv];
+            }
+            if (useNormals) {
+                mesh.normals[next] = normals[corner.normal];
+            }
+            chunk.vertexIds[d] = next++;
+        }
+    });
+    RunChunks(pool, (int)chunks.size(), [&](int i) {
+        ObjChunk &chunk = chunks[i];
+        for (size_t d = 0; d < chunk.distinct.size(); ++d) {
+            uint64_t first = chunk.firstSeen[d];
+            if (first != ((uint64_t)i << 32 | d)) {
+                chunk.vertexIds[d] = chunks[first >> 32].vertexIds[first & 0xffffffffu];
+            }
+        }
+        uint32_t *indices = mesh.indices.empty() ? NULL : &mesh.indices[cornerBase[i]];
+        for (size_t c = 0; c < chunk.corners.size(); ++c) {
+            indices[c] = chunk.vertexIds[chunk.cornerDistinct[c]];
+        }
+    });
+}
+
+}
+
+bool LoadOBJ(const std::string &path, TriangleMesh &mesh, ThreadPool *pool, std::string *error) {
+    MappedFile file;
+    if (!file.Open(path)) {
+        SetError(error, "could not open " + path);
+        return false;
+    }
+
+    // cut the file into chunks that end on line breaks
+    std::vector<ObjChunk> chunks;
+    const char *start = file.Data();
+    while (start < file.End()) {
+        ObjChunk chunk;
+        chunk.begin = start;
+        if ((size_t)(file.End() - start) <= OBJ_CHUNK_SIZE) {
+            chunk.end = file.End();
+        } else {
+            const char *p = start + OBJ_CHUNK_SIZE;
+            Parse::SkipLine(p, file.End());
+            chunk.end = p;
+        }
+        start = chunk.end;
+        chunks.push_back(chunk);
+    }
+
+    // first count the vertices in every chunk, so each chunk knows where its vertices go in the
+    // shared arrays and what relative indices in its faces refer to
+    RunChunks(pool, (int)chunks.size(), [&](int i) { CountObjChunk(chunks[i]); });
+    size_t numPositions = 0, numUVs = 0, numNormals = 0;
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        chunks[i].positionBase = numPositions;
+        chunks[i].uvBase = numUVs;
+        chunks[i].normalBase = numNormals;
+        numPositions += chunks[i].numPositions;
+        numUVs += chunks[i].numUVs;
+        numNormals += chunks[i].numNormals;
+    }
+
+    std::vector<glm::vec3> positions(numPositions);
+    std::vector<glm::vec2> uvs(numUVs);
+    std::vector<glm::vec3> normals(numNormals);
+    RunChunks(pool, (int)chunks.size(), [&](int i) {
+        ParseObjChunk(chunks[i], positions.empty() ? NULL : &positions[0], uvs.empty() ? NULL : &uvs[0], normals.empty() ? NULL : &normals[0]);
+    });
+
+    // check the faces, and whether the uv and normal indices always match the position index,
+    // in which case the vertex arrays can be used as they are
+    bool allUVs = true, allNormals = true, sameIndices = true;
+    size_t numCorners = 0;
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        const ObjChunk &chunk = chunks[i];
+        if (chunk.errorAt) {
+            SetError(error, LineError(path, file.Data(), chunk.errorAt, chunk.errorMessage));
+            return false;
+        }
+        for (size_t c = 0; c < chunk.corners.size(); ++c) {
+            const ObjCorner &corner = chunk.corners[c];
+            if ((size_t)corner.position >= numPositions || (corner.uv >= 0 && (size_t)corner.uv >= numUVs)
+                || (corner.normal >= 0 && (size_t)corner.normal >= numNormals)) {
+                SetError(error, path + ": face index out of range");
+                return false;
+            }
+            allUVs = allUVs && corner.uv >= 0;
+            allNormals = allNormals && corner.normal >= 0;
+            sameIndices = sameIndices && (corner.uv < 0 || corner.uv == corner.position) && (corner.normal < 0 || corner.normal == corner.position);
+        }
+        numCorners += chunk.corners.size();
+    }
+    if (numCorners / 3 > 0xffffffffu || numPositions > 0xffffffffu) {
+        SetError(error, path + ": too many vertices for 32 bit indices");
+        return false;
+    }
+    // an attribute only some of the corners have is dropped
+    bool useUVs = numCorners > 0 && allUVs;
+    bool useNormals = numCorners > 0 && allNormals;
+
+    mesh.indices.clear();
+    mesh.indices.reserve(numCorners);
+    if (sameIndices && (!useUVs || numUVs >= numPositions) && (!useNormals || numNormals >= numPositions)) {
+        for (size_t i = 0; i < chunks.size(); ++i) {
+            for (size_t c = 0; c < chunks[i].corners.size(); ++c) {
+                mesh.indices.push_back((uint32_t)chunks[i].corners[c].position);
+            }
+        }
+        mesh.positions.swap(positions);
+        mesh.uvs.clear();
+        mesh.normals.clear();
+        if (useUVs) {
+            uvs.resize(numPositions);
+            mesh.uvs.swap(uvs);
+        }
+        if (useNormals) {
+            normals.resize(numPositions);
+            mesh.normals.swap(normals);
+        }
+    } else {
+        // the attributes are indexed separately, so make one vertex per distinct combination
+        MergeObjCorners(chunks, positions, uvs, normals, useUVs, useNormals, mesh, pool);
+    }
+    return true;
+}
+
+// ---------------------------------------------------------------------------------------------
+// PLY
+
+namespace {
+
+enum PlyType { PLY_INT8, PLY_UINT8, PLY_INT16, PLY_UINT16, PLY_INT32, PLY_UINT32, PLY_FLOAT32, PLY_FLOAT64, PLY_INVALID };
+
+enum PlyFormat { PLY_ASCII, PLY_BINARY_LITTLE_ENDIAN, PLY_BINARY_BIG_ENDIAN };
+
+// the vertices are parsed in parallel in blocks of this many
+const size_t PLY_VERTEX_BLOCK = 1 << 16;
+// and the faces in blocks of this many, when they are all triangles
+const size_t PLY_FACE_BLOCK = 1 << 16;
+
+struct PlyProperty {
+    std::string name;
+    PlyType type;
+    bool isList;
+    PlyType countType;
+    size_t offset;  // byte offset within the element, only meaningful while the element has no lists
+};
+
+struct PlyElement {
+    std::string name;
+    size_t count;
+    std::vector<PlyProperty> properties;
+    bool fixedSize;
+    size_t stride;
+
+    int Find(const char *propertyName) const {
+        for (size_t i = 0; i < properties.size(); ++i) {
+            if (properties[i].name == propertyName) {
+                return (int)i;
+            }
+        }
+        return -1;
+    }
+};
+
+PlyType ParsePlyType(const char *begin, const char *end) {
+    if (Parse::WordEquals(begin, end, "char") || Parse::WordEquals(begin, end, "int8")) return PLY_INT8;
+    if (Parse::WordEquals(begin, end, "uchar") || Parse::WordEquals(begin, end, "uint8")) return PLY_UINT8;
+    if (Parse::WordEquals(begin, end, "short") || Parse::WordEquals(begin, end, "int16")) return PLY_INT16;
+    if (Parse::WordEquals(begin, end, "ushort") || Parse::WordEquals(begin, end, "uint16")) return PLY_UINT16;
+    if (Parse::WordEquals(begin, end, "int") || Parse::WordEquals(begin, end, "int32")) return PLY_INT32;
+    if (Parse::WordEquals(begin, end, "uint") || Parse::WordEquals(begin, end, "uint32")) return PLY_UINT32;
+    if (Parse::WordEquals(begin, end, "float") || Parse::WordEquals(begin, end, "float32")) return PLY_FLOAT32;
+    if (Parse::WordEquals(begin, end, "double") || Parse::WordEquals(begin, end, "float64")) return PLY_FLOAT64;
+    return PLY_INVALID;
+}
+
+size_t PlyTypeSize(PlyType type) {
+    switch (type) {
+        case PLY_INT8: case PLY_UINT8: return 1;
+        case PLY_INT16: case PLY_UINT16: return 2;
+        case PLY_INT32: case PLY_UINT32: case PLY_FLOAT32: return 4;
+        case PLY_FLOAT64: return 8;
+        default: return 0;
+    }
+}
+
+template<typename T>
+T ReadSwapped(const char *p, bool swap) {
+    char bytes[sizeof(T)];
+    memcpy(bytes, p, sizeof(T));
+    if (swap) {
+        for (size_t i = 0; i < sizeof(T) / 2; ++i) {
+            char tmp = bytes[i];
+            bytes[i] = bytes[sizeof(T) - 1 - i];
+            bytes[sizeof(T) - 1 - i] = tmp;
+        }
+    }
+    T value;
+    memcpy(&value, bytes, sizeof(T));
+    return value;
+}
+
+/* Reads one binary value of the given type, swapping the bytes if the file's endianness differs */
+double ReadPlyValue(const char *p, PlyType type, bool swap) {
+    switch (type) {
+        case PLY_INT8: return (double)*(const signed char *)p;
+        case PLY_UINT8: return (double)*(const unsigned char *)p;
+        case PLY_INT16: return (double)ReadSwapped<int16_t>(p, swap);
+        case PLY_UINT16: return (double)ReadSwapped<uint16_t>(p, swap);
+        case PLY_INT32: return (double)ReadSwapped<int32_t>(p, swap);
+        case PLY_UINT32: return (double)ReadSwapped<uint32_t>(p, swap);
+        case PLY_FLOAT32: return (double)ReadSwapped<float>(p, swap);
+        case PLY_FLOAT64: return ReadSwapped<double>(p, swap);
+        default: return 0.0;
+    }
+}
+
+/* Where in a vertex each attribute the mesh uses is, -1 if the file does not have it */
+struct PlyVertexLayout {
+    int position[3];
+    int normal[3];
+    int uv[2];
+
+    explicit PlyVertexLayout(const PlyElement &vertex) {
+        position[0] = vertex.Find("x");
+        position[1] = vertex.Find("y");
+        position[2] = vertex.Find("z");
+        normal[0] = vertex.Find("nx");
+        normal[1] = vertex.Find("ny");
+        normal[2] = vertex.Find("nz");
+        const char *uNames[] = { "u", "s", "texture_u" };
+        const char *vNames[] = { "v", "t", "texture_v" };
+        uv[0] = uv[1] = -1;
+        for (int i = 0; i < 3 && (uv[0] < 0 || uv[1] < 0); ++i) {
+            uv[0] = vertex.Find(uNames[i]);
+            uv[1] = vertex.Find(vNames[i]);
+        }
+    }
+
+    bool HasPosition() const { return position[0] >= 0 && position[1] >= 0 && position[2] >= 0; }
+    bool HasNormals() const { return normal[0] >= 0 && normal[1] >= 0 && normal[2] >= 0; }
+    bool HasUVs() const { return uv[0] >= 0 && uv[1] >= 0; }
+};
+
+bool ParsePlyHeader(const MappedFile &file, PlyFormat &format, std::vector<PlyElement> &elements, const char *&body, std::string &message) {
+    const char *p = file.Data();
+    const char *end = file.End();
+    if (!Parse::MatchKeyword(p, end, "ply")) {
+        message = "not a PLY file";
+        return false;
+    }
+    bool haveFormat = false;
+    for (Parse::SkipLine(p, end); p < end; Parse::SkipLine(p, end)) {
+        const char *wordBegin, *wordEnd;
+        if (!Parse::ParseWord(p, end, wordBegin, wordEnd)) {
+            continue;
+        }
+        if (Parse::WordEquals(wordBegin, wordEnd, "end_header")) {
+            Parse::SkipLine(p, end);
+            body = p;
+            if (!haveFormat) {
+                message = "missing format line";
+                return false;
+            }
+            return true;
+        } else if (Parse::WordEquals(wordBegin, wordEnd, "format")) {
+            Parse::ParseWord(p, end, wordBegin, wordEnd);
+            if (Parse::WordEquals(wordBegin, wordEnd, "ascii")) {
+                format = PLY_ASCII;
+            } else if (Parse::WordEquals(wordBegin, wordEnd, "binary_little_endian")) {
+                format = PLY_BINARY_LITTLE_ENDIAN;
+            } else if (Parse::WordEquals(wordBegin, wordEnd, "binary_big_endian")) {
+                format = PLY_BINARY_BIG_ENDIAN;
+            } else {
+                message = "unknown format " + std::string(wordBegin, wordEnd);
+                return false;
+            }
+            haveFormat = true;
+        } else if (Parse::WordEquals(wordBegin, wordEnd, "element")) {
+            PlyElement element;
+            long long count;
+            Parse::ParseWord(p, end, wordBegin, wordEnd);
+            element.name.assign(wordBegin, wordEnd);
+            Parse::SkipSpaces(p, end);
+            if (!Parse::ParseInt(p, end, count) || count < 0) {
+                message = "bad element count";
+                return false;
+            }
+            element.count = (size_t)count;
+            element.fixedSize = true;
+            element.stride = 0;
+            elements.push_back(element);
+        } else if (Parse::WordEquals(wordBegin, wordEnd, "property")) {
+            if (elements.empty()) {
+                message = "property before any element";
+                return false;
+            }
+            PlyElement &element = elements.back();
+            PlyProperty property;
+            Parse::ParseWord(p, end, wordBegin, wordEnd);
+            property.isList = Parse::WordEquals(wordBegin, wordEnd, "list");
+            property.countType = PLY_INVALID;
+            if (property.isList) {
+                Parse::ParseWord(p, end, wordBegin, wordEnd);
+                property.countType = ParsePlyType(wordBegin, wordEnd);
+                Parse::ParseWord(p, end, wordBegin, wordEnd);
+            }
+            property.type = ParsePlyType(wordBegin, wordEnd);
+            Parse::ParseWord(p, end, wordBegin, wordEnd);
+            property.name.assign(wordBegin, wordEnd);
+            if (property.type == PLY_INVALID || (property.isList && property.countType == PLY_INVALID)) {
+                message = "unknown type for property " + property.name;
+                return false;
+            }
+            property.offset = element.stride;
+            if (property.isList) {
+                element.fixedSize = false;
+            } else {
+                element.stride += PlyTypeSize(property.type);
+            }
+            element.properties.push_back(property);
+        }
+        // comment and obj_info lines are ignored
+    }
+    message = "missing end_header";
+    return false;
+}
+
+/* Walks over one element whose size is not fixed, returns false if it runs off the end of the file */
+bool SkipPlyElement(const PlyElement &element, const char *&p, const char *end, bool swap) {
+    for (size_t i = 0; i < element.properties.size(); ++i) {
+        const PlyProperty &property = element.properties[i];
+        if (property.isList) {
+            size_t countSize = PlyTypeSize(property.countType);
+            if ((size_t)(end - p) < countSize) {
+                return false;
+            }
+            size_t count = (size_t)ReadPlyValue(p, property.countType, swap);
+            p += countSize;
+            if ((size_t)(end - p) < count * PlyTypeSize(property.type)) {
+                return false;
+            }
+            p += count * PlyTypeSize(property.type);
+        } else {
+            if ((size_t)(end - p) < PlyTypeSize(property.type)) {
+                return false;
+            }
+            p += PlyTypeSize(property.type);
+        }
+    }
+    return true;
+}
+
+bool ReadBinaryPlyVertices(const PlyElement &element, const char *&p, const char *end, bool swap, TriangleMesh &mesh, ThreadPool *pool) {
+    PlyVertexLayout layout(element);
+    if (!layout.HasPosition()) {
+        return false;
+    }
+    size_t count = element.count;
+    mesh.positions.resize(count);
+    mesh.normals.resize(layout.HasNormals() ? count : 0);
+    mesh.uvs.resize(layout.HasUVs() ? count : 0);
+
+    if (element.fixedSize) {
+        if ((size_t)(end - p) / (element.stride ? element.stride : 1) < count) {
+            return false;
+        }
+        const char *data = p;
+        // every vertex is at a known place, so blocks of them can be read at the same time
+        RunChunks(pool, (int)((count + PLY_VERTEX_BLOCK - 1) / PLY_VERTEX_BLOCK), [&](int block) {
+            size_t first = block * PLY_VERTEX_BLOCK;
+            size_t last = std::min(count, first + PLY_VERTEX_BLOCK);
+            for (size_t i = first; i < last; ++i) {
+                const char *vertex = data + i * element.stride;
+                for (int axis = 0; axis < 3; ++axis) {
+                    const PlyProperty &property = element.properties[layout.position[axis]];
+                    mesh.positions[i][axis] = (float)ReadPlyValue(vertex + property.offset, property.type, swap);
+                }
+                if (layout.HasNormals()) {
+                    for (int axis = 0; axis < 3; ++axis) {
+                        const PlyProperty &property = element.properties[layout.normal[axis]];
+                        mesh.normals[i][axis] = (float)ReadPlyValue(vertex + property.offset, property.type, swap);
+                    }
+                }
+                if (layout.HasUVs()) {
+                    for (int axis = 0; axis < 2; ++axis) {
+                        const PlyProperty &property = element.properties[layout.uv[axis]];
+                        mesh.uvs[i][axis] = (float)ReadPlyValue(vertex + property.offset, property.type, swap);
+                    }
+                }
+            }
+        });
+        p += count * element.stride;
+        return true;
+    }
+
+    // a vertex with a list in it, each one has to be walked in turn
+    for (size_t i = 0; i < count; ++i) {
+        for (size_t j = 0; j < element.properties.size(); ++j) {
+            const PlyProperty &property = element.properties[j];
+            size_t size = PlyTypeSize(property.type);
+            if (property.isList) {
+                size_t countSize = PlyTypeSize(property.countType);
+                if ((size_t)(end - p) < countSize) {
+                    return false;
+                }
+                size_t listCount = (size_t)ReadPlyValue(p, property.countType, swap);
+                p += countSize;
+                if ((size_t)(end - p) < listCount * size) {
+                    return false;
+                }
+                p += listCount * size;
+                continue;
+            }
+            if ((size_t)(end - p) < size) {
+                return false;
+            }
+            float value = (float)ReadPlyValue(p, property.type, swap);
+            p += size;
+            for (int axis = 0; axis < 3; ++axis) {
+                if ((int)j == layout.position[axis]) mesh.positions[i][axis] = value;
+                if ((int)j == layout.normal[axis] && layout.HasNormals()) mesh.normals[i][axis] = value;
+                if (axis < 2 && (int)j == layout.uv[axis] && layout.HasUVs()) mesh.uvs[i][axis] = value;
+            }
+        }
+    }
+    return true;
+}
+
+bool ReadBinaryPlyFaces(const PlyElement &element, const char *&p, const char *end, bool swap, TriangleMesh &mesh, ThreadPool *pool) {
+    int indexProperty = element.Find("vertex_indices");
+    if (indexProperty < 0) {
+        indexProperty = element.Find("vertex_index");
+    }
+    if (indexProperty < 0 || !element.properties[indexProperty].isList) {
+        return false;
+    }
+    const PlyProperty &list = element.properties[indexProperty];
+    size_t countSize = PlyTypeSize(list.countType);
+    size_t indexSize = PlyTypeSize(list.type);
+    size_t count = element.count;
+
+    // Most files only have triangles and nothing else in a face, so every face is the same size.
+    // Try reading them in parallel like that, and fall back to walking the faces one by one if any
+    // of them turns out not to be a triangle.
+    if (element.properties.size() == 1) {
+        size_t stride = countSize + 3 * indexSize;
+        if ((size_t)(end - p) / stride >= count) {
+            const char *data = p;
+            std::vector<uint32_t> indices(count * 3);
+            std::atomic<bool> allTriangles(true);
+            RunChunks(pool, (int)((count + PLY_FACE_BLOCK - 1) / PLY_FACE_BLOCK), [&](int block) {
+                size_t first = block * PLY_FACE_BLOCK;
+                size_t last = std::min(count, first + PLY_FACE_BLOCK);
+                for (size_t i = first; i < last && allTriangles; ++i) {
+                    const char *face = data + i * stride;
+                    if ((size_t)ReadPlyValue(face, list.countType, swap) != 3) {
+                        allTriangles = false;
+                        break;
+                    }
+                    for (int corner = 0; corner < 3; ++corner) {
+                        indices[3 * i + corner] = (uint32_t)ReadPlyValue(face + countSize + corner * indexSize, list.type, swap);
+                    }
+                }
+            });
+            if (allTriangles) {
+                mesh.indices.swap(indices);
+                p += count * stride;
+                return true;
+            }
+        }
+    }
+
+    mesh.indices.clear();
+    mesh.indices.reserve(count * 3);
+    std::vector<uint32_t> polygon;
+    for (size_t i = 0; i < count; ++i) {
+        for (size_t j = 0; j < element.properties.size(); ++j) {
+            const PlyProperty &property = element.properties[j];
+            if ((int)j != indexProperty) {
+                PlyElement single;
+                single.properties.push_back(property);
+                if (!SkipPlyElement(single, p, end, swap)) {
+                    return false;
+                }
+                continue;
+            }
+            if ((size_t)(end - p) < countSize) {
+                return false;
+            }
+            size_t corners = (size_t)ReadPlyValue(p, list.countType, swap);
+            p += countSize;
+            if ((size_t)(end - p) < corners * indexSize) {
+                return false;
+            }
+            polygon.resize(corners);
+            for (size_t c = 0; c < corners; ++c) {
+                polygon[c] = (uint32_t)ReadPlyValue(p, list.type, swap);
+                p += indexSize;
+            }
+            if (corners >= 3) {
+                AppendFan(&polygon[0], (int)corners, mesh.indices);
+            }
+        }
+    }
+    return true;
+}
+
+/*
+** Reads one ascii value. Integer types are read as integers, since a float would round anything
+** past 2^24 and quietly turn a big vertex index into one of its neighbours.
+*/
+bool NextPlyValue(const char *&p, const char *end, PlyType type, double &value) {
+    Parse::SkipSpaces(p, end);
+    if (type == PLY_FLOAT32 || type == PLY_FLOAT64) {
+        float number;
+        if (!Parse::ParseFloat(p, end, number)) {
+            return false;
+        }
+        value = number;
+        return true;
+    }
+    long long integer;
+    if (!Parse::ParseInt(p, end, integer)) {
+        return false;
+    }
+    value = (double)integer;
+    return true;
+}
+
+/* The ascii body has one element per line, which are read in order */
+bool ReadAsciiPly(const std::vector<PlyElement> &elements, const char *p, const char *end, TriangleMesh &mesh) {
+    std::vector<uint32_t> polygon;
+    for (size_t e = 0; e < elements.size(); ++e) {
+        const PlyElement &element = elements[e];
+        bool isVertex = element.name == "vertex";
+        bool isFace = element.name == "face";
+        PlyVertexLayout layout(element);
+        int indexProperty = element.Find("vertex_indices");
+        if (indexProperty < 0) {
+            indexProperty = element.Find("vertex_index");
+        }
+        if (isVertex) {
+            if (!layout.HasPosition()) {
+                return false;
+            }
+            mesh.positions.resize(element.count);
+            mesh.normals.resize(layout.HasNormals() ? element.count : 0);
+            mesh.uvs.resize(layout.HasUVs() ? element.count : 0);
+        }
+        for (size_t i = 0; i < element.count; ++i, Parse::SkipLine(p, end)) {
+            if (p >= end) {
+                return false;
+            }
+            for (size_t j = 0; j < element.properties.size(); ++j) {
+                const PlyProperty &property = element.properties[j];
+                double value;
+                if (property.isList) {
+                    long long corners;
+                    Parse::SkipSpaces(p, end);
+                    if (!Parse::ParseInt(p, end, corners) || corners < 0) {
+                        return false;
+                    }
+                    polygon.resize((size_t)corners);
+                    for (long long c = 0; c < corners; ++c) {
+                        if (!NextPlyValue(p, end, property.type, value) || value < 0.0 || value > 0xffffffffu) {
+                            return false;
+                        }
+                        polygon[(size_t)c] = (uint32_t)value;
+                    }
+                    if (isFace && (int)j == indexProperty && corners >= 3) {
+                        AppendFan(&polygon[0], (int)corners, mesh.indices);
+                    }
+                    continue;
+                }
+                if (!NextPlyValue(p, end, property.type, value)) {
+                    return false;
+                }
+                if (isVertex) {
+                    for (int axis = 0; axis < 3; ++axis) {
+                        if ((int)j == layout.position[axis]) mesh.positions[i][axis] = (float)value;
+                        if ((int)j == layout.normal[axis] && layout.HasNormals()) mesh.normals[i][axis] = (float)value;
+                        if (axis < 2 && (int)j == layout.uv[axis] && layout.HasUVs()) mesh.uvs[i][axis] = (float)value;
+                    }
+                }
+            }
+        }
+    }
+    return true;
+}
+
+}
+
+bool LoadPLY(const std::string &path, TriangleMesh &mesh, ThreadPool *pool, std::string *error) {
+    MappedFile file;
+    if (!file.Open(path)) {
+        SetError(error, "could not open " + path);
+        return false;
+    }
+    PlyFormat format = PLY_ASCII;
+    std::vector<PlyElement> elements;
+    const char *body = NULL;
+    std::string message;
+    if (!ParsePlyHeader(file, format, elements, body, message)) {
+        SetError(error, path + ": " + message);
+        return false;
+    }
+
+    mesh.positions.clear();
+    mesh.normals.clear();
+    mesh.uvs.clear();
+    mesh.indices.clear();
+
+    if (format == PLY_ASCII) {
+        if (!ReadAsciiPly(elements, body, file.End(), mesh)) {
+            SetError(error, path + ": bad or truncated ascii data");
+            return false;
+        }
+    } else {
+        uint16_t one = 1;
+        bool hostIsLittleEndian = *(const unsigned char *)&one == 1;
+        bool swap = hostIsLittleEndian != (format == PLY_BINARY_LITTLE_ENDIAN);
+        const char *p = body;
+        for (size_t e = 0; e < elements.size(); ++e) {
+            const PlyElement &element = elements[e];
+            bool ok;
+            if (element.name == "vertex") {
+                ok = ReadBinaryPlyVertices(element, p, file.End(), swap, mesh, pool);
+            } else if (element.name == "face") {
+                ok = ReadBinaryPlyFaces(element, p, file.End(), swap, mesh, pool);
+            } else if (element.fixedSize) {
+                ok = (size_t)(file.End() - p) / (element.stride ? element.stride : 1) >= element.count;
+                if (ok) {
+                    p += element.count * element.stride;
+                }
+            } else {
+                ok = true;
+                for (size_t i = 0; i < element.count && ok; ++i) {
+                    ok = SkipPlyElement(element, p, file.End(), swap);
+                }
+            }
+            if (!ok) {
+                SetError(error, path + ": bad or truncated " + element.name + " data");
+                return false;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < mesh.indices.size(); ++i) {
+        if (mesh.indices[i] >= mesh.positions.size()) {
+            SetError(error, path + ": face index out of range");
+            return false;
+        }
+    }
+    return true;
+}
+
+bool LoadMesh(const std::string &path, TriangleMesh &mesh, ThreadPool *pool, std::string *error) {
+    size_t dot = path.rfind('.');
+    std::string extension = dot == std::string::npos ? "" : path.substr(dot + 1);
+    for (size_t i = 0; i < extension.size(); ++i) {
+        extension[i] = (char)tolower(extension[i]);
+    }
+    if (extension == "obj") {
+        return LoadOBJ(path, mesh, pool, error);
+    } else if (extension == "ply") {
+        return LoadPLY(path, mesh, pool, error);
+    }
+    SetError(error, path + ": unknown mesh format, expected .obj or .ply");
+    return false;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <string>
+
+#include "TriangleMesh.h"
+#include "ThreadPool.h"
+
+/*
+** Loaders which stream mesh files straight into the arrays of a TriangleMesh.
+** The file is mapped into memory and parsed in place in one pass, without creating a string per
+** line or token. When a thread pool is given, large files are cut into chunks that are parsed on
+** all of its threads. Polygons with more than three corners are split into triangle fans.
+** The mesh is not built, call mesh.Build() once it has been filled.
+** On failure they return false and, if error is not NULL, say what went wrong in it.
+*/
+
+/*
+** Wavefront OBJ: v, vt, vn and f lines, everything else is ignored. When faces index positions, uvs
+** and normals separately, the vertices for each distinct combination are found on the pool as well.
+*/
+bool LoadOBJ(const std::string &path, TriangleMesh &mesh, ThreadPool *pool = NULL, std::string *error = NULL);
+
+/* PLY in binary little or big endian, or ascii: the vertex and face elements are read */
+bool LoadPLY(const std::string &path, TriangleMesh &mesh, ThreadPool *pool = NULL, std::string *error = NULL);
+
+/* Picks the loader from the file extension */
+bool LoadMesh(const std::string &path, TriangleMesh &mesh, ThreadPool *pool = NULL, std::string *error = NULL);
@@ -10,91 +10,107 @@ Material::Material():
     refractiveIndex(0.0f)
   {}
 
-Object::Object(const glm::mat4 &transform, const Material &material):
+Object::Object(const glm::mat4 &transform, MaterialID material, Type type):
     transform(transform),
-    material(material)
+    materialID(material),
+    type(type)
   {}
 
-/*
- *
- */
-bool Sphere::Intersect(const Ray &ray, IntersectInfo &info) const {
-    // solve the quadratic equation
-    float a = glm::dot(ray.direction, ray.direction);
-    float b = glm::dot(2.0f*ray.direction, (ray.origin - origin));
-    float c = glm::dot((ray.origin - origin), (ray.origin - origin)) - pow(radius, 2);
-    float discriminant = pow(b, 2) - 4*a*c;
+void Object::IntersectPacket(const RayPacket &packet, uint32_t lanes, HitRecord *hits) const {
+    for (uint32_t bits = lanes; bits; bits &= bits - 1) {
+        int lane = LowestLane(bits);
+        Intersect(packet.Get(lane), hits[lane]);
+    }
+}
 
-    if(discriminant < 0) {
-        // here the ray did not intersect with the object
-        return false;
-    } else if (discriminant >= 0){
-        // here the ray passes through 2 surfaces of the sphere, or touches the edge
-        // we want to use the closest intersection point and since the sqrt is always positive,
-        // we can just use the negative version of the quadratic solution function.
-        float depth = (-b -sqrt(discriminant)) / (2.0f*a);
-        // ignore intersection if it is behind the camera
-        // we make the assumption that if we are on the inside of the object then it is not displayed
-        if(depth < 0){
-          return false;
+uint32_t Object::OccludedPacket(const RayPacket &packet, uint32_t lanes, const float *tMax) const {
+    uint32_t occluded = 0;
+    for (uint32_t bits = lanes; bits; bits &= bits - 1) {
+        int lane = LowestLane(bits);
+        if (Occluded(packet.Get(lane), tMax[lane])) {
+            occluded |= 1u << lane;
         }
-        info.hitPoint = ray.origin + (depth * ray.direction);
     }
+    return occluded;
+}
 
-    info.material = MaterialPtr();
+bool Sphere::Intersect(const Ray &ray, HitRecord &hit) const {
+    float depth;
+    if (!IntersectSphere(ray, data, hit.time, depth)) {
+        return false;
+    }
+    hit.time = depth;
+    hit.object = this;
+    return true;
+}
+
+void Sphere::GetSurface(const Ray &ray, const HitRecord &hit, IntersectInfo &info) const {
+    info.hitPoint = ray(hit.time);
     // calculate the normal on the sphere where the ray intersects it
-    info.normal = glm::normalize(info.hitPoint - origin);
-    info.time = glm::length(ray.origin - info.hitPoint);
+    info.normal = glm::normalize(info.hitPoint - data.center);
+    info.materialID = materialID;
+    info.time = hit.time;
+}
 
-    return true;
+bool Sphere::Occluded(const Ray &ray, float tMax) const {
+    float depth;
+    return IntersectSphere(ray, data, tMax, depth);
 }
 
-bool Plane::Intersect(const Ray &ray, IntersectInfo &info) const {
-    float angle = glm::dot(ray.direction, normal);
-    // this prevents divide by 0 error
-    if (angle != 0) {
-        float depth = glm::dot((point - ray.origin), normal) / angle;
-        // check if the intercection is infront of the camera
-        if (depth > 0) {
-            info.hitPoint = ray.origin + depth * ray.direction;
-            info.normal = normal;
-            info.material = MaterialPtr();
-            info.time = glm::length(ray.origin - info.hitPoint);
-            return true;
-        }
-        // here the intercection is behind the camera
+AABB Sphere::Bounds() const {
+    return AABB(data.center - glm::vec3(data.radius), data.center + glm::vec3(data.radius));
+}
+
+bool Plane::Intersect(const Ray &ray, HitRecord &hit) const {
+    float depth;
+    if (!IntersectPlane(ray, data, hit.time, depth)) {
         return false;
     }
-    return false;
+    hit.time = depth;
+    hit.object = this;
+    return true;
 }
 
-bool Triangle::Intersect(const Ray &ray, IntersectInfo &info) const {
-    glm::vec3 normal = glm::normalize(glm::cross(point2 - point1, point3 - point1));
-    // this is the angle between the normal and the ray direction
-    float angle = glm::dot(ray.direction, normal);
-    // if the Triangle is perpendicular to the view then it does not intersect
-    if (angle != 0) {
-        float depth = glm::dot((point1 - ray.origin), normal) / angle;
-        if (depth > 0) {
-            glm::vec3 hitPoint = ray.origin + depth * ray.direction;
-
-            glm::vec3 hit1 =  hitPoint - point1;
-            glm::vec3 hit2 =  hitPoint - point2;
-            glm::vec3 hit3 =  hitPoint - point3;
+void Plane::GetSurface(const Ray &ray, const HitRecord &hit, IntersectInfo &info) const {
+    info.hitPoint = ray(hit.time);
+    info.normal = data.normal;
+    info.materialID = materialID;
+    info.time = hit.time;
+}
 
-            // check if the ray was on the inside of each line of the triangle
-            float determinant1 = glm::dot(normal, glm::cross(point2 - point1, hit1));
-            float determinant2 = glm::dot(normal, glm::cross(point3 - point2, hit2));
-            float determinant3 = glm::dot(normal, glm::cross(point1 - point3, hit3));
+bool Plane::Occluded(const Ray &ray, float tMax) const {
+    float depth;
+    return IntersectPlane(ray, data, tMax, depth);
+}
 
-            if(determinant1 >= 0 && determinant2 >= 0 && determinant3 >= 0) {
-                info.hitPoint = hitPoint;
-                info.normal = normal;
-                info.material = MaterialPtr();
-                info.time = glm::length(ray.origin - info.hitPoint);
-                return true;
-            }
-        }
+bool Triangle::Intersect(const Ray &ray, HitRecord &hit) const {
+    float depth, u, v;
+    if (IntersectTriangle(ray, data, hit.time, depth, u, v)) {
+        hit.time = depth;
+        hit.object = this;
+        hit.u = u;
+        hit.v = v;
+        return true;
     }
     return false;
 }
+
+void Triangle::GetSurface(const Ray &ray, const HitRecord &hit, IntersectInfo &info) const {
+    info.hitPoint = ray(hit.time);
+    info.normal = data.normal;
+    info.materialID = materialID;
+    info.time = hit.time;
+}
+
+bool Triangle::Occluded(const Ray &ray, float tMax) const {
+    float depth, u, v;
+    return IntersectTriangle(ray, data, tMax, depth, u, v);
+}
+
+AABB Triangle::Bounds() const {
+    AABB box;
+    box.Extend(data.vertex0);
+    box.Extend(data.vertex0 + data.edge1);
+    box.Extend(data.vertex0 + data.edge2);
+    return box;
+}
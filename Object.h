@@ -1,40 +1,53 @@
 #pragma once
 
 #include "Ray.h"
-
-class Material {
-  public:
-    Material();
-    glm::vec3 ambient;
-    glm::vec3 diffuse;
-    glm::vec3 specular;
-    float glossiness; //Specular intensity
-    float reflection;
-    float refraction;
-    float refractiveIndex;
-
-    Material(glm::vec3 amb, glm::vec3 diff, glm::vec3 spec, float gloss, float refl, float refr, float refrIndex)
-      :ambient(amb) ,diffuse(diff) ,specular(spec) ,glossiness(gloss) ,reflection(refl), refraction(refr), refractiveIndex(refrIndex)
-      {}
-};
+#include "Material.h"
+#include "AABB.h"
+#include "TriangleIntersect.h"
+#include "PrimitiveIntersect.h"
 
 // The father class of all the objects displayed. Some features would be shared between objects, others will be overloaded.
 class Object {
   public:
-    Object(const glm::mat4 &transform = glm::mat4(1.0f), const Material &material = Material());
+    // What kind of object it is, known without a virtual call. The scene copies the data of spheres,
+    // planes and triangles into flat arrays and tests them inline, everything else is OTHER and
+    // is tested through the virtual functions below.
+    enum Type { OTHER, SPHERE, PLANE, TRIANGLE };
+
+    Object(const glm::mat4 &transform = glm::mat4(1.0f), MaterialID material = 0, Type type = OTHER);
     //  The keyword const here will check the type of the parameters and make sure no changes are made
     //  to them in the function. It's not necessary but better for robustness
-    virtual bool Intersect(const Ray &ray, IntersectInfo &info) const { return true; }
+    // Tests the ray against the object, only hits closer than hit.time count. On a hit it lowers
+    // hit.time and records this object and the primitive and uv it hit, nothing else.
+    virtual bool Intersect(const Ray &ray, HitRecord &hit) const { return false; }
+    // Works out the hit point, normal and material from a record this object filled in, this is only
+    // done once per ray, for the closest hit of all.
+    virtual void GetSurface(const Ray &ray, const HitRecord &hit, IntersectInfo &info) const {}
+    // Only answers whether anything is hit in front of the ray before tMax, without working out
+    // where or filling in any shading information. Used for the shadow rays.
+    virtual bool Occluded(const Ray &ray, float tMax) const { return false; }
+    // The same two tests for the rays of a packet whose bits are set in lanes, hits[lane] is the
+    // HitRecord of each ray. The default tests the rays one at a time, objects with their own BVH
+    // walk it with the whole packet.
+    virtual void IntersectPacket(const RayPacket &packet, uint32_t lanes, HitRecord *hits) const;
+    // Returns the mask of the rays in lanes that are blocked before their tMax
+    virtual uint32_t OccludedPacket(const RayPacket &packet, uint32_t lanes, const float *tMax) const;
+    // The box around the object, used to place it in the BVH. Objects that go on forever return false
+    // from IsBounded() and are tested separately against every ray.
+    virtual AABB Bounds() const { return AABB(); }
+    virtual bool IsBounded() const { return true; }
     glm::vec3 Position() const { return glm::vec3(transform[3][0], transform[3][1], transform[3][2]); }
 
-    const Material *MaterialPtr() const { return &material; }
+    MaterialID GetMaterialID() const { return materialID; }
+    Type GetType() const { return type; }
     const Object *ObjectPtr() const { return this; }
 
     virtual ~Object() {}
 
   protected:  //  The difference between protected and private is that the protected members will still be available in subclasses.
     glm::mat4 transform;  // Usually a transformation matrix is used to decribe the position from the origin.
-    Material material;
+    MaterialID materialID;  // index of the material in the scene's material table
+    Type type;
 };
 
 //  For all those objects added into the scene. Describing them in proper ways and the implement of function Intersect() is what needs to be done.
@@ -42,43 +55,55 @@ class Object {
 //  Try something else if you like, for instance, a box?
 
 class Sphere : public Object {
-  glm::vec3 origin;
-  float radius;
+  friend class SceneCache;
+  SphereData data;
 
   public:
-    Sphere(const glm::mat4 &transform, const Material &material, glm::vec3 orn, float rad)
-      :Object(transform, material)
-      ,origin(orn)
-      ,radius(rad)
+    Sphere(const glm::mat4 &transform, MaterialID material, glm::vec3 orn, float rad)
+      :Object(transform, material, SPHERE)
+      ,data(orn, rad)
       {}
-    virtual bool Intersect(const Ray &ray, IntersectInfo &info) const;
+    const SphereData &Data() const { return data; }
+    virtual bool Intersect(const Ray &ray, HitRecord &hit) const;
+    virtual void GetSurface(const Ray &ray, const HitRecord &hit, IntersectInfo &info) const;
+    virtual bool Occluded(const Ray &ray, float tMax) const;
+    virtual AABB Bounds() const;
 };
 
 class Plane : public Object {
-  glm::vec3 point;
-  glm::vec3 normal;
+  friend class SceneCache;
+  PlaneData data;
 
   public:
-    Plane(const glm::mat4 &transform, const Material &material, glm::vec3 pt, glm::vec3 norm)
-      : Object(transform, material)
-      , point(pt)
-      , normal(glm::normalize(norm))
+    Plane(const glm::mat4 &transform, MaterialID material, glm::vec3 pt, glm::vec3 norm)
+      : Object(transform, material, PLANE)
+      , data(pt, norm)
       {}
-    virtual bool Intersect(const Ray &ray, IntersectInfo &info) const;
+    const PlaneData &Data() const { return data; }
+    virtual bool Intersect(const Ray &ray, HitRecord &hit) const;
+    virtual void GetSurface(const Ray &ray, const HitRecord &hit, IntersectInfo &info) const;
+    virtual bool Occluded(const Ray &ray, float tMax) const;
+    virtual bool IsBounded() const { return false; }
 };
 
 class Triangle : public Object {
-    glm::vec3 point1;
-    glm::vec3 point2;
-    glm::vec3 point3;
+    friend class SceneCache;
+    TriangleData data;
 
     public:
         // Need to make sure the points are in clockwise order
-        Triangle(const glm::mat4 &transform, const Material &material, glm::vec3 pt1, glm::vec3 pt2, glm::vec3 pt3)
-            : Object(transform, material)
-            , point1(pt1)
-            , point2(pt2)
-            , point3(pt3)
+        Triangle(const glm::mat4 &transform, MaterialID material, glm::vec3 pt1, glm::vec3 pt2, glm::vec3 pt3)
+            : Object(transform, material, TRIANGLE)
+            , data(pt1, pt2, pt3)
+            {}
+        // From the precomputed edges, so a triangle read back from a scene cache is exactly the one saved
+        Triangle(const glm::mat4 &transform, MaterialID material, const TriangleData &triangleData)
+            : Object(transform, material, TRIANGLE)
+            , data(triangleData)
             {}
-        virtual bool Intersect(const Ray &ray, IntersectInfo &info) const;
+        const TriangleData &Data() const { return data; }
+        virtual bool Intersect(const Ray &ray, HitRecord &hit) const;
+        virtual void GetSurface(const Ray &ray, const HitRecord &hit, IntersectInfo &info) const;
+        virtual bool Occluded(const Ray &ray, float tMax) const;
+        virtual AABB Bounds() const;
 };
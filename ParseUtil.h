@@ -0,0 +1,170 @@
+#pragma once
+
+#include <stdint.h>
+#include <cmath>
+#include <cstring>
+
+/*
+** Small helpers for parsing text in place. They all work on a cursor p into a buffer that ends
+** at end and is not null terminated, move the cursor past whatever they read, and never allocate.
+*/
+namespace Parse {
+
+inline bool IsSpace(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+inline bool IsDigit(char c) { return c >= '0' && c <= '9'; }
+
+/* Skips spaces and tabs, but not the end of the line */
+inline void SkipSpaces(const char *&p, const char *end) {
+    while (p < end && IsSpace(*p)) {
+        ++p;
+    }
+}
+
+/* Moves p to the start of the next line */
+inline void SkipLine(const char *&p, const char *end) {
+    const char *newline = (const char *)memchr(p, '\n', end - p);
+    p = newline ? newline + 1 : end;
+}
+
+/* Returns the end of the current line, not including the newline */
+inline const char *LineEnd(const char *p, const char *end) {
+    const char *newline = (const char *)memchr(p, '\n', end - p);
+    return newline ? newline : end;
+}
+
+/* The line number of the position p in a buffer starting at begin, for error messages */
+inline int LineNumber(const char *begin, const char *p) {
+    int line = 1;
+    for (const char *c = begin; c < p; ++c) {
+        if (*c == '\n') {
+            line++;
+        }
+    }
+    return line;
+}
+
+/* True if the text at p is keyword followed by a space or the end of the line, and skips it */
+inline bool MatchKeyword(const char *&p, const char *end, const char *keyword) {
+    size_t length = strlen(keyword);
+    if ((size_t)(end - p) < length || memcmp(p, keyword, length) != 0) {
+        return false;
+    }
+    const char *after = p + length;
+    if (after < end && !IsSpace(*after) && *after != '\n') {
+        return false;
+    }
+    p = after;
+    return true;
+}
+
+/* Reads the next word, which is anything up to a space or the end of the line */
+inline bool ParseWord(const char *&p, const char *end, const char *&wordBegin, const char *&wordEnd) {
+    SkipSpaces(p, end);
+    wordBegin = p;
+    while (p < end && !IsSpace(*p) && *p != '\n') {
+        ++p;
+    }
+    wordEnd = p;
+    return wordEnd > wordBegin;
+}
+
+inline bool WordEquals(const char *wordBegin, const char *wordEnd, const char *text) {
+    size_t length = strlen(text);
+    return (size_t)(wordEnd - wordBegin) == length && memcmp(wordBegin, text, length) == 0;
+}
+
+inline bool ParseInt(const char *&p, const char *end, long long &value) {
+    const char *s = p;
+    bool negative = false;
+    if (s < end && (*s == '-' || *s == '+')) {
+        negative = *s == '-';
+        ++s;
+    }
+    if (s >= end || !IsDigit(*s)) {
+        return false;
+    }
+    long long result = 0;
+    while (s < end && IsDigit(*s)) {
+        result = result * 10 + (*s - '0');
+        ++s;
+    }
+    value = negative ? -result : result;
+    p = s;
+    return true;
+}
+
+/*
+** Reads a decimal floating point number such as -1.25e-3. The digits are gathered into a 64 bit
+** integer and scaled by a power of ten once at the end, which is exact to float precision for
+** anything a mesh or scene file contains and much faster than strtof.
+*/
+inline bool ParseFloat(const char *&p, const char *end, float &value) {
+    static const double powersOfTen[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    const char *s = p;
+    bool negative = false;
+    if (s < end && (*s == '-' || *s == '+')) {
+        negative = *s == '-';
+        ++s;
+    }
+    uint64_t mantissa = 0;
+    int significantDigits = 0;
+    int exponent = 0;
+    bool anyDigits = false;
+    while (s < end && IsDigit(*s)) {
+        if (significantDigits < 19) {
+            mantissa = mantissa * 10 + (*s - '0');
+            if (mantissa != 0) {
+                significantDigits++;
+            }
+        } else {
+            exponent++;
+        }
+        anyDigits = true;
+        ++s;
+    }
+    if (s < end && *s == '.') {
+        ++s;
+        while (s < end && IsDigit(*s)) {
+            if (significantDigits < 19) {
+                mantissa = mantissa * 10 + (*s - '0');
+                if (mantissa != 0) {
+                    significantDigits++;
+                }
+                exponent--;
+            }
+            anyDigits = true;
+            ++s;
+        }
+    }
+    if (!anyDigits) {
+        return false;
+    }
+    if (s < end && (*s == 'e' || *s == 'E')) {
+        const char *exponentStart = s + 1;
+        long long exponentValue;
+        if (ParseInt(exponentStart, end, exponentValue)) {
+            exponent += (int)exponentValue;
+            s = exponentStart;
+        }
+    }
+    double result = (double)mantissa;
+    if (exponent < 0) {
+        result = -exponent <= 22 ? result / powersOfTen[-exponent] : result * std::pow(10.0, exponent);
+    } else if (exponent > 0) {
+        result = exponent <= 22 ? result * powersOfTen[exponent] : result * std::pow(10.0, exponent);
+    }
+    value = (float)(negative ? -result : result);
+    p = s;
+    return true;
+}
+
+/* Skips spaces and reads a float, for whitespace separated lists of numbers */
+inline bool NextFloat(const char *&p, const char *end, float &value) {
+    SkipSpaces(p, end);
+    return ParseFloat(p, end, value);
+}
+
+}
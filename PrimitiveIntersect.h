@@ -0,0 +1,62 @@
+#pragma once
+
+#include "Ray.h"
+
+// A sphere as the intersection test wants it, with nothing else in the way
+struct SphereData {
+    glm::vec3 center;
+    float radius;
+
+    SphereData() {}
+    SphereData(const glm::vec3 &c, float r):
+        center(c),
+        radius(r)
+    {}
+};
+
+// A plane through point, normal is of unit length
+struct PlaneData {
+    glm::vec3 point;
+    glm::vec3 normal;
+
+    PlaneData() {}
+    PlaneData(const glm::vec3 &p, const glm::vec3 &n):
+        point(p),
+        normal(glm::normalize(n))
+    {}
+};
+
+/*
+** Ray/sphere intersection, solving the quadratic written with half of the b term:
+**   oc = origin - centre, b = dot(oc, d), c = dot(oc, oc) - r^2, discriminant = b^2 - a c
+** Only the nearer root counts, so a sphere the ray starts inside of is not hit. On a hit in [0, tMax)
+** it returns true with the distance t along the ray.
+*/
+inline bool IntersectSphere(const Ray &ray, const SphereData &sphere, float tMax, float &t) {
+    glm::vec3 offset = ray.origin - sphere.center;
+    float b = glm::dot(ray.direction, offset);
+    float c = glm::dot(offset, offset) - sphere.radius * sphere.radius;
+    // the ray starts outside the sphere and points away from it
+    if (c > 0 && b > 0) {
+        return false;
+    }
+    float a = glm::dot(ray.direction, ray.direction);
+    float discriminant = b * b - a * c;
+    if (discriminant < 0) {
+        return false;
+    }
+    // the sqrt is always positive, so the negative version of the quadratic solution is the closer one
+    t = (-b - sqrtf(discriminant)) / a;
+    return t >= 0 && t < tMax;
+}
+
+/* Ray/plane intersection, on a hit in (0, tMax) it returns true with the distance t along the ray */
+inline bool IntersectPlane(const Ray &ray, const PlaneData &plane, float tMax, float &t) {
+    float angle = glm::dot(ray.direction, plane.normal);
+    // the ray runs parallel to the plane
+    if (angle == 0) {
+        return false;
+    }
+    t = glm::dot(plane.point - ray.origin, plane.normal) / angle;
+    return t > 0 && t < tMax;
+}
@@ -1,9 +1,14 @@
 #pragma once
 
+#include <vector>
+#include <limits>
+#include <cmath>
+#include <stdint.h>
+
 #include "glm/glm.hpp"
 #include "glm/gtc/matrix_transform.hpp"
 
-class Material;
+#include "Material.h"
 
 class Ray {
   public:
@@ -21,6 +26,154 @@ class Ray {
     }
 };
 
+/*
+** A batch of rays stored as a structure of arrays: all the x coordinates of the origins
+** together, then all the y coordinates and so on. This is the layout SIMD code works on.
+*/
+class RayBatch {
+  public:
+    std::vector<float> originX, originY, originZ;
+    std::vector<float> directionX, directionY, directionZ;
+
+    void Resize(int size) {
+      originX.resize(size);
+      originY.resize(size);
+      originZ.resize(size);
+      directionX.resize(size);
+      directionY.resize(size);
+      directionZ.resize(size);
+    }
+
+    int Size() const { return (int)originX.size(); }
+
+    Ray Get(int i) const {
+      return Ray(glm::vec3(originX[i], originY[i], originZ[i]), glm::vec3(directionX[i], directionY[i], directionZ[i]));
+    }
+};
+
+/*
+** Up to MAX_SIZE coherent rays, such as the primary rays of a small block of pixels or the shadow
+** rays of those pixels towards one light, which walk the acceleration structures together. The rays
+** are stored as a structure of arrays like RayBatch, but in fixed size arrays so a packet can live on
+** the stack, along with the reciprocals of the directions the slab tests use.
+** Once every ray has been Set(), ComputeBounds() works out whether the rays all go the same way
+** along each axis and the range their origins and reciprocal directions cover, which is what lets
+** the BVH cull a node for the whole packet at once.
+*/
+class RayPacket {
+  public:
+    static const int MAX_SIZE = 16;
+
+    RayPacket(): size(0), coherent(false) {}
+
+    void Set(int lane, const Ray &ray) {
+      originX[lane] = ray.origin.x;
+      originY[lane] = ray.origin.y;
+      originZ[lane] = ray.origin.z;
+      directionX[lane] = ray.direction.x;
+      directionY[lane] = ray.direction.y;
+      directionZ[lane] = ray.direction.z;
+      invDirectionX[lane] = 1.0f / ray.direction.x;
+      invDirectionY[lane] = 1.0f / ray.direction.y;
+      invDirectionZ[lane] = 1.0f / ray.direction.z;
+    }
+
+    Ray Get(int lane) const {
+      return Ray(glm::vec3(originX[lane], originY[lane], originZ[lane]), glm::vec3(directionX[lane], directionY[lane], directionZ[lane]));
+    }
+
+    /* A mask with a bit set for each of the size rays */
+    uint32_t FullMask() const { return (1u << size) - 1; }
+
+    /* Call once the first size rays have been Set() */
+    void ComputeBounds() {
+      coherent = size > 0;
+      originMin = invDirectionMin = glm::vec3(std::numeric_limits<float>::infinity());
+      originMax = invDirectionMax = glm::vec3(-std::numeric_limits<float>::infinity());
+      for (int lane = 0; lane < size; ++lane) {
+        glm::vec3 origin(originX[lane], originY[lane], originZ[lane]);
+        glm::vec3 invDirection(invDirectionX[lane], invDirectionY[lane], invDirectionZ[lane]);
+        originMin = glm::min(originMin, origin);
+        originMax = glm::max(originMax, origin);
+        invDirectionMin = glm::min(invDirectionMin, invDirection);
+        invDirectionMax = glm::max(invDirectionMax, invDirection);
+        for (int axis = 0; axis < 3; ++axis) {
+          // a ray parallel to a slab has an infinite reciprocal, which the interval test cannot bound
+          if (!(std::fabs(invDirection[axis]) < std::numeric_limits<float>::infinity())) {
+            coherent = false;
+          }
+        }
+      }
+      for (int axis = 0; axis < 3; ++axis) {
+        directionIsNegative[axis] = invDirectionMax[axis] < 0;
+        if (!directionIsNegative[axis] && invDirectionMin[axis] < 0) {
+          coherent = false;
+        }
+      }
+    }
+
+    int size;
+    alignas(16) float originX[MAX_SIZE];
+    alignas(16) float originY[MAX_SIZE];
+    alignas(16) float originZ[MAX_SIZE];
+    alignas(16) float directionX[MAX_SIZE];
+    alignas(16) float directionY[MAX_SIZE];
+    alignas(16) float directionZ[MAX_SIZE];
+    alignas(16) float invDirectionX[MAX_SIZE];
+    alignas(16) float invDirectionY[MAX_SIZE];
+    alignas(16) float invDirectionZ[MAX_SIZE];
+
+    // Set by ComputeBounds(). A packet is coherent when every ray goes the same way along each axis,
+    // only then are the ranges below tight enough to cull with and the children visited in one order.
+    bool coherent;
+    bool directionIsNegative[3];
+    glm::vec3 originMin, originMax;
+    glm::vec3 invDirectionMin, invDirectionMax;
+};
+
+/* The index of the lowest set bit of a non zero mask of packet lanes */
+inline int LowestLane(uint32_t lanes) {
+#if defined(__GNUC__)
+  return __builtin_ctz(lanes);
+#else
+  int lane = 0;
+  while (!(lanes >> lane & 1)) {
+    ++lane;
+  }
+  return lane;
+#endif
+}
+
+class Object;
+
+/*
+** What the intersection tests report while the closest hit is being searched for: the distance along
+** the ray, which object and which of its primitives was hit, and the barycentric coordinates of the
+** hit on that primitive. time starts at the furthest distance a hit may be at, and each closer hit
+** lowers it, so every test after it can reject anything further away straight away.
+** The hit point, normal and material are only worked out once, for the closest hit, by Object::GetSurface().
+*/
+class HitRecord {
+  public:
+    HitRecord(float tMax = std::numeric_limits<float>::infinity()):
+      time(tMax),
+      object(NULL),
+      primitive(0),
+      u(0.0f),
+      v(0.0f)
+    {}
+
+    /* The time along the ray of the closest hit so far */
+    float time;
+    /* The object that was hit, NULL if nothing has been hit yet */
+    const Object *object;
+    /* Which part of the object was hit, such as a triangle of a mesh or a sphere of a sphere set */
+    uint32_t primitive;
+    /* The barycentric coordinates of the hit on a triangle */
+    float u, v;
+};
+
+// The shading information of the closest hit, worked out from its HitRecord
 class IntersectInfo {
   public:
 
@@ -28,14 +181,14 @@ class IntersectInfo {
       time(std::numeric_limits<float>::infinity()),
       hitPoint(0.0f),
       normal(0.0f),
-      material(NULL)
+      materialID(0)
     {}
     // It allows you to init variables in another way. Equal to:
     // IntersectInfo(){
     //   time = std::numeric_limits<float>::infinity();
     //   hitPoint = 0.0f;
     //   normal = 0.0f;
-    //   material = NULL;
+    //   materialID = 0;
     // }
 
     /* The position of the intersection in 3D coordinates */
@@ -44,13 +197,13 @@ class IntersectInfo {
     glm::vec3 normal;
     /* The time along the ray that the intersection occurs */
     float time;
-    /* The material of the object that was intersected */
-    const Material *material;
+    /* The material of the object that was intersected, as an index into the scene's material table */
+    MaterialID materialID;
 
     // Reloading "operator =" for class IntersectInfo
     IntersectInfo &operator =(const IntersectInfo &rhs) {
       hitPoint = rhs.hitPoint;
-      material = rhs.material;
+      materialID = rhs.materialID;
       normal = rhs.normal;
       time = rhs.time;
       return *this;
@@ -62,10 +215,12 @@ class Payload {//In this case, it stands for the light particle shot from a cert
     Payload():
       color(0.0f),
       numBounces(0),
-      currentRefractiveIndex(1)
+      currentRefractiveIndex(1),
+      randomState(1)
     {}
 
-    glm::vec3 color;//  Each time, intersecting with something will change the color of this Payload.
+    glm::vec3 color;//  The colour CastRay() found for the ray, with all its reflections and refractions added in.
     int numBounces; //  To make the calculation not so expensive, Ray hits more times than a certain number of bounces will not be taken into consideration.
-    float currentRefractiveIndex;
+    float currentRefractiveIndex;// What the ray starts out travelling through, each reflected or refracted ray keeps track of its own.
+    uint32_t randomState;// For the Russian roulette, seeded from the pixel so the image is the same however the work is split up.
 };
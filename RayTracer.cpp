@@ -4,11 +4,28 @@ int windowX = 640;
 int windowY = 480;
 
 // Lighting constants
-const glm::vec3 lightPosition(-150, 300, 10);
-const glm::vec3 lightIntensity(1, 1, 1);
 const float specularIntensity = 10.0;
 const float EPSILON = 0.01;
-const int REFLECTION_LIMIT = 6;
+
+// The lights in the scene, set up along with the objects
+std::vector<Light> lights;
+// How many times a ray may bounce, scene files can change this
+int reflectionLimit = 6;
+// Reflection and refraction rays that would add less than this share to their pixel are not traced.
+// With russianRoulette they are instead traced with a chance of their share over minRayWeight, and
+// count for minRayWeight when they are, which leaves the average colour of the pixel as it was.
+float minRayWeight = 0.001f;
+bool russianRoulette = false;
+// Render with RenderTileWavefront instead of following one pixel's rays at a time
+bool wavefront = false;
+// How many coherent rays are traced together as a RayPacket, 4, 8 or 16, or 1 to trace every ray on its own.
+// The primary rays of a block of pixels make up a packet, as do their shadow rays towards one light.
+int packetSize = RayPacket::MAX_SIZE;
+
+/* The width of the block of pixels whose primary rays make up a packet, the blocks are 2x2, 4x2 or 4x4 */
+int PacketBlockWidth(int size) {
+	return size >= 8 ? 4 : (size >= 2 ? 2 : 1);
+}
 
 /*
 ** std::vector is a data format similar with list in most of  script language,
@@ -19,12 +36,216 @@ const int REFLECTION_LIMIT = 6;
 */
 std::vector<Object*> objects;
 
+// Meshes and sphere sets that are placed in the scene by Instances instead of being objects themselves,
+// each one is built once in its own space however many instances refer to it
+std::vector<Object*> geometries;
+
+// Every material in the scene, the objects refer to them by their index in here
+std::vector<Material> materials;
+
+MaterialID AddMaterial(const Material &material) {
+	materials.push_back(material);
+	return (MaterialID)(materials.size() - 1);
+}
+
+// The finite objects are kept in a BVH so each ray only has to test the few objects near it.
+// Planes never end so they cannot be put in a box and are instead tested against every ray.
+// This is the top level of the scene, meshes, sphere sets and the geometry of instances each
+// have their own BVH over their primitives below it.
+BVH objectBVH;
+std::vector<Object*> boundedObjects;
+std::vector<Object*> unboundedObjects;
+// The box of each bounded object as the BVH last saw it, and where each object is in boundedObjects, -1 for none
+std::vector<AABB> boundedBounds;
+std::vector<int> boundedIndex;
+// The bounded objects that have moved since the BVH was last brought up to date
+std::vector<uint32_t> movedObjects;
+// A part of the BVH is rebuilt once moving objects have made it this many times as costly to trace as when it was built
+const float BVH_REBUILD_THRESHOLD = 1.5f;
+
+// The spheres and triangles among the bounded objects are copied into flat arrays, in the order the
+// BVH's leaves list them, and so are the planes among the unbounded ones. The leaves then test them
+// inline by their type instead of fetching each object from wherever it was allocated and calling
+// it through Object. Meshes, sphere sets and instances are OTHER and still called, they do enough
+// work in each call that it makes no difference.
+struct ObjectSlot {
+	Object::Type type;
+	// where its data is in the array for its type
+	uint32_t index;
+};
+std::vector<ObjectSlot> boundedSlots;
+std::vector<SphereData> sphereData;
+std::vector<TriangleData> triangleData;
+// the planes are moved to the front of unboundedObjects, planeData[i] is unboundedObjects[i]
+std::vector<PlaneData> planeData;
+
+// The camera the frame is rendered from
+Camera camera;
+
+// The worker threads used to render the tiles, created in main()
+ThreadPool *threadPool = NULL;
+
 void cleanup() {
 	for(unsigned int i = 0; i < objects.size(); ++i){
 		if(objects[i]){
 			delete objects[i];
 		}
 	}
+	// the instances are gone, so nothing refers to the shared geometry any more
+	for(unsigned int i = 0; i < geometries.size(); ++i){
+		delete geometries[i];
+	}
+	delete threadPool;
+}
+
+/*
+** Sorts the objects into the bounded and unbounded lists and builds the BVH over the bounded ones.
+** This needs to be called again whenever the objects vector changes. A scene cache holds the BVH
+** already, after loading one pass prebuilt = true to keep it instead of building it again.
+*/
+void BuildAccelerationStructure(bool prebuilt) {
+	boundedObjects.clear();
+	unboundedObjects.clear();
+	boundedBounds.clear();
+	boundedIndex.assign(objects.size(), -1);
+	movedObjects.clear();
+	for (unsigned int i = 0; i < objects.size(); ++i) {
+		if (objects[i]->IsBounded()) {
+			boundedIndex[i] = (int)boundedObjects.size();
+			boundedObjects.push_back(objects[i]);
+			boundedBounds.push_back(objects[i]->Bounds());
+		} else {
+			unboundedObjects.push_back(objects[i]);
+		}
+	}
+	if (!prebuilt) {
+		objectBVH.Build(boundedBounds);
+	}
+
+	boundedSlots.assign(boundedObjects.size(), ObjectSlot());
+	sphereData.clear();
+	triangleData.clear();
+	const uint32_t *leafOrder = objectBVH.IndexData();
+	for (unsigned int i = 0; i < boundedObjects.size(); ++i) {
+		uint32_t index = leafOrder ? leafOrder[i] : i;
+		const Object *object = boundedObjects[index];
+		ObjectSlot &slot = boundedSlots[index];
+		slot.type = object->GetType();
+		if (slot.type == Object::SPHERE) {
+			slot.index = (uint32_t)sphereData.size();
+			sphereData.push_back(static_cast<const Sphere *>(object)->Data());
+		} else if (slot.type == Object::TRIANGLE) {
+			slot.index = (uint32_t)triangleData.size();
+			triangleData.push_back(static_cast<const Triangle *>(object)->Data());
+		} else {
+			slot.type = Object::OTHER;
+			slot.index = 0;
+		}
+	}
+	std::stable_partition(unboundedObjects.begin(), unboundedObjects.end(), [](const Object *object) {
+		return object->GetType() == Object::PLANE;
+	});
+	planeData.clear();
+	for (unsigned int i = 0; i < unboundedObjects.size() && unboundedObjects[i]->GetType() == Object::PLANE; ++i) {
+		planeData.push_back(static_cast<const Plane *>(unboundedObjects[i])->Data());
+	}
+}
+
+/*
+** Tests the ray against boundedObjects[index], the spheres and triangles inline from their flat
+** arrays and anything else through its Intersect(), filling in hit the same way either way
+*/
+inline bool IntersectBounded(const Ray &ray, uint32_t index, HitRecord &hit) {
+	const ObjectSlot &slot = boundedSlots[index];
+	float t, u, v;
+	switch (slot.type) {
+	case Object::SPHERE:
+		if (!IntersectSphere(ray, sphereData[slot.index], hit.time, t)) {
+			return false;
+		}
+		break;
+	case Object::TRIANGLE:
+		if (!IntersectTriangle(ray, triangleData[slot.index], hit.time, t, u, v)) {
+			return false;
+		}
+		hit.u = u;
+		hit.v = v;
+		break;
+	default:
+		return boundedObjects[index]->Intersect(ray, hit);
+	}
+	hit.time = t;
+	hit.object = boundedObjects[index];
+	return true;
+}
+
+inline bool OccludedBounded(const Ray &ray, uint32_t index, float tMax) {
+	const ObjectSlot &slot = boundedSlots[index];
+	float t, u, v;
+	switch (slot.type) {
+	case Object::SPHERE:
+		return IntersectSphere(ray, sphereData[slot.index], tMax, t);
+	case Object::TRIANGLE:
+		return IntersectTriangle(ray, triangleData[slot.index], tMax, t, u, v);
+	default:
+		return boundedObjects[index]->Occluded(ray, tMax);
+	}
+}
+
+/* The unbounded objects, the planes inline */
+inline void IntersectUnbounded(const Ray &ray, HitRecord &hit) {
+	size_t numPlanes = planeData.size();
+	for (size_t i = 0; i < numPlanes; ++i) {
+		float t;
+		if (IntersectPlane(ray, planeData[i], hit.time, t)) {
+			hit.time = t;
+			hit.object = unboundedObjects[i];
+		}
+	}
+	for (size_t i = numPlanes; i < unboundedObjects.size(); ++i) {
+		unboundedObjects[i]->Intersect(ray, hit);
+	}
+}
+
+inline bool OccludedUnbounded(const Ray &ray, float tMax) {
+	size_t numPlanes = planeData.size();
+	for (size_t i = 0; i < numPlanes; ++i) {
+		float t;
+		if (IntersectPlane(ray, planeData[i], tMax, t)) {
+			return true;
+		}
+	}
+	for (size_t i = numPlanes; i < unboundedObjects.size(); ++i) {
+		if (unboundedObjects[i]->Occluded(ray, tMax)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+** Records that objects[index] has moved or changed shape. Nothing is done until the next frame,
+** so an object can be marked any number of times in between.
+*/
+void MarkObjectDirty(unsigned int index) {
+	if (index < boundedIndex.size() && boundedIndex[index] >= 0) {
+		movedObjects.push_back((uint32_t)boundedIndex[index]);
+	}
+}
+
+/*
+** Refits the BVH to the objects marked since the last frame, rebuilding the parts of it that have
+** got too much worse, so the work done depends on how much moved rather than on the size of the scene.
+*/
+void UpdateAccelerationStructure() {
+	if (movedObjects.empty()) {
+		return;
+	}
+	for (unsigned int i = 0; i < movedObjects.size(); ++i) {
+		boundedBounds[movedObjects[i]] = boundedObjects[movedObjects[i]]->Bounds();
+	}
+	objectBVH.Update(boundedBounds, movedObjects, BVH_REBUILD_THRESHOLD);
+	movedObjects.clear();
 }
 
 /*
@@ -32,207 +253,726 @@ void cleanup() {
 ** If an object is hit then the IntersectionInfo object should contain
 ** the information about the intersection. Returns true if any object is hit,
 ** false otherwise
-**
+** While searching, the objects only keep the HitRecord of the closest hit up to date,
+** the hit point, normal and material are worked out once at the end for the object that won.
 */
 bool CheckIntersection(const Ray &ray, IntersectInfo &info) {
-	IntersectInfo closestObjectInfo;
-	closestObjectInfo.time = LONG_MAX;
-	bool intersects = false;
-	// Check for intersection with all objects
-	for (int i=0; i<objects.size(); i++) {
-		IntersectInfo currentInfo;
-		if (objects[i]->Intersect(ray, currentInfo)) {
-			// find the object closest to the origin of the ray
-			if (currentInfo.time < closestObjectInfo.time) {
-				intersects = true;
-				closestObjectInfo = currentInfo;
+	HitRecord hit;
+	// Check the unbounded objects first, they are usually walls and floors which
+	// limit how far the ray has to be followed through the BVH
+	IntersectUnbounded(ray, hit);
+	// hit.time is the BVH's tMax as well, so every closer hit an object finds also
+	// stops the BVH visiting nodes further away than it
+	objectBVH.Intersect(ray, hit.time, [&](uint32_t index, float &) {
+		return IntersectBounded(ray, index, hit);
+	});
+	if (!hit.object) {
+		return false;
+	}
+	hit.object->GetSurface(ray, hit, info);
+	return true;
+}
+
+/*
+** Returns true if any object blocks the ray before it has travelled tMax.
+** Unlike CheckIntersection this stops at the first blocker it finds and
+** never works out where the ray hit or what it hit.
+*/
+bool CheckOcclusion(const Ray &ray, float tMax) {
+	if (OccludedUnbounded(ray, tMax)) {
+		return true;
+	}
+	return objectBVH.Occluded(ray, tMax, [&](uint32_t index, float maxTime) {
+		return OccludedBounded(ray, index, maxTime);
+	});
+}
+
+/*
+** CheckIntersection for every ray of a packet, the rays walk the BVH and the objects' own BVHs together.
+** info[lane] is filled in for each ray that hits something, and the mask of those rays is returned.
+*/
+uint32_t CheckIntersectionPacket(const RayPacket &packet, IntersectInfo *info) {
+	HitRecord hits[RayPacket::MAX_SIZE];
+	float tMax[RayPacket::MAX_SIZE];
+	uint32_t lanes = packet.FullMask();
+	for (int lane = 0; lane < packet.size; ++lane) {
+		IntersectUnbounded(packet.Get(lane), hits[lane]);
+		tMax[lane] = hits[lane].time;
+	}
+	objectBVH.IntersectPacket(packet, tMax, lanes, [&](uint32_t index, uint32_t objectLanes) {
+		if (boundedSlots[index].type != Object::OTHER) {
+			for (uint32_t bits = objectLanes; bits; bits &= bits - 1) {
+				int lane = LowestLane(bits);
+				IntersectBounded(packet.Get(lane), index, hits[lane]);
+				tMax[lane] = hits[lane].time;
 			}
+			return;
+		}
+		boundedObjects[index]->IntersectPacket(packet, objectLanes, hits);
+		for (int lane = 0; lane < packet.size; ++lane) {
+			tMax[lane] = hits[lane].time;
+		}
+	});
+	uint32_t hitLanes = 0;
+	for (int lane = 0; lane < packet.size; ++lane) {
+		if (hits[lane].object) {
+			hits[lane].object->GetSurface(packet.Get(lane), hits[lane], info[lane]);
+			hitLanes |= 1u << lane;
 		}
 	}
-	// save the closest object info
-	info = closestObjectInfo;
-	return intersects;
+	return hitLanes;
 }
 
-glm::vec3 GetPhongColor(const Ray &ray, IntersectInfo &info){
-	glm::vec3 color;
+/* CheckOcclusion for every ray of a packet, returns the mask of the rays blocked before their tMax */
+uint32_t CheckOcclusionPacket(const RayPacket &packet, const float *tMax) {
+	uint32_t lanes = packet.FullMask();
+	uint32_t occluded = 0;
+	for (int lane = 0; lane < packet.size; ++lane) {
+		if (OccludedUnbounded(packet.Get(lane), tMax[lane])) {
+			occluded |= 1u << lane;
+		}
+	}
+	return occluded | objectBVH.OccludedPacket(packet, tMax, lanes & ~occluded, [&](uint32_t index, uint32_t objectLanes) {
+		if (boundedSlots[index].type == Object::OTHER) {
+			return boundedObjects[index]->OccludedPacket(packet, objectLanes, tMax);
+		}
+		uint32_t blocked = 0;
+		for (uint32_t bits = objectLanes; bits; bits &= bits - 1) {
+			int lane = LowestLane(bits);
+			if (OccludedBounded(packet.Get(lane), index, tMax[lane])) {
+				blocked |= 1u << lane;
+			}
+		}
+		return blocked;
+	});
+}
 
+// The diffuse and specular light one light adds to the hit point, the ambient colour is added once by CastRay
+glm::vec3 GetPhongColor(const Ray &ray, const IntersectInfo &info, const Material &material, const Light &light){
 	glm::vec3 surfaceNorm = info.normal;
-	glm::vec3 lightVec = glm::normalize(lightPosition - info.hitPoint);
+	glm::vec3 lightVec = glm::normalize(light.position - info.hitPoint);
 	glm::vec3 camPos = glm::normalize(ray.origin - info.hitPoint);
 	// use max to clamp the cosAlpha above 0
 	float cosAlpha = glm::dot(((2.0f * surfaceNorm * glm::dot(lightVec, surfaceNorm)) - lightVec), camPos);
 	cosAlpha = fmax(0.0f, cosAlpha);
-	float glossMutiplier = pow(cosAlpha, info.material->glossiness);
+	float glossMutiplier = pow(cosAlpha, material.glossiness);
 
-	glm::vec3 ambient = info.material->ambient;
-	glm::vec3 diffuse = info.material->diffuse * glm::dot(lightVec, surfaceNorm);
-	glm::vec3 specular = info.material->specular * glossMutiplier;
+	glm::vec3 diffuse = material.diffuse * glm::dot(lightVec, surfaceNorm);
+	glm::vec3 specular = material.specular * glossMutiplier;
 
 	// use max to clamp the diffuse above 0
 	diffuse.x = fmax(0.0f, diffuse.x);
 	diffuse.y = fmax(0.0f, diffuse.y);
 	diffuse.z = fmax(0.0f, diffuse.z);
 
-	return lightIntensity * (specular + diffuse + ambient);
+	return light.intensity * (specular + diffuse);
 }
 
-bool InShadow(const glm::vec3 shadowOrigin) {
-	IntersectInfo shadowInfo;
-	Ray shadowRayRaw = Ray(shadowOrigin, glm::normalize(lightPosition - shadowOrigin));
-	// fix for floating point inaccuracies
-	Ray shadowRay = Ray(shadowRayRaw(EPSILON), glm::normalize(lightPosition - shadowRayRaw(EPSILON)));
-
+/* The ray from a point towards a light, and how far it has to go to reach it */
+Ray GetShadowRay(const glm::vec3 &shadowOrigin, const Light &light, float &lengthToLight) {
+	Ray shadowRayRaw = Ray(shadowOrigin, glm::normalize(light.position - shadowOrigin));
 	// only look for shadows up unitl the light source
-	float lengthToLight = glm::length(lightPosition - shadowOrigin);
-    for (int i=0; i<objects.size(); i++) {
-        if (objects[i]->Intersect(shadowRay, shadowInfo)) {
-            if (shadowInfo.time < lengthToLight) {
-                return true;
-            }
-        }
-    }
-    return false;
-}
-
-glm::vec3 GetReflectionColor(const Ray &ray, const IntersectInfo &info, Payload &payload, const glm::vec3 surfaceColour) {
-	// calculate the reflection, we can just reuse the same payload object
-	payload.numBounces += 1;
-	// initialise to the surface color
-
-	glm::vec3 refelectionDirection = ray.direction - 2*(glm::dot(ray.direction, info.normal)) * info.normal;
-	Ray reflectionRayRaw = Ray(info.hitPoint, glm::normalize(refelectionDirection));
+	lengthToLight = glm::length(light.position - shadowOrigin);
 	// fix for floating point inaccuracies
-	Ray reflectionRay = Ray(reflectionRayRaw(EPSILON), glm::normalize(refelectionDirection));
+	return Ray(shadowRayRaw(EPSILON), glm::normalize(light.position - shadowRayRaw(EPSILON)));
+}
 
-	if (payload.numBounces < REFLECTION_LIMIT) {
-		float reflectionTime = CastRay(reflectionRay, payload);
-		// merge the base colour and the reflection together
-		float reflectivity = info.material->reflection;
-		return (reflectivity * payload.color) + ((1-reflectivity) * surfaceColour);
-	}
-	// default to the origional color
-	return surfaceColour;
+bool InShadow(const glm::vec3 shadowOrigin, const Light &light) {
+	float lengthToLight;
+	Ray shadowRay = GetShadowRay(shadowOrigin, light, lengthToLight);
+	return CheckOcclusion(shadowRay, lengthToLight);
 }
 
-glm::vec3 GetRefractionColor(const Ray &ray, const IntersectInfo &info, Payload &payload, const glm::vec3 surfaceColour) {
-	if (info.material->refraction <= 0 || payload.currentRefractiveIndex != 1) {
-		return surfaceColour;
+/*
+** InShadow for count points and every light, shadowed[i * lights.size() + l] is set when light l is
+** blocked from point i. The shadow rays of up to packetSize points towards the same light all end at
+** the light, so they are traced together as a packet.
+*/
+void FindShadows(const glm::vec3 *points, int count, char *shadowed) {
+	int numLights = (int)lights.size();
+	for (int l = 0; l < numLights; ++l) {
+		if (packetSize <= 1) {
+			for (int i = 0; i < count; ++i) {
+				shadowed[i * numLights + l] = InShadow(points[i], lights[l]);
+			}
+			continue;
+		}
+		for (int first = 0; first < count; first += packetSize) {
+			RayPacket packet;
+			float lengthToLight[RayPacket::MAX_SIZE];
+			packet.size = std::min(packetSize, count - first);
+			for (int lane = 0; lane < packet.size; ++lane) {
+				packet.Set(lane, GetShadowRay(points[first + lane], lights[l], lengthToLight[lane]));
+			}
+			packet.ComputeBounds();
+			uint32_t occluded = CheckOcclusionPacket(packet, lengthToLight);
+			for (int lane = 0; lane < packet.size; ++lane) {
+				shadowed[(first + lane) * numLights + l] = occluded >> lane & 1;
+			}
+		}
 	}
+}
 
-	float refractionRatio = -payload.currentRefractiveIndex / (float) info.material->refractiveIndex;
-	payload.currentRefractiveIndex = info.material->refractiveIndex;
+/* The mirror direction ray leaving the hit point, started a little way off the surface */
+Ray GetReflectionRay(const Ray &ray, const IntersectInfo &info) {
+	glm::vec3 refelectionDirection = glm::normalize(ray.direction - 2*(glm::dot(ray.direction, info.normal)) * info.normal);
+	Ray reflectionRayRaw = Ray(info.hitPoint, refelectionDirection);
+	// fix for floating point inaccuracies
+	return Ray(reflectionRayRaw(EPSILON), refelectionDirection);
+}
+
+/*
+** The ray bent into a material of refractive index material.refractiveIndex from one of index
+** currentRefractiveIndex. Returns false if the light is totally reflected instead.
+*/
+bool GetRefractionRay(const Ray &ray, const IntersectInfo &info, const Material &material, float currentRefractiveIndex, Ray &refractionRay) {
+	float refractionRatio = -currentRefractiveIndex / (float) material.refractiveIndex;
 
 	// Compute the direction of the refraction ray
 	float bendedDirection =  1.0f - powf(refractionRatio,2) * (1.0f - powf(glm::dot(info.normal,-ray.direction),2));
-	float refraction;
-	if (bendedDirection >= 0) {
-		glm::vec3 refrDir = (float) (refractionRatio * (glm::dot(info.normal,-ray.direction)) - sqrtf(bendedDirection))
-				* info.normal - refractionRatio * (-ray.direction);
+	if (bendedDirection < 0) {
+		return false;
+	}
+	glm::vec3 refrDir = (float) (refractionRatio * (glm::dot(info.normal,-ray.direction)) - sqrtf(bendedDirection))
+			* info.normal - refractionRatio * (-ray.direction);
 
-		Ray refrRayRaw = Ray(info.hitPoint, refrDir);
-		Ray rayRefr = Ray(refrRayRaw(EPSILON), refrDir);
+	Ray refrRayRaw = Ray(info.hitPoint, refrDir);
+	refractionRay = Ray(refrRayRaw(EPSILON), refrDir);
+	return true;
+}
 
-		CastRay(rayRefr, payload);
-		refraction = info.material->refraction;
-	} else {
-		refraction = 0;
-	}
+/* Random numbers in [0, 1) from a xorshift generator, the state must never be 0 */
+float NextRandom(uint32_t &state) {
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return (state >> 8) / 16777216.0f;
+}
 
-	return (refraction * payload.color) + ((1-refraction) * surfaceColour);
+/* A well mixed, non zero seed for the random numbers of one pixel, so they only depend on where it is */
+uint32_t PixelSeed(int x, int y) {
+	uint32_t hash = (uint32_t)x * 0x8da6b343u ^ (uint32_t)y * 0xd8163841u;
+	hash ^= hash >> 16;
+	hash *= 0x7feb352du;
+	hash ^= hash >> 15;
+	hash *= 0x846ca68bu;
+	hash ^= hash >> 16;
+	return hash ? hash : 1;
 }
 
 /*
-** Recursive ray-casting function. It might be the most important Function in this demo cause it's the one decides the color of pixels.
-** This function is called for each pixel, and each time a ray is reflected/used
-** for shadow testing. The Payload object can be used to record information about
-** the ray trace such as the current color and the number of bounces performed.
-** This function should return either the time of intersection with an object
-** or minus one to indicate no intersection.
+** Decides whether a reflection or refraction ray that makes up weight of its pixel is worth tracing.
+** Rays under minRayWeight are dropped, or with Russian roulette survive with a chance of
+** weight / minRayWeight and have their weight raised to minRayWeight to make up for the ones lost.
 */
-//	The function CastRay() will have to deal with light(), shadow() and reflection(). The impement of them would also be important.
-float CastRay(Ray &ray, Payload &payload) {
-	IntersectInfo info;
+bool KeepRay(float &weight, uint32_t &randomState) {
+	if (weight <= 0) {
+		return false;
+	}
+	if (weight >= minRayWeight) {
+		return true;
+	}
+	if (russianRoulette && NextRandom(randomState) * minRayWeight < weight) {
+		weight = minRayWeight;
+		return true;
+	}
+	return false;
+}
 
-	if (CheckIntersection(ray, info)) {
-		glm::vec3 surfaceColour;
+/*
+** Shares out the weight of a ray that hit a surface: a surface that reflects r and refracts f of
+** the light keeps (1 - f)(1 - r) of it for its own colour, its reflection gets (1 - f) r and its
+** refraction f. No rays are made past the bounce limit or when canBounce is false, and then the
+** surface keeps their share.
+*/
+Bounce GetBounce(const Ray &ray, const IntersectInfo &info, const Material &material, float weight, int numBounces,
+	float refractiveIndex, bool canBounce) {
+	Bounce bounce;
+	canBounce = canBounce && numBounces + 1 < reflectionLimit;
+	float reflection = canBounce ? material.reflection : 0.0f;
+	float refraction = 0.0f;
+	// only rays coming from the air are bent into an object
+	if (canBounce && material.refraction > 0 && refractiveIndex == 1
+		&& GetRefractionRay(ray, info, material, refractiveIndex, bounce.refractionRay)) {
+		refraction = material.refraction;
+	}
+	bounce.surfaceWeight = weight * (1 - refraction) * (1 - reflection);
+	bounce.reflectionWeight = weight * (1 - refraction) * reflection;
+	bounce.refractionWeight = weight * refraction;
+	return bounce;
+}
 
-		// if the object is in shadow then only use ambient light
-		if (InShadow(info.hitPoint)) {
-			surfaceColour = info.material->ambient;
+// How the surface of a material is shaded, picked once per material by PrepareMaterials() so each
+// hit only runs the parts of the shading its material has
+enum ShadingModel {
+	SHADE_DIFFUSE,		// no specular highlight, reflection or refraction
+	SHADE_GLOSSY,		// a highlight but no reflection or refraction
+	SHADE_MIRROR,		// reflects but does not refract
+	SHADE_DIELECTRIC	// refracts, and may reflect as well
+};
+
+// The shading model of each material, in the order of the material table
+std::vector<ShadingModel> materialShading;
+
+void PrepareMaterials() {
+	materialShading.resize(materials.size());
+	for (unsigned int i = 0; i < materials.size(); ++i) {
+		const Material &material = materials[i];
+		if (material.refraction > 0) {
+			materialShading[i] = SHADE_DIELECTRIC;
+		} else if (material.reflection != 0) {
+			materialShading[i] = SHADE_MIRROR;
+		} else if (material.specular == glm::vec3(0.0f)) {
+			materialShading[i] = SHADE_DIFFUSE;
 		} else {
-			surfaceColour = GetPhongColor(ray, info);
+			materialShading[i] = SHADE_GLOSSY;
 		}
+	}
+}
 
-		// mix the reflection and the base colours
-		glm::vec3 reflectionColour = GetReflectionColor(ray, info, payload, surfaceColour);
-		payload.color = GetRefractionColor(ray, info, payload, reflectionColour);
+/* Shade() for one shading model, with the parts the model does not have left out when it is compiled */
+template<ShadingModel MODEL>
+Bounce ShadeWith(const Ray &ray, const IntersectInfo &info, const Material &material, float weight, int numBounces,
+	float refractiveIndex, bool canBounce, const char *shadowed, glm::vec3 &surfaceColour) {
+	surfaceColour = material.ambient;
+	for (unsigned int i = 0; i < lights.size(); ++i) {
+		if (MODEL == SHADE_DIFFUSE) {
+			// the diffuse half of GetPhongColor(), a light behind the surface adds nothing to it so
+			// there is no need to find out whether it is blocked
+			glm::vec3 lightVec = glm::normalize(lights[i].position - info.hitPoint);
+			float cosTheta = glm::dot(lightVec, info.normal);
+			if (cosTheta <= 0 || (shadowed ? shadowed[i] != 0 : InShadow(info.hitPoint, lights[i]))) {
+				continue;
+			}
+			glm::vec3 diffuse = material.diffuse * cosTheta;
+			diffuse.x = fmax(0.0f, diffuse.x);
+			diffuse.y = fmax(0.0f, diffuse.y);
+			diffuse.z = fmax(0.0f, diffuse.z);
+			surfaceColour += lights[i].intensity * diffuse;
+		} else if (!(shadowed ? shadowed[i] != 0 : InShadow(info.hitPoint, lights[i]))) {
+			surfaceColour += GetPhongColor(ray, info, material, lights[i]);
+		}
+	}
 
-		return info.time;
+	Bounce bounce;
+	if (MODEL == SHADE_DIFFUSE || MODEL == SHADE_GLOSSY) {
+		bounce.surfaceWeight = weight;
+		bounce.reflectionWeight = 0.0f;
+		bounce.refractionWeight = 0.0f;
+	} else if (MODEL == SHADE_MIRROR) {
+		// GetBounce() without the refraction
+		float reflection = canBounce && numBounces + 1 < reflectionLimit ? material.reflection : 0.0f;
+		bounce.surfaceWeight = weight * (1 - reflection);
+		bounce.reflectionWeight = weight * reflection;
+		bounce.refractionWeight = 0.0f;
+	} else {
+		bounce = GetBounce(ray, info, material, weight, numBounces, refractiveIndex, canBounce);
 	}
+	return bounce;
+}
 
-	// The Ray from camera hits nothing so nothing will be seen. In this case, the pixel should be totally black.
-	payload.color = glm::vec3(0.0f, 0.0f, 0.0f);
-	return -1.0f;
+/*
+** Shades a hit: sets surfaceColour to the ambient, diffuse and specular light at it and returns how
+** the ray's weight is shared out as GetBounce() does. shadowed[i] says whether light i is blocked from
+** the hit point, or when shadowed is NULL the shadow rays are traced as they are needed.
+*/
+Bounce Shade(const Ray &ray, const IntersectInfo &info, float weight, int numBounces, float refractiveIndex, bool canBounce,
+	const char *shadowed, glm::vec3 &surfaceColour) {
+	const Material &material = materials[info.materialID];
+	switch (materialShading[info.materialID]) {
+	case SHADE_DIFFUSE:
+		return ShadeWith<SHADE_DIFFUSE>(ray, info, material, weight, numBounces, refractiveIndex, canBounce, shadowed, surfaceColour);
+	case SHADE_GLOSSY:
+		return ShadeWith<SHADE_GLOSSY>(ray, info, material, weight, numBounces, refractiveIndex, canBounce, shadowed, surfaceColour);
+	case SHADE_MIRROR:
+		return ShadeWith<SHADE_MIRROR>(ray, info, material, weight, numBounces, refractiveIndex, canBounce, shadowed, surfaceColour);
+	default:
+		return ShadeWith<SHADE_DIELECTRIC>(ray, info, material, weight, numBounces, refractiveIndex, canBounce, shadowed, surfaceColour);
+	}
 }
 
+namespace {
 
-// Render Function
+// A ray still to be traced for the current pixel, and how much of its colour ends up in the pixel
+struct PendingRay {
+	PendingRay(): ray(glm::vec3(0.0f), glm::vec3(0.0f)) {}
+	PendingRay(const Ray &ray, float weight, int numBounces, float refractiveIndex):
+		ray(ray),
+		weight(weight),
+		numBounces(numBounces),
+		refractiveIndex(refractiveIndex)
+	{}
 
-// This is the main render function, it draws pixels onto the display
-// using GL_POINTS. It is called every time an update is required.
+	Ray ray;
+	float weight;
+	int numBounces;
+	// the refractive index of what the ray is travelling through
+	float refractiveIndex;
+};
 
-// This function transforms each pixel into the space of the virtual
-// scene and casts a ray from the camera in that direction using CastRay
-// And for rendering,
-// 1)Clear the screen so we can draw a new frame
-// 2)Cast a ray into the scene for each pixel on the screen and use the returned color to render the pixel
-// 3)Flush the pipeline so that the instructions we gave are performed.
+// Pending rays are taken off the end of the stack, so it only ever holds about one ray per bounce
+const int RAY_STACK_SIZE = 64;
 
-void Render()
-{
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);// Clear OpenGL Window
+}
+
+/*
+** Ray-casting function. It might be the most important Function in this demo cause it's the one decides the color of pixels.
+** This function is called for each pixel. The Payload gives the number of bounces and refractive
+** index the ray starts with, and gets the final colour.
+** When the primary ray was already traced as part of a packet, primaryHit is where it hit and
+** primaryShadowed says for each light whether it is blocked from there, so they are not traced again.
+** Each surface hit is shaded with the lights and shadows, and its reflection and refraction rays are
+** pushed onto a small stack along with the share of the pixel they make up, as worked out by
+** GetBounce(). The rays are traced one after the other until the stack is empty, adding each
+** surface's weighted colour to the pixel, so every ray has its own bounce count and refractive
+** index and nothing recurses. Rays that would add too little to the pixel are cut off early by KeepRay().
+** This function should return either the time of intersection with an object
+** or minus one to indicate no intersection.
+*/
+//	The function CastRay() will have to deal with light(), shadow() and reflection(). The impement of them would also be important.
+float CastRay(Ray &ray, Payload &payload, const IntersectInfo *primaryHit, const char *primaryShadowed) {
+	PendingRay stack[RAY_STACK_SIZE];
+	int stackSize = 0;
+	stack[stackSize++] = PendingRay(ray, 1.0f, payload.numBounces, payload.currentRefractiveIndex);
+	float primaryTime = -1.0f;
+	glm::vec3 color(0.0f);
+
+	while (stackSize > 0) {
+		PendingRay current = stack[--stackSize];
+		IntersectInfo info;
+		bool primary = primaryTime < 0.0f;
+		if (primary && primaryHit) {
+			info = *primaryHit;
+		} else if (!CheckIntersection(current.ray, info)) {
+			// The Ray hits nothing so nothing will be seen from it, it adds no colour.
+			continue;
+		}
+		if (primary) {
+			primaryTime = info.time;
+		}
+
+		// each light that is not blocked adds its diffuse and specular light to the ambient, and the
+		// reflection and refraction both need a free place on the stack
+		glm::vec3 surfaceColour;
+		Bounce bounce = Shade(current.ray, info, current.weight, current.numBounces, current.refractiveIndex,
+			stackSize + 2 <= RAY_STACK_SIZE, primary ? primaryShadowed : NULL, surfaceColour);
+		color += bounce.surfaceWeight * surfaceColour;
+		if (KeepRay(bounce.reflectionWeight, payload.randomState)) {
+			stack[stackSize++] = PendingRay(GetReflectionRay(current.ray, info), bounce.reflectionWeight, current.numBounces + 1, current.refractiveIndex);
+		}
+		if (KeepRay(bounce.refractionWeight, payload.randomState)) {
+			stack[stackSize++] = PendingRay(bounce.refractionRay, bounce.refractionWeight, current.numBounces + 1,
+				materials[info.materialID].refractiveIndex);
+		}
+	}
 
-	//	Three parameters of lookat(vec3 eye, vec3 center, vec3 up).
-	glm::mat4 viewMatrix = glm::lookAt(glm::vec3(-10.0f,10.0f,10.0f), glm::vec3(0.0f,0.0f,0.0f), glm::vec3(0.0f,1.0f,0.0f));
-	glm::mat4 projMatrix = glm::perspective(45.0f, (float)windowX / (float)windowY, 1.0f, 10000.0f);
+	payload.color = color;
+	return primaryTime;
+}
 
-	glBegin(GL_POINTS);	//Using GL_POINTS mode. In this mode, every vertex specified is a point.
-	//	Reference https://en.wikibooks.org/wiki/OpenGL_Programming/GLStart/Tut3 if interested.
 
-	for(int x = 0; x < windowX; ++x)
-		for(int y = 0; y < windowY; ++y){//Cover the entire display zone pixel by pixel, but without showing.
-			float pixelX =  2*((x+0.5f)/windowX)-1;	//Actually, (pixelX, pixelY) are the relative position of the point(x, y).
-			float pixelY = -2*((y+0.5f)/windowY)+1;	//The displayzone will be decribed as a 2.0f x 2.0f platform and coordinate origin is the center of the display zone.
+// Render Function
 
-			//	Decide the direction of each of the ray.
-			glm::vec4 worldNear = glm::inverse(viewMatrix) * glm::inverse(projMatrix) * glm::vec4(pixelX, pixelY, -1, 1);
-			glm::vec4 worldFar  = glm::inverse(viewMatrix) * glm::inverse(projMatrix) * glm::vec4(pixelX, pixelY,  1, 1);
-			glm::vec3 worldNearPos = glm::vec3(worldNear.x, worldNear.y, worldNear.z) / worldNear.w;
-			glm::vec3 worldFarPos  = glm::vec3(worldFar.x, worldFar.y, worldFar.z) / worldFar.w;
+// The image is cut into square tiles of this many pixels which are handed out to the render threads
+const int TILE_SIZE = 16;
 
+/*
+** Traces every pixel in the rectangle [x0, x1) x [y0, y1) of the frame.
+** Everything a ray needs while it is being traced lives on this function's stack, so any
+** number of tiles can be rendered at the same time.
+*/
+void RenderTile(int x0, int y0, int x1, int y1, Framebuffer &frame) {
+	RayBatch rays;
+	for(int y = y0; y < y1; ++y) {
+		// make the primary rays for the whole row of the tile in one go
+		camera.GenerateRays(x0, y, x1 - x0, rays);
+		for(int x = x0; x < x1; ++x){
 			Payload payload;
-			Ray ray(worldNearPos, glm::normalize(glm::vec3(worldFarPos - worldNearPos))); //Ray(const glm::vec3 &origin, const glm::vec3 &direction)
+			payload.randomState = PixelSeed(x, y);
+			Ray ray = rays.Get(x - x0);
 
 			if(CastRay(ray,payload) > 0.0f){
-				glColor3f(payload.color.x,payload.color.y,payload.color.z);
+				frame.At(x, y) = payload.color;
 			}
 			else {
-				glColor3f(1,0,0);
+				frame.At(x, y) = glm::vec3(1,0,0);
 			}
+		}
+	}
+}
 
-			glVertex3f(pixelX,pixelY,0.0f);
+/*
+** RenderTile with the primary rays traced a packet at a time. Each packet is the rays of a small block
+** of pixels, the ones that hit something have their shadow rays traced as packets too, and then
+** CastRay carries on from there one pixel at a time with the reflections and refractions.
+*/
+void RenderTilePackets(int x0, int y0, int x1, int y1, Framebuffer &frame) {
+	int blockWidth = PacketBlockWidth(packetSize);
+	int blockHeight = packetSize / blockWidth;
+	int numLights = (int)lights.size();
+	std::vector<RayBatch> rows(blockHeight);
+	std::vector<char> shadowed(RayPacket::MAX_SIZE * numLights);
+
+	for (int blockY = y0; blockY < y1; blockY += blockHeight) {
+		int numRows = std::min(blockHeight, y1 - blockY);
+		for (int row = 0; row < numRows; ++row) {
+			camera.GenerateRays(x0, blockY + row, x1 - x0, rows[row]);
 		}
+		for (int blockX = x0; blockX < x1; blockX += blockWidth) {
+			RayPacket packet;
+			int pixelX[RayPacket::MAX_SIZE], pixelY[RayPacket::MAX_SIZE];
+			packet.size = 0;
+			for (int row = 0; row < numRows; ++row) {
+				for (int x = blockX; x < std::min(blockX + blockWidth, x1); ++x) {
+					pixelX[packet.size] = x;
+					pixelY[packet.size] = blockY + row;
+					packet.Set(packet.size++, rows[row].Get(x - x0));
+				}
+			}
+			packet.ComputeBounds();
+
+			IntersectInfo info[RayPacket::MAX_SIZE];
+			uint32_t hitLanes = CheckIntersectionPacket(packet, info);
+			glm::vec3 hitPoints[RayPacket::MAX_SIZE];
+			int numHits = 0;
+			for (int lane = 0; lane < packet.size; ++lane) {
+				if (hitLanes >> lane & 1) {
+					hitPoints[numHits++] = info[lane].hitPoint;
+				}
+			}
+			FindShadows(hitPoints, numHits, shadowed.data());
+
+			for (int lane = 0, hit = 0; lane < packet.size; ++lane) {
+				if (!(hitLanes >> lane & 1)) {
+					frame.At(pixelX[lane], pixelY[lane]) = glm::vec3(1,0,0);
+					continue;
+				}
+				Payload payload;
+				payload.randomState = PixelSeed(pixelX[lane], pixelY[lane]);
+				Ray ray = packet.Get(lane);
+				CastRay(ray, payload, &info[lane], shadowed.data() + numLights * hit++);
+				frame.At(pixelX[lane], pixelY[lane]) = payload.color;
+			}
+		}
+	}
+}
+
+/*
+** Casts a ray into the scene for each pixel of the frame, one tile per task on the thread pool.
+** Each pixel only depends on the scene, so the image is the same however many threads there are.
+** Nothing here touches OpenGL, this is all the headless mode needs.
+*/
+void RenderFrame(Framebuffer &frame) {
+	UpdateAccelerationStructure();
+	camera.SetResolution(frame.width, frame.height);
+
+	int tileSize = wavefront ? WAVEFRONT_TILE_SIZE : TILE_SIZE;
+	int tilesX = (frame.width + tileSize - 1) / tileSize;
+	int tilesY = (frame.height + tileSize - 1) / tileSize;
+	threadPool->ParallelFor(tilesX * tilesY, [&](int tile) {
+		int x0 = (tile % tilesX) * tileSize;
+		int y0 = (tile / tilesX) * tileSize;
+		int x1 = std::min(x0 + tileSize, frame.width);
+		int y1 = std::min(y0 + tileSize, frame.height);
+		if (wavefront) {
+			RenderTileWavefront(x0, y0, x1, y1, frame);
+		} else if (packetSize > 1) {
+			RenderTilePackets(x0, y0, x1, y1, frame);
+		} else {
+			RenderTile(x0, y0, x1, y1, frame);
+		}
+	});
+}
 
-	glEnd();
+#ifndef HEADLESS
+
+// The frame shown in the window
+Framebuffer windowFrame;
+
+// This is the main render function, it draws the rendered frame onto the display.
+// It is called every time an update is required.
+// 1)Clear the screen so we can draw a new frame
+// 2)Render the frame into memory with RenderFrame
+// 3)Copy the whole frame to the window in one call and flush the pipeline so that the instructions we gave are performed.
+
+void Render()
+{
+	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);// Clear OpenGL Window
+
+	windowFrame.Resize(windowX, windowY);
+	RenderFrame(windowFrame);
+
+	// the frame starts with the top row, so draw downwards from the top left corner
+	glRasterPos2f(-1, 1);
+	glPixelZoom(1, -1);
+	glDrawPixels(windowFrame.width, windowFrame.height, GL_RGB, GL_FLOAT, &windowFrame.pixels[0]);
 	glFlush();
 }
 
+#endif
+
+void PrintUsage(const char *program) {
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -w <width>     width of the image in pixels (default %d)\n"
+		"  -h <height>    height of the image in pixels (default %d)\n"
+		"  -s <scene>     built in scene to render: default, particles, mesh, instances, or a scene file (default \"default\")\n"
+		"  -m <file>      .obj or .ply model to show in the mesh scene instead of the torus\n"
+		"  -c <file>      scene cache: loaded instead of the scene if it is valid, otherwise written once the scene is built\n"
+		"  -d <bounces>   maximum number of bounces, instead of the scene's own (default %d)\n"
+		"  -k <weight>    reflections and refractions adding less than this to a pixel are not traced (default %g)\n"
+		"  -r             trace some of those rays anyway with Russian roulette, which keeps the image unbiased\n"
+		"  -W             render a wave of rays at a time, sorted by material, instead of a pixel at a time\n"
+		"  -a <type>      acceleration structure: bvh, or wide for 4 wide nodes with quantized boxes (default bvh)\n"
+		"  -b <builder>   how the BVHs are built: sah, or lbvh for the much faster Morton code build (default sah)\n"
+		"  -O <passes>    rounds of treelet reoptimization after an lbvh build (default 0)\n"
+		"  -g <type>      what sphere sets use: grid, bvh, or auto to pick a grid for big sets of evenly spread spheres (default auto)\n"
+		"  -p <rays>      trace coherent rays in packets of 4, 8 or 16, or 1 to trace each ray on its own (default %d)\n"
+		"  -t <threads>   number of render threads, 0 for one per core (default 0)\n"
+		"  -o <file>      render without a window and save the image, .pfm for floating point, otherwise .ppm\n",
+		program, windowX, windowY, reflectionLimit, minRayWeight, packetSize);
+}
+
 int main(int argc, char **argv) {
+	std::string sceneName = "default";
+	std::string outputPath;
+	std::string modelPath;
+	std::string cachePath;
+	std::string accelerator = "bvh";
+	std::string builder = "sah";
+	std::string sphereAccelerator = "auto";
+	int numThreads = 0;
+	int maxDepth = -1;
+
+	for (int i = 1; i < argc; ++i) {
+		bool hasValue = i + 1 < argc;
+		if (strcmp(argv[i], "-w") == 0 && hasValue) {
+			windowX = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-h") == 0 && hasValue) {
+			windowY = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-s") == 0 && hasValue) {
+			sceneName = argv[++i];
+		} else if (strcmp(argv[i], "-m") == 0 && hasValue) {
+			modelPath = argv[++i];
+		} else if (strcmp(argv[i], "-c") == 0 && hasValue) {
+			cachePath = argv[++i];
+		} else if (strcmp(argv[i], "-d") == 0 && hasValue) {
+			maxDepth = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-k") == 0 && hasValue) {
+			minRayWeight = (float)atof(argv[++i]);
+		} else if (strcmp(argv[i], "-r") == 0) {
+			russianRoulette = true;
+		} else if (strcmp(argv[i], "-W") == 0) {
+			wavefront = true;
+		} else if (strcmp(argv[i], "-a") == 0 && hasValue) {
+			accelerator = argv[++i];
+		} else if (strcmp(argv[i], "-b") == 0 && hasValue) {
+			builder = argv[++i];
+		} else if (strcmp(argv[i], "-O") == 0 && hasValue) {
+			BVH::treeletPasses = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-g") == 0 && hasValue) {
+			sphereAccelerator = argv[++i];
+		} else if (strcmp(argv[i], "-p") == 0 && hasValue) {
+			packetSize = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-t") == 0 && hasValue) {
+			numThreads = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "-o") == 0 && hasValue) {
+			outputPath = argv[++i];
+		} else {
+			PrintUsage(argv[0]);
+			return 1;
+		}
+	}
+	if (windowX <= 0 || windowY <= 0) {
+		fprintf(stderr, "The image size must be positive\n");
+		return 1;
+	}
+	if (accelerator == "wide") {
+		// every BVH is widened as it is built or loaded from the cache
+		BVH::buildWideNodes = true;
+	} else if (accelerator != "bvh") {
+		fprintf(stderr, "Unknown acceleration structure \"%s\"\n", accelerator.c_str());
+		return 1;
+	}
+	if (builder == "lbvh") {
+		BVH::buildLinear = true;
+	} else if (builder != "sah") {
+		fprintf(stderr, "Unknown BVH builder \"%s\"\n", builder.c_str());
+		return 1;
+	}
+	if (sphereAccelerator == "grid") {
+		SphereSet::accelerator = SphereSet::ALWAYS_GRID;
+	} else if (sphereAccelerator == "bvh") {
+		SphereSet::accelerator = SphereSet::ALWAYS_BVH;
+	} else if (sphereAccelerator != "auto") {
+		fprintf(stderr, "Unknown sphere set acceleration structure \"%s\"\n", sphereAccelerator.c_str());
+		return 1;
+	}
+	if (BVH::treeletPasses < 0) {
+		fprintf(stderr, "The number of treelet passes can not be negative\n");
+		return 1;
+	}
+	if (packetSize != 1 && packetSize != 4 && packetSize != 8 && packetSize != 16) {
+		fprintf(stderr, "The packet size must be 1, 4, 8 or 16\n");
+		return 1;
+	}
+
+	// the pool is made first so the mesh loaders and the BVH builds can use it as well
+	threadPool = new ThreadPool(numThreads);
+	BVH::buildPool = threadPool;
+	atexit(cleanup);
+
+	// a valid cache replaces building the scene altogether
+	std::string cacheError;
+	bool cached = !cachePath.empty() && SceneCache::Load(cachePath, &cacheError);
+	if (!cachePath.empty() && !cached) {
+		fprintf(stderr, "Building the scene cache, %s\n", cacheError.c_str());
+	}
 
+	if (!cached) {
+		// anything that looks like a path is a scene file, otherwise it is the name of a built in scene
+		if (sceneName.find_first_of("./") != std::string::npos) {
+			std::string error;
+			if (!LoadSceneFile(sceneName, threadPool, &error)) {
+				fprintf(stderr, "%s\n", error.c_str());
+				return 1;
+			}
+		} else if (!LoadBuiltInScene(sceneName, modelPath, threadPool)) {
+			fprintf(stderr, "Could not load the scene \"%s\"\n", sceneName.c_str());
+			return 1;
+		}
+	}
+	// the command line wins over the scene
+	if (maxDepth >= 0) {
+		reflectionLimit = maxDepth;
+	}
+	BuildAccelerationStructure(cached);
+	PrepareMaterials();
+	if (!cachePath.empty() && !cached && !SceneCache::Save(cachePath, &cacheError)) {
+		fprintf(stderr, "%s\n", cacheError.c_str());
+	}
+
+	if (!outputPath.empty()) {
+		// headless mode, render a single frame straight to a file without ever touching GLUT
+		Framebuffer frame(windowX, windowY);
+		std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+		RenderFrame(frame);
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+		printf("Rendered %dx%d in %.3f s on %d threads\n", frame.width, frame.height, seconds, threadPool->NumThreads());
+		if (!frame.Save(outputPath)) {
+			fprintf(stderr, "Could not write %s\n", outputPath.c_str());
+			return 1;
+		}
+		return 0;
+	}
+
+#ifdef HEADLESS
+	fprintf(stderr, "This build has no window, use -o to choose where to save the image\n");
+	return 1;
+#else
   	//initialise OpenGL
 	glutInit(&argc, argv);
-	//Define the window size with the size specifed at the top of this file
+	//Define the window size with the size given on the command line
 	glutInitWindowSize(windowX, windowY);
 
 	//Create the window for drawing
@@ -243,62 +983,6 @@ int main(int argc, char **argv) {
 	//is called when the window must display.
 	glutDisplayFunc(Render);
 
-	// this can be used as a global transform for every object if I'm feeling lazy
-	glm::mat4 transform1(0.0f);
-
-	Material chrome = Material(glm::vec3(0.01, 0.01, 0.01), glm::vec3(0.9, 0.9, 0.9), glm::vec3(0.8, 0.8, 1.0), 20, 0.0, 0.7, 1.4);
-	Material glossGreen = Material(glm::vec3(0.01, 0.05, 0.02), glm::vec3(0.4, 0.6, 0.3), glm::vec3(0.5, 0.5, 0.5), 30, 0.1, 0, 1.0);
-	Material glossRed = Material(glm::vec3(0.05, 0.03, 0.03), glm::vec3(1.0, 0.3, 0.3), glm::vec3(0.7, 0.7, 0.7), 10, 0.2, 0, 0);
-	Material mirrorPink = Material(glm::vec3(0.05, 0.03, 0.03), glm::vec3(1.0, 0.5, 0.7), glm::vec3(0.7, 0.7, 0.7), 10, 0.4, 0, 0);
-	Material shinnyLightBlue = Material(glm::vec3(0.01, 0.05, 0.02), glm::vec3(0.3, 0.3, 1.0), glm::vec3(0.2, 0.2, 0.2), 60, 0.3, 0, 1.0);
-	Material whiteWall = Material(glm::vec3(0.3, 0.3, 0.3), glm::vec3(0.7, 0.7, 0.7), glm::vec3(0.7, 0.7, 0.7), 20, 0.5, 0, 1.0);
-	Material floorGreen = Material(glm::vec3(0.03, 0.03, 0.03), glm::vec3(0.8, 1.0, 0.9), glm::vec3(0.5, 0.5, 0.5), 20, 0.0, 0, 1.0);
-
-	Material extra1 = Material(glm::vec3(0.03, 0.03, 0.03), glm::vec3(0.9, 0.6, 0.5), glm::vec3(0.3, 0.3, 0.3), 20, 0.4, 0.0, 1.0);
-	Material extra2 = Material(glm::vec3(0.03, 0.03, 0.03), glm::vec3(0.9, 0.4, 0.3), glm::vec3(0.3, 0.3, 0.3), 10, 0.1, 0.0, 1.0);
-	Material extra3 = Material(glm::vec3(0.03, 0.03, 0.03), glm::vec3(0.7, 0.7, 0.5), glm::vec3(0.3, 0.3, 0.3), 30, 0.0, 0.0, 1.0);
-	Material extra4 = Material(glm::vec3(0.03, 0.03, 0.03), glm::vec3(0.8, 0.9, 0.6), glm::vec3(0.3, 0.3, 0.3), 50, 0.5, 0.0, 1.0);
-	Material extra5 = Material(glm::vec3(0.03, 0.03, 0.03), glm::vec3(0.8, 0.2, 0.5), glm::vec3(0.3, 0.3, 0.3), 30, 0.8, 0.0, 1.0);
-	Material extra6 = Material(glm::vec3(0.03, 0.03, 0.03), glm::vec3(0.4, 0.6, 0.2), glm::vec3(0.3, 0.3, 0.3), 90, 0.5, 0.0, 1.0);
-	Material extra7 = Material(glm::vec3(0.03, 0.03, 0.03), glm::vec3(0.8, 0.5, 0.3), glm::vec3(0.3, 0.3, 0.3), 70, 0.3, 0.1, 1.0);
-
-	Sphere sphere1(transform1, chrome, glm::vec3(150, -170, -150), 30.0);
-	Sphere sphere2(transform1, glossRed, glm::vec3(140, -180, -90), 20.0);
-	Sphere sphere3(transform1, glossGreen, glm::vec3(190, -178, -110), 22.0);
-	Sphere sphere4(transform1, shinnyLightBlue, glm::vec3(220, -181, -160), 19.0);
-	Sphere sphere5(transform1, extra1, glm::vec3(210, -182, -220), 18.0);
-	Sphere sphere6(transform1, extra2, glm::vec3(170, -182, -200), 18.0);
-	Sphere sphere7(transform1, extra3, glm::vec3(140, -181, -230), 19.0);
-	Sphere sphere8(transform1, extra4, glm::vec3(100, -178, -200), 22.0);
-	Sphere sphere9(transform1, extra6, glm::vec3(50, -181, -150), 19.0);
-	Sphere sphere10(transform1, extra7, glm::vec3(90, -181, -100), 19.0);
-
-	Triangle triangle(transform1, mirrorPink, glm::vec3(80, -200, -180), glm::vec3(120, -200, -120), glm::vec3(110, -140, -150));
-
-	Plane plane1(transform1, whiteWall, glm::vec3(0, 0, -250), glm::vec3(0, 0, 1));
-	Plane plane2(transform1, whiteWall, glm::vec3(250, 0, 0), glm::vec3(-1, 0, 0));
-	Plane floorPlane(transform1, whiteWall, glm::vec3(0, -200, 0), glm::vec3(0, 1, 0));
-	Plane roofPlane(transform1, whiteWall, glm::vec3(0, 500, 0), glm::vec3(0, -1, 0));
-
-	// use this to push objects into the vector
-	objects.push_back(&sphere1);
-	objects.push_back(&sphere2);
-	objects.push_back(&sphere3);
-	objects.push_back(&sphere4);
-	objects.push_back(&sphere5);
-	objects.push_back(&sphere6);
-	objects.push_back(&sphere7);
-	objects.push_back(&sphere8);
-	objects.push_back(&sphere9);
-	objects.push_back(&sphere10);
-
-	objects.push_back(&triangle);
-
-	objects.push_back(&plane1);
-	objects.push_back(&plane2);
-	objects.push_back(&floorPlane);
-	objects.push_back(&roofPlane);
-
-	atexit(cleanup);
 	glutMainLoop();
+#endif
 }
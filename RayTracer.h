@@ -9,16 +9,88 @@
 #include <fstream> //Provides facilities for file-based input and output.
 #include <cstring>
 #include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <string>
+#include <chrono>
 
+// The HEADLESS build renders straight to image files and does not need OpenGL at all
+#ifndef HEADLESS
+#ifdef __APPLE__
 #include <GLUT/glut.h> //OpenGL Utility Toolkits
+#else
+#include <GL/glut.h>
+#endif
+#endif
 
 #include "glm/glm.hpp"
 #include "glm/gtc/matrix_transform.hpp"
 
 #include "Ray.h"
 #include "Object.h"
+#include "BVH.h"
+#include "SphereSet.h"
+#include "TriangleMesh.h"
+#include "Instance.h"
+#include "MeshLoader.h"
+#include "ThreadPool.h"
+#include "Framebuffer.h"
+#include "Wavefront.h"
+#include "Camera.h"
+#include "Light.h"
+#include "SceneFile.h"
+#include "SceneCache.h"
 
+void BuildAccelerationStructure(bool prebuilt = false);
+void MarkObjectDirty(unsigned int index);
+void UpdateAccelerationStructure();
 bool CheckIntersection(const Ray &ray, IntersectInfo &info);
-float CastRay(Ray &ray, Payload &payload);
+bool CheckOcclusion(const Ray &ray, float tMax);
+uint32_t CheckIntersectionPacket(const RayPacket &packet, IntersectInfo *info);
+uint32_t CheckOcclusionPacket(const RayPacket &packet, const float *tMax);
+float CastRay(Ray &ray, Payload &payload, const IntersectInfo *primaryHit = NULL, const char *primaryShadowed = NULL);
+void RenderFrame(Framebuffer &frame);
+
+// How the weight of a ray that hit a surface is shared out, see GetBounce()
+struct Bounce {
+	Bounce(): refractionRay(glm::vec3(0.0f), glm::vec3(0.0f)) {}
+
+	float surfaceWeight;
+	float reflectionWeight;
+	float refractionWeight;
+	// only set when refractionWeight is not 0
+	Ray refractionRay;
+};
+
+// The pieces CastRay is made of, which the wavefront renderer puts together in its own order
+glm::vec3 GetPhongColor(const Ray &ray, const IntersectInfo &info, const Material &material, const Light &light);
+Ray GetShadowRay(const glm::vec3 &shadowOrigin, const Light &light, float &lengthToLight);
+Ray GetReflectionRay(const Ray &ray, const IntersectInfo &info);
+Bounce GetBounce(const Ray &ray, const IntersectInfo &info, const Material &material, float weight, int numBounces,
+	float refractiveIndex, bool canBounce = true);
+bool KeepRay(float &weight, uint32_t &randomState);
+void PrepareMaterials();
+Bounce Shade(const Ray &ray, const IntersectInfo &info, float weight, int numBounces, float refractiveIndex, bool canBounce,
+	const char *shadowed, glm::vec3 &surfaceColour);
+void FindShadows(const glm::vec3 *points, int count, char *shadowed);
+uint32_t PixelSeed(int x, int y);
+
+// The objects in the scene, owned by the scene and deleted by cleanup()
+extern std::vector<Object*> objects;
+// Geometry shared by Instances, owned by the scene and deleted by cleanup() but only seen where an instance places it
+extern std::vector<Object*> geometries;
+// The scene's material table, and a function to add to it which returns the new material's ID
+extern std::vector<Material> materials;
+MaterialID AddMaterial(const Material &material);
+// The BVH over the objects that have bounds, in the order they appear in objects
+extern BVH objectBVH;
+extern std::vector<Light> lights;
+extern Camera camera;
+extern int reflectionLimit;
+extern float minRayWeight;
+extern bool russianRoulette;
+extern int packetSize;
+int PacketBlockWidth(int size);
+bool LoadBuiltInScene(const std::string &name, const std::string &modelPath, ThreadPool *pool);
 
 #endif
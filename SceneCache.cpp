@@ -0,0 +1,623 @@
+#include "RayTracer.h"
+#include "SceneCache.h"
+#include "MappedFile.h"
+
+#include <unordered_map>
+
+namespace {
+
+const char CACHE_MAGIC[8] = { 'R', 'T', 'S', 'C', 'E', 'N', 'E', 0 };
+// reads back as a different number on a machine with the other byte order
+const uint32_t BYTE_ORDER_MARK = 0x01020304;
+// every array in the file starts on a cache line
+const uint64_t ALIGNMENT = 64;
+
+// The arrays are written straight from memory, so their layout is part of the file format
+static_assert(sizeof(glm::vec3) == 12 && sizeof(glm::vec2) == 8, "glm vectors must be tightly packed");
+static_assert(sizeof(BVHNode) == 32, "the BVH node layout is part of the cache format, change VERSION with it");
+
+// count elements starting offset bytes into the file
+struct ArrayRef {
+    uint64_t offset;
+    uint64_t count;
+};
+
+struct CacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint64_t fileSize;
+
+    float cameraEye[3], cameraCenter[3], cameraUp[3];
+    float fieldOfView, nearPlane, farPlane;
+    int32_t reflectionLimit;
+    uint32_t unused;
+
+    ArrayRef lights;        // LightRecord
+    ArrayRef materials;     // MaterialRecord
+    ArrayRef objects;       // ObjectRecord, in the order of the objects vector
+    ArrayRef geometries;    // ObjectRecord, in the order of the geometries vector
+    ArrayRef spheres;       // SphereRecord
+    ArrayRef planes;        // PlaneRecord
+    ArrayRef triangles;     // TriangleRecord
+    ArrayRef meshes;        // MeshRecord
+    ArrayRef sphereSets;    // SphereSetRecord
+    ArrayRef instances;     // InstanceRecord
+    // the BVH over the objects with bounds, its indices count them in the order of the objects array
+    ArrayRef objectNodes;   // BVHNode
+    ArrayRef objectIndices; // uint32_t
+};
+
+struct LightRecord {
+    float position[3];
+    float intensity[3];
+};
+
+struct MaterialRecord {
+    float ambient[3], diffuse[3], specular[3];
+    float glossiness, reflection, refraction, refractiveIndex;
+};
+
+enum ObjectType { OBJECT_SPHERE, OBJECT_PLANE, OBJECT_TRIANGLE, OBJECT_MESH, OBJECT_SPHERE_SET, OBJECT_INSTANCE };
+
+// which record array the object is in, and where
+struct ObjectRecord {
+    uint32_t type;
+    uint32_t index;
+};
+
+struct SphereRecord {
+    float center[3];
+    float radius;
+    uint32_t material;
+};
+
+struct PlaneRecord {
+    float point[3];
+    float normal[3];
+    uint32_t material;
+};
+
+struct TriangleRecord {
+    float vertex0[3], edge1[3], edge2[3], normal[3];
+    uint32_t material;
+};
+
+// normals and uvs have a count of 0 when the mesh has none, the triangles are in BVH leaf order
+struct MeshRecord {
+    uint32_t material;
+    uint32_t unused;
+    ArrayRef positions, normals, uvs;
+    ArrayRef indices;
+    ArrayRef nodes;
+};
+
+// the centre and radius arrays have SphereSet::PADDING entries past the last sphere, a set with a
+// grid has no nodes and a set with a BVH has no cells
+struct SphereSetRecord {
+    uint32_t numSpheres;
+    uint32_t unused;
+    ArrayRef centerX, centerY, centerZ, radius;
+    ArrayRef materialIndex;
+    ArrayRef nodes;
+    float gridMin[3], gridMax[3];
+    int32_t gridResolution[3];
+    uint32_t unused2;
+    ArrayRef cellStart, cellItems;
+};
+
+// the geometry is an index into the geometries array, the matrix is stored column by column
+struct InstanceRecord {
+    uint32_t geometry;
+    uint32_t unused;
+    float transform[16];
+};
+
+void ToFloats(const glm::vec3 &v, float *to) {
+    to[0] = v.x;
+    to[1] = v.y;
+    to[2] = v.z;
+}
+
+glm::vec3 ToVec3(const float *v) {
+    return glm::vec3(v[0], v[1], v[2]);
+}
+
+MaterialRecord ToRecord(const Material &material) {
+    MaterialRecord record;
+    ToFloats(material.ambient, record.ambient);
+    ToFloats(material.diffuse, record.diffuse);
+    ToFloats(material.specular, record.specular);
+    record.glossiness = material.glossiness;
+    record.reflection = material.reflection;
+    record.refraction = material.refraction;
+    record.refractiveIndex = material.refractiveIndex;
+    return record;
+}
+
+Material FromRecord(const MaterialRecord &record) {
+    return Material(ToVec3(record.ambient), ToVec3(record.diffuse), ToVec3(record.specular),
+                    record.glossiness, record.reflection, record.refraction, record.refractiveIndex);
+}
+
+/* Appends to the cache file, keeping track of the offset and padding each array to ALIGNMENT */
+class CacheWriter {
+  public:
+    explicit CacheWriter(FILE *f): file(f), offset(0), failed(false) {}
+
+    void Raw(const void *data, size_t size) {
+        if (size > 0 && fwrite(data, 1, size, file) != size) {
+            failed = true;
+        }
+        offset += size;
+    }
+
+    template<typename T>
+    ArrayRef Write(const T *data, size_t count) {
+        static const char zeros[ALIGNMENT] = { 0 };
+        Raw(zeros, (size_t)((ALIGNMENT - offset % ALIGNMENT) % ALIGNMENT));
+        ArrayRef ref = { offset, (uint64_t)count };
+        if (count > 0) {
+            Raw(data, count * sizeof(T));
+        }
+        return ref;
+    }
+
+    template<typename T>
+    ArrayRef Write(const std::vector<T> &data) {
+        return Write(data.empty() ? (const T *)NULL : &data[0], data.size());
+    }
+
+    FILE *file;
+    uint64_t offset;
+    bool failed;
+};
+
+/* Returns true if the array lies inside the file and is aligned as the writer leaves it */
+bool ValidArray(const ArrayRef &ref, size_t elementSize, size_t fileSize) {
+    if (ref.count == 0) {
+        return true;
+    }
+    return ref.offset % ALIGNMENT == 0 && ref.offset <= fileSize && ref.count <= (fileSize - ref.offset) / elementSize;
+}
+
+template<typename T>
+const T *ArrayData(const MappedFile &file, const ArrayRef &ref) {
+    return ref.count == 0 ? NULL : (const T *)(file.Data() + ref.offset);
+}
+
+// The mapping the loaded meshes and sphere sets point into, it is never unmapped while they exist
+MappedFile cacheFile;
+
+/* Returns true if every value in the mapped array is below limit */
+bool ValuesBelow(const ArrayRef &ref, uint64_t limit) {
+    const uint32_t *values = ArrayData<uint32_t>(cacheFile, ref);
+    for (uint64_t i = 0; i < ref.count; ++i) {
+        if (values[i] >= limit) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+** Returns true if the mapped BVH nodes make a tree that traversal can walk safely: each child comes
+** after its parent and has no other parent, the leaves list entries below numEntries, and no path
+** is deeper than the traversal stack.
+*/
+bool ValidNodes(const ArrayRef &ref, uint64_t numEntries) {
+    const BVHNode *nodes = ArrayData<BVHNode>(cacheFile, ref);
+    // the parents come first, so one pass in order knows the depth of a node before its children
+    std::vector<uint8_t> depth(ref.count, 0);
+    if (ref.count > 0) {
+        depth[0] = 1;
+    }
+    for (uint64_t i = 0; i < ref.count; ++i) {
+        const BVHNode &node = nodes[i];
+        if (node.count > 0) {
+            if ((uint64_t)node.offset + node.count > numEntries) {
+                return false;
+            }
+            continue;
+        }
+        if (depth[i] == 0 || depth[i] >= BVH::STACK_SIZE || node.offset <= i + 1 || node.offset >= ref.count
+            || depth[i + 1] != 0 || depth[node.offset] != 0) {
+            return false;
+        }
+        depth[i + 1] = depth[node.offset] = depth[i] + 1;
+    }
+    return true;
+}
+
+/*
+** Makes the object an ObjectRecord describes, pointing meshes and sphere sets into cacheFile.
+** Instances refer to loadedGeometries, which are the geometries already made from the file.
+** Returns NULL if the record or anything it refers to is corrupt.
+*/
+Object *LoadObject(const CacheHeader &header, const ObjectRecord &objectRecord, const std::vector<Object*> &loadedGeometries) {
+    size_t size = cacheFile.Size();
+    uint64_t numMaterials = header.materials.count;
+    uint32_t index = objectRecord.index;
+    glm::mat4 identity(1.0f);
+
+    if (objectRecord.type == OBJECT_SPHERE && index < header.spheres.count) {
+        const SphereRecord &record = ArrayData<SphereRecord>(cacheFile, header.spheres)[index];
+        if (record.material < numMaterials) {
+            return new Sphere(identity, record.material, ToVec3(record.center), record.radius);
+        }
+    } else if (objectRecord.type == OBJECT_PLANE && index < header.planes.count) {
+        const PlaneRecord &record = ArrayData<PlaneRecord>(cacheFile, header.planes)[index];
+        if (record.material < numMaterials) {
+            return new Plane(identity, record.material, ToVec3(record.point), ToVec3(record.normal));
+        }
+    } else if (objectRecord.type == OBJECT_TRIANGLE && index < header.triangles.count) {
+        const TriangleRecord &record = ArrayData<TriangleRecord>(cacheFile, header.triangles)[index];
+        if (record.material < numMaterials) {
+            TriangleData data;
+            data.vertex0 = ToVec3(record.vertex0);
+            data.edge1 = ToVec3(record.edge1);
+            data.edge2 = ToVec3(record.edge2);
+            data.normal = ToVec3(record.normal);
+            return new Triangle(identity, record.material, data);
+        }
+    } else if (objectRecord.type == OBJECT_MESH && index < header.meshes.count) {
+        const MeshRecord &record = ArrayData<MeshRecord>(cacheFile, header.meshes)[index];
+        uint64_t numVertices = record.positions.count;
+        if (record.material < numMaterials && numVertices <= 0xffffffffu && record.indices.count <= 0xffffffffu
+            && record.indices.count % 3 == 0 && (record.normals.count == 0 || record.normals.count == numVertices)
+            && (record.uvs.count == 0 || record.uvs.count == numVertices)
+            && ValidArray(record.positions, sizeof(glm::vec3), size) && ValidArray(record.normals, sizeof(glm::vec3), size)
+            && ValidArray(record.uvs, sizeof(glm::vec2), size) && ValidArray(record.indices, sizeof(uint32_t), size)
+            && ValidArray(record.nodes, sizeof(BVHNode), size) && ValuesBelow(record.indices, numVertices)
+            && ValidNodes(record.nodes, record.indices.count / 3)) {
+            TriangleMesh *mesh = new TriangleMesh(record.material);
+            mesh->UseArrays((uint32_t)numVertices, ArrayData<glm::vec3>(cacheFile, record.positions),
+                ArrayData<glm::vec3>(cacheFile, record.normals), ArrayData<glm::vec2>(cacheFile, record.uvs),
+                (uint32_t)record.indices.count, ArrayData<uint32_t>(cacheFile, record.indices),
+                ArrayData<BVHNode>(cacheFile, record.nodes), (size_t)record.nodes.count);
+            return mesh;
+        }
+    } else if (objectRecord.type == OBJECT_SPHERE_SET && index < header.sphereSets.count) {
+        const SphereSetRecord &record = ArrayData<SphereSetRecord>(cacheFile, header.sphereSets)[index];
+        uint64_t padded = record.numSpheres > 0 ? (uint64_t)record.numSpheres + SphereSet::PADDING : 0;
+        if (record.centerX.count == padded && record.centerY.count == padded && record.centerZ.count == padded
+            && record.radius.count == padded && record.materialIndex.count == record.numSpheres
+            && ValidArray(record.centerX, sizeof(float), size) && ValidArray(record.centerY, sizeof(float), size)
+            && ValidArray(record.centerZ, sizeof(float), size) && ValidArray(record.radius, sizeof(float), size)
+            && ValidArray(record.materialIndex, sizeof(MaterialID), size) && ValidArray(record.nodes, sizeof(BVHNode), size)
+            && ValidArray(record.cellStart, sizeof(uint32_t), size) && ValidArray(record.cellItems, sizeof(uint32_t), size)
+            && ValuesBelow(record.materialIndex, numMaterials) && ValidNodes(record.nodes, record.numSpheres)
+            && ValuesBelow(record.cellItems, record.numSpheres)) {
+            // the cells have to be a whole grid whose lists end where the items do
+            uint64_t numCells = 1;
+            for (int axis = 0; axis < 3; ++axis) {
+                int32_t cells = record.gridResolution[axis];
+                numCells *= cells >= 1 && cells <= Grid::MAX_RESOLUTION ? (uint64_t)cells : 0;
+            }
+            const uint32_t *cellStart = ArrayData<uint32_t>(cacheFile, record.cellStart);
+            bool hasGrid = record.cellStart.count > 0;
+            bool validGrid = record.nodes.count == 0 && record.cellStart.count == numCells + 1
+                && cellStart[numCells] == record.cellItems.count;
+            for (uint64_t i = 0; hasGrid && validGrid && i < numCells; ++i) {
+                validGrid = cellStart[i] <= cellStart[i + 1];
+            }
+            if (!hasGrid || validGrid) {
+                SphereSet *set = new SphereSet();
+                set->UseArrays((int)record.numSpheres, ArrayData<float>(cacheFile, record.centerX), ArrayData<float>(cacheFile, record.centerY),
+                    ArrayData<float>(cacheFile, record.centerZ), ArrayData<float>(cacheFile, record.radius),
+                    ArrayData<MaterialID>(cacheFile, record.materialIndex), ArrayData<BVHNode>(cacheFile, record.nodes), (size_t)record.nodes.count);
+                if (hasGrid) {
+                    set->UseGrid(AABB(ToVec3(record.gridMin), ToVec3(record.gridMax)), record.gridResolution, cellStart,
+                                 ArrayData<uint32_t>(cacheFile, record.cellItems));
+                }
+                return set;
+            }
+        }
+    } else if (objectRecord.type == OBJECT_INSTANCE && index < header.instances.count) {
+        const InstanceRecord &record = ArrayData<InstanceRecord>(cacheFile, header.instances)[index];
+        if (record.geometry < loadedGeometries.size()) {
+            glm::mat4 transform;
+            memcpy(&transform[0][0], record.transform, sizeof(record.transform));
+            return new Instance(loadedGeometries[record.geometry], transform);
+        }
+    }
+    return NULL;
+}
+
+}
+
+/*
+** Collects the records of the objects and geometries into one array per kind of object, and writes
+** the big arrays of the meshes and sphere sets straight to the file as it goes.
+*/
+class SceneCache::ObjectWriter {
+  public:
+    explicit ObjectWriter(CacheWriter &w): writer(w) {
+        for (size_t i = 0; i < geometries.size(); ++i) {
+            geometryIndex[geometries[i]] = (uint32_t)i;
+        }
+    }
+
+    /* Fills in objectRecord for the object, returns what went wrong if the object cannot be stored */
+    const char *Add(const Object *object, ObjectRecord &objectRecord) {
+        if (const Sphere *sphere = dynamic_cast<const Sphere *>(object)) {
+            SphereRecord record;
+            ToFloats(sphere->data.center, record.center);
+            record.radius = sphere->data.radius;
+            record.material = object->GetMaterialID();
+            objectRecord.type = OBJECT_SPHERE;
+            objectRecord.index = (uint32_t)spheres.size();
+            spheres.push_back(record);
+        } else if (const Plane *plane = dynamic_cast<const Plane *>(object)) {
+            PlaneRecord record;
+            ToFloats(plane->data.point, record.point);
+            ToFloats(plane->data.normal, record.normal);
+            record.material = object->GetMaterialID();
+            objectRecord.type = OBJECT_PLANE;
+            objectRecord.index = (uint32_t)planes.size();
+            planes.push_back(record);
+        } else if (const Triangle *triangle = dynamic_cast<const Triangle *>(object)) {
+            TriangleRecord record;
+            ToFloats(triangle->data.vertex0, record.vertex0);
+            ToFloats(triangle->data.edge1, record.edge1);
+            ToFloats(triangle->data.edge2, record.edge2);
+            ToFloats(triangle->data.normal, record.normal);
+            record.material = object->GetMaterialID();
+            objectRecord.type = OBJECT_TRIANGLE;
+            objectRecord.index = (uint32_t)triangles.size();
+            triangles.push_back(record);
+        } else if (const TriangleMesh *mesh = dynamic_cast<const TriangleMesh *>(object)) {
+            MeshRecord record;
+            memset(&record, 0, sizeof(record));
+            record.material = object->GetMaterialID();
+            size_t numVertices = mesh->NumVertices();
+            record.positions = writer.Write(mesh->PositionData(), numVertices);
+            record.normals = writer.Write(mesh->NormalData(), mesh->NormalData() ? numVertices : 0);
+            record.uvs = writer.Write(mesh->UVData(), mesh->UVData() ? numVertices : 0);
+            record.indices = writer.Write(mesh->IndexData(), 3 * (size_t)mesh->NumTriangles());
+            record.nodes = writer.Write(mesh->Hierarchy().NodeData(), mesh->Hierarchy().NumNodes());
+            objectRecord.type = OBJECT_MESH;
+            objectRecord.index = (uint32_t)meshes.size();
+            meshes.push_back(record);
+        } else if (const SphereSet *set = dynamic_cast<const SphereSet *>(object)) {
+            SphereSetRecord record;
+            memset(&record, 0, sizeof(record));
+            record.numSpheres = (uint32_t)set->Size();
+            size_t padded = set->Size() > 0 ? set->Size() + SphereSet::PADDING : 0;
+            record.centerX = writer.Write(set->centerXData, padded);
+            record.centerY = writer.Write(set->centerYData, padded);
+            record.centerZ = writer.Write(set->centerZData, padded);
+            record.radius = writer.Write(set->radiusData, padded);
+            record.materialIndex = writer.Write(set->materialIndexData, (size_t)set->Size());
+            record.nodes = writer.Write(set->bvh.NodeData(), set->bvh.NumNodes());
+            if (set->UsesGrid()) {
+                ToFloats(set->grid.Bounds().min, record.gridMin);
+                ToFloats(set->grid.Bounds().max, record.gridMax);
+                memcpy(record.gridResolution, set->grid.Resolution(), sizeof(record.gridResolution));
+                record.cellStart = writer.Write(set->grid.CellStartData(), set->grid.NumCells() + 1);
+                record.cellItems = writer.Write(set->grid.ItemData(), set->grid.NumItems());
+            }
+            objectRecord.type = OBJECT_SPHERE_SET;
+            objectRecord.index = (uint32_t)sphereSets.size();
+            sphereSets.push_back(record);
+        } else if (const Instance *instance = dynamic_cast<const Instance *>(object)) {
+            std::unordered_map<const Object *, uint32_t>::const_iterator geometry = geometryIndex.find(instance->Geometry());
+            if (geometry == geometryIndex.end()) {
+                return "an instance refers to geometry that is not in the scene's geometries";
+            }
+            InstanceRecord record;
+            memset(&record, 0, sizeof(record));
+            record.geometry = geometry->second;
+            memcpy(record.transform, &instance->Transform()[0][0], sizeof(record.transform));
+            objectRecord.type = OBJECT_INSTANCE;
+            objectRecord.index = (uint32_t)instances.size();
+            instances.push_back(record);
+        } else {
+            return "the scene has an object of a kind the cache cannot store";
+        }
+        return NULL;
+    }
+
+    std::vector<SphereRecord> spheres;
+    std::vector<PlaneRecord> planes;
+    std::vector<TriangleRecord> triangles;
+    std::vector<MeshRecord> meshes;
+    std::vector<SphereSetRecord> sphereSets;
+    std::vector<InstanceRecord> instances;
+
+  private:
+    CacheWriter &writer;
+    std::unordered_map<const Object *, uint32_t> geometryIndex;
+};
+
+bool SceneCache::Save(const std::string &path, std::string *error) {
+    std::string tempPath = path + ".tmp";
+    FILE *file = fopen(tempPath.c_str(), "wb");
+    if (!file) {
+        if (error) {
+            *error = "could not write " + tempPath;
+        }
+        return false;
+    }
+
+    CacheHeader header;
+    memset(&header, 0, sizeof(header));
+    CacheWriter writer(file);
+    // a placeholder, the real header is written once the offsets are known
+    writer.Raw(&header, sizeof(header));
+
+    ObjectWriter objectWriter(writer);
+    std::vector<ObjectRecord> geometryRecords(geometries.size());
+    std::vector<ObjectRecord> objectRecords(objects.size());
+    const char *failure = NULL;
+    for (size_t i = 0; i < geometries.size() && !failure; ++i) {
+        failure = objectWriter.Add(geometries[i], geometryRecords[i]);
+        if (!failure && geometryRecords[i].type == OBJECT_INSTANCE) {
+            failure = "the cache cannot store instances of instances";
+        }
+    }
+    for (size_t i = 0; i < objects.size() && !failure; ++i) {
+        failure = objectWriter.Add(objects[i], objectRecords[i]);
+    }
+
+    std::vector<LightRecord> lightRecords(lights.size());
+    for (size_t i = 0; i < lights.size(); ++i) {
+        ToFloats(lights[i].position, lightRecords[i].position);
+        ToFloats(lights[i].intensity, lightRecords[i].intensity);
+    }
+
+    std::vector<MaterialRecord> materialRecords(materials.size());
+    for (size_t i = 0; i < materials.size(); ++i) {
+        materialRecords[i] = ToRecord(materials[i]);
+    }
+
+    header.lights = writer.Write(lightRecords);
+    header.materials = writer.Write(materialRecords);
+    header.objects = writer.Write(objectRecords);
+    header.geometries = writer.Write(geometryRecords);
+    header.spheres = writer.Write(objectWriter.spheres);
+    header.planes = writer.Write(objectWriter.planes);
+    header.triangles = writer.Write(objectWriter.triangles);
+    header.meshes = writer.Write(objectWriter.meshes);
+    header.sphereSets = writer.Write(objectWriter.sphereSets);
+    header.instances = writer.Write(objectWriter.instances);
+    header.objectNodes = writer.Write(objectBVH.NodeData(), objectBVH.NumNodes());
+    header.objectIndices = writer.Write(objectBVH.IndexData(), objectBVH.NumNodes() > 0 ? objectBVH.indices.size() : 0);
+
+    memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+    header.version = VERSION;
+    header.byteOrder = BYTE_ORDER_MARK;
+    header.fileSize = writer.offset;
+    ToFloats(camera.eye, header.cameraEye);
+    ToFloats(camera.center, header.cameraCenter);
+    ToFloats(camera.up, header.cameraUp);
+    header.fieldOfView = camera.fieldOfView;
+    header.nearPlane = camera.nearPlane;
+    header.farPlane = camera.farPlane;
+    header.reflectionLimit = reflectionLimit;
+
+    if (fseek(file, 0, SEEK_SET) != 0) {
+        writer.failed = true;
+    }
+    writer.Raw(&header, sizeof(header));
+    if (fclose(file) != 0) {
+        writer.failed = true;
+    }
+
+    if (!failure && writer.failed) {
+        failure = "could not write the whole cache";
+    }
+    // renaming only once the file is complete means a reader never sees half a cache
+    if (!failure && rename(tempPath.c_str(), path.c_str()) != 0) {
+        failure = "could not rename the cache into place";
+    }
+    if (failure) {
+        remove(tempPath.c_str());
+        if (error) {
+            *error = path + ": " + failure;
+        }
+        return false;
+    }
+    return true;
+}
+
+bool SceneCache::Load(const std::string &path, std::string *error) {
+    if (!cacheFile.Open(path, false)) {
+        if (error) {
+            *error = "could not open " + path;
+        }
+        return false;
+    }
+    size_t size = cacheFile.Size();
+    // the mapping starts on a page boundary, so the header and arrays can be used where they are
+    const CacheHeader &header = *(const CacheHeader *)cacheFile.Data();
+
+    const char *failure = NULL;
+    if (!objects.empty() || !geometries.empty() || !materials.empty()) {
+        // the material IDs in the mapped arrays count from the start of the table
+        failure = "a cache can only be loaded into an empty scene";
+    } else if (size < sizeof(CacheHeader) || memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic)) != 0) {
+        failure = "not a scene cache";
+    } else if (header.byteOrder != BYTE_ORDER_MARK) {
+        failure = "written on a machine with a different byte order";
+    } else if (header.version != VERSION) {
+        failure = "written by a different version of the ray tracer";
+    } else if (header.fileSize != size) {
+        failure = "the file is truncated";
+    } else if (!ValidArray(header.lights, sizeof(LightRecord), size) || !ValidArray(header.materials, sizeof(MaterialRecord), size)
+        || !ValidArray(header.objects, sizeof(ObjectRecord), size) || !ValidArray(header.geometries, sizeof(ObjectRecord), size)
+        || !ValidArray(header.spheres, sizeof(SphereRecord), size) || !ValidArray(header.instances, sizeof(InstanceRecord), size)
+        || !ValidArray(header.planes, sizeof(PlaneRecord), size) || !ValidArray(header.triangles, sizeof(TriangleRecord), size)
+        || !ValidArray(header.meshes, sizeof(MeshRecord), size) || !ValidArray(header.sphereSets, sizeof(SphereSetRecord), size)
+        || !ValidArray(header.objectNodes, sizeof(BVHNode), size) || !ValidArray(header.objectIndices, sizeof(uint32_t), size)) {
+        failure = "the tables are corrupt";
+    }
+
+    // the objects only go into the scene once all of them have been read, the geometries go
+    // first since the instances refer to them
+    std::vector<Object*> loadedGeometries, loaded;
+    const ObjectRecord *geometryRecords = failure ? NULL : ArrayData<ObjectRecord>(cacheFile, header.geometries);
+    for (uint64_t i = 0; !failure && i < header.geometries.count; ++i) {
+        Object *geometry = geometryRecords[i].type == OBJECT_INSTANCE ? NULL : LoadObject(header, geometryRecords[i], loadedGeometries);
+        if (!geometry) {
+            failure = "a geometry record is corrupt";
+        } else {
+            loadedGeometries.push_back(geometry);
+        }
+    }
+    const ObjectRecord *objectRecords = failure ? NULL : ArrayData<ObjectRecord>(cacheFile, header.objects);
+    for (uint64_t i = 0; !failure && i < header.objects.count; ++i) {
+        Object *object = LoadObject(header, objectRecords[i], loadedGeometries);
+        if (!object) {
+            failure = "an object record is corrupt";
+        } else {
+            loaded.push_back(object);
+        }
+    }
+
+    if (!failure) {
+        // the object BVH has to index exactly the objects with bounds
+        size_t numBounded = 0;
+        for (size_t i = 0; i < loaded.size(); ++i) {
+            if (loaded[i]->IsBounded()) {
+                numBounded++;
+            }
+        }
+        bool valid = header.objectIndices.count == numBounded && (header.objectNodes.count > 0) == (numBounded > 0)
+            && ValuesBelow(header.objectIndices, numBounded) && ValidNodes(header.objectNodes, header.objectIndices.count);
+        if (!valid) {
+            failure = "the object BVH does not match the objects";
+        }
+    }
+
+    if (failure) {
+        for (size_t i = 0; i < loaded.size(); ++i) {
+            delete loaded[i];
+        }
+        for (size_t i = 0; i < loadedGeometries.size(); ++i) {
+            delete loadedGeometries[i];
+        }
+        cacheFile.Close();
+        if (error) {
+            *error = path + ": " + failure;
+        }
+        return false;
+    }
+
+    const MaterialRecord *materialRecords = ArrayData<MaterialRecord>(cacheFile, header.materials);
+    for (uint64_t i = 0; i < header.materials.count; ++i) {
+        materials.push_back(FromRecord(materialRecords[i]));
+    }
+    geometries.insert(geometries.end(), loadedGeometries.begin(), loadedGeometries.end());
+    objects.insert(objects.end(), loaded.begin(), loaded.end());
+    objectBVH.UseNodes(ArrayData<BVHNode>(cacheFile, header.objectNodes), (size_t)header.objectNodes.count,
+                       ArrayData<uint32_t>(cacheFile, header.objectIndices));
+    const LightRecord *lightRecords = ArrayData<LightRecord>(cacheFile, header.lights);
+    for (uint64_t i = 0; i < header.lights.count; ++i) {
+        lights.push_back(Light(ToVec3(lightRecords[i].position), ToVec3(lightRecords[i].intensity)));
+    }
+    camera = Camera(ToVec3(header.cameraEye), ToVec3(header.cameraCenter), ToVec3(header.cameraUp),
+                    header.fieldOfView, header.nearPlane, header.farPlane);
+    reflectionLimit = header.reflectionLimit;
+    return true;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <string>
+#include <stdint.h>
+
+/*
+** A binary copy of a whole scene which can be loaded again almost instantly.
+** The file holds the lights, camera, materials and flat arrays of every kind of object, along with
+** the prebuilt BVHs of the meshes, the sphere sets and the scene itself, or the grids of sphere
+** sets that use one, laid out exactly as they are in memory. Geometry shared by instances is stored
+** once and the instances only by their transforms. Every reference in it is an offset from the
+** start of the file, so it can be mapped anywhere.
+** Loading maps the file and points the meshes and sphere sets straight at their arrays and BVH
+** nodes in the mapping, only the small objects (spheres, planes and triangles) are created again
+** from their records. The file starts with a version number and a cache written by a different
+** version, or on a machine with a different byte order, is refused rather than misread.
+*/
+class SceneCache {
+  public:
+    static const uint32_t VERSION = 4;
+
+    /*
+    ** Writes the current scene, along with the BVH over its objects, to path. The acceleration
+    ** structure has to have been built. The file is written next to it and renamed into place.
+    */
+    static bool Save(const std::string &path, std::string *error = NULL);
+
+    /*
+    ** Loads a scene written by Save() into the objects, lights and camera of the ray tracer, and
+    ** its BVH into objectBVH, so call BuildAccelerationStructure(true) after it. The file stays
+    ** mapped until the program exits.
+    ** On failure it returns false and, if error is not NULL, says what went wrong in it.
+    */
+    static bool Load(const std::string &path, std::string *error = NULL);
+
+  private:
+    // gathers the records of the objects as they are saved, in here since it reads their private data
+    class ObjectWriter;
+};
@@ -0,0 +1,313 @@
+#include "RayTracer.h"
+#include "MappedFile.h"
+#include "ParseUtil.h"
+
+#include <unordered_map>
+
+namespace {
+
+/*
+** The names of the materials or geometries defined so far and their indices in the scene's tables.
+** The names point into the mapped file, so looking one up is a hash of the word and a compare,
+** without making a string.
+*/
+class NameTable {
+  public:
+    static uint64_t Hash(const char *begin, const char *end) {
+        // FNV-1a
+        uint64_t hash = 14695981039346656037ULL;
+        for (const char *c = begin; c < end; ++c) {
+            hash = (hash ^ (unsigned char)*c) * 1099511628211ULL;
+        }
+        return hash;
+    }
+
+    /* Finds the index of the given name, returns false if there is none */
+    bool Find(const char *begin, const char *end, uint32_t &id) const {
+        std::pair<Lookup::const_iterator, Lookup::const_iterator> range = lookup.equal_range(Hash(begin, end));
+        for (Lookup::const_iterator i = range.first; i != range.second; ++i) {
+            const Name &name = names[i->second];
+            if (name.end - name.begin == end - begin && memcmp(name.begin, begin, end - begin) == 0) {
+                id = name.id;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /* Names an index, the name must not have been used yet */
+    void Add(const char *begin, const char *end, uint32_t id) {
+        lookup.insert(std::make_pair(Hash(begin, end), names.size()));
+        Name name = { begin, end, id };
+        names.push_back(name);
+    }
+
+  private:
+    struct Name {
+        const char *begin;
+        const char *end;
+        uint32_t id;
+    };
+    typedef std::unordered_multimap<uint64_t, size_t> Lookup;
+
+    std::vector<Name> names;
+    Lookup lookup;
+};
+
+bool NextVec3(const char *&p, const char *end, glm::vec3 &v) {
+    return Parse::NextFloat(p, end, v.x) && Parse::NextFloat(p, end, v.y) && Parse::NextFloat(p, end, v.z);
+}
+
+bool AtLineEnd(const char *&p, const char *end) {
+    Parse::SkipSpaces(p, end);
+    return p >= end || *p == '\n' || *p == '#';
+}
+
+// Mesh files are looked for relative to the scene file unless their path is absolute
+std::string MeshPath(const std::string &directory, const char *fileName, const char *fileNameEnd) {
+    std::string meshPath(fileName, fileNameEnd);
+    return meshPath[0] == '/' ? meshPath : directory + meshPath;
+}
+
+}
+
+bool LoadSceneFile(const std::string &path, ThreadPool *pool, std::string *error) {
+    MappedFile file;
+    if (!file.Open(path)) {
+        if (error) {
+            *error = "could not open " + path;
+        }
+        return false;
+    }
+    size_t slash = path.rfind('/');
+    std::string directory = slash == std::string::npos ? "" : path.substr(0, slash + 1);
+
+    // spheres, planes, triangles and meshes are placed by their own coordinates, only instances have a transform
+    glm::mat4 identity(1.0f);
+    NameTable materialNames;
+    NameTable geometryNames;
+    const char *end = file.End();
+    const char *message = NULL;
+    std::string detail;
+    const char *line = file.Data();
+
+    for (const char *p = file.Data(); p < end; Parse::SkipLine(p, end)) {
+        Parse::SkipSpaces(p, end);
+        line = p;
+        if (AtLineEnd(p, end)) {
+            continue;
+        }
+        const char *keyword, *keywordEnd;
+        Parse::ParseWord(p, end, keyword, keywordEnd);
+
+        // everything but the material definitions starts by naming a material
+        MaterialID material = 0;
+        if (Parse::WordEquals(keyword, keywordEnd, "sphere") || Parse::WordEquals(keyword, keywordEnd, "plane")
+            || Parse::WordEquals(keyword, keywordEnd, "triangle") || Parse::WordEquals(keyword, keywordEnd, "mesh")) {
+            const char *name = p, *nameEnd = p;
+            if (!Parse::ParseWord(p, end, name, nameEnd) || !materialNames.Find(name, nameEnd, material)) {
+                message = "unknown material";
+                detail.assign(name, nameEnd);
+                break;
+            }
+        }
+
+        if (Parse::WordEquals(keyword, keywordEnd, "camera")) {
+            Camera sceneCamera;
+            if (!NextVec3(p, end, sceneCamera.eye) || !NextVec3(p, end, sceneCamera.center) || !NextVec3(p, end, sceneCamera.up)) {
+                message = "expected camera <eye x y z> <center x y z> <up x y z> [fov]";
+                break;
+            }
+            Parse::NextFloat(p, end, sceneCamera.fieldOfView);
+            camera = sceneCamera;
+        } else if (Parse::WordEquals(keyword, keywordEnd, "light")) {
+            Light light;
+            if (!NextVec3(p, end, light.position)) {
+                message = "expected light <x y z> [<r g b>]";
+                break;
+            }
+            if (!AtLineEnd(p, end) && !NextVec3(p, end, light.intensity)) {
+                message = "expected light <x y z> [<r g b>]";
+                break;
+            }
+            lights.push_back(light);
+        } else if (Parse::WordEquals(keyword, keywordEnd, "maxdepth")) {
+            long long depth;
+            Parse::SkipSpaces(p, end);
+            if (!Parse::ParseInt(p, end, depth) || depth < 0) {
+                message = "expected maxdepth <number of bounces>";
+                break;
+            }
+            reflectionLimit = (int)depth;
+        } else if (Parse::WordEquals(keyword, keywordEnd, "material")) {
+            const char *name, *nameEnd;
+            Material m;
+            if (!Parse::ParseWord(p, end, name, nameEnd) || !NextVec3(p, end, m.ambient) || !NextVec3(p, end, m.diffuse)
+                || !NextVec3(p, end, m.specular) || !Parse::NextFloat(p, end, m.glossiness) || !Parse::NextFloat(p, end, m.reflection)
+                || !Parse::NextFloat(p, end, m.refraction) || !Parse::NextFloat(p, end, m.refractiveIndex)) {
+                message = "expected material <name> <ambient> <diffuse> <specular> <glossiness> <reflection> <refraction> <refractive index>";
+                break;
+            }
+            MaterialID existing;
+            if (materialNames.Find(name, nameEnd, existing)) {
+                message = "material defined twice";
+                detail.assign(name, nameEnd);
+                break;
+            }
+            materialNames.Add(name, nameEnd, AddMaterial(m));
+        } else if (Parse::WordEquals(keyword, keywordEnd, "sphere")) {
+            glm::vec3 center;
+            float radius;
+            if (!NextVec3(p, end, center) || !Parse::NextFloat(p, end, radius)) {
+                message = "expected sphere <material> <center x y z> <radius>";
+                break;
+            }
+            objects.push_back(new Sphere(identity, material, center, radius));
+        } else if (Parse::WordEquals(keyword, keywordEnd, "plane")) {
+            glm::vec3 point, normal;
+            if (!NextVec3(p, end, point) || !NextVec3(p, end, normal)) {
+                message = "expected plane <material> <point x y z> <normal x y z>";
+                break;
+            }
+            objects.push_back(new Plane(identity, material, point, normal));
+        } else if (Parse::WordEquals(keyword, keywordEnd, "triangle")) {
+            glm::vec3 a, b, c;
+            if (!NextVec3(p, end, a) || !NextVec3(p, end, b) || !NextVec3(p, end, c)) {
+                message = "expected triangle <material> <x y z> <x y z> <x y z>";
+                break;
+            }
+            objects.push_back(new Triangle(identity, material, a, b, c));
+        } else if (Parse::WordEquals(keyword, keywordEnd, "mesh")) {
+            const char *fileName, *fileNameEnd;
+            if (!Parse::ParseWord(p, end, fileName, fileNameEnd)) {
+                message = "expected mesh <material> <file> [scale <s>] [translate <x y z>] [spatial]";
+                break;
+            }
+            float scale = 1.0f;
+            glm::vec3 translation(0.0f);
+            bool spatialSplits = false;
+            const char *option, *optionEnd;
+            while (!AtLineEnd(p, end) && Parse::ParseWord(p, end, option, optionEnd)) {
+                bool valid;
+                if (Parse::WordEquals(option, optionEnd, "scale")) {
+                    valid = Parse::NextFloat(p, end, scale);
+                } else if (Parse::WordEquals(option, optionEnd, "translate")) {
+                    valid = NextVec3(p, end, translation);
+                } else if (Parse::WordEquals(option, optionEnd, "spatial")) {
+                    spatialSplits = true;
+                    valid = true;
+                } else {
+                    valid = false;
+                }
+                if (!valid) {
+                    message = "expected mesh <material> <file> [scale <s>] [translate <x y z>] [spatial]";
+                    break;
+                }
+            }
+            if (message) {
+                break;
+            }
+
+            TriangleMesh *mesh = new TriangleMesh(material);
+            if (!LoadMesh(MeshPath(directory, fileName, fileNameEnd), *mesh, pool, &detail)) {
+                delete mesh;
+                message = "could not load mesh";
+                break;
+            }
+            for (size_t i = 0; i < mesh->positions.size(); ++i) {
+                mesh->positions[i] = scale * mesh->positions[i] + translation;
+            }
+            mesh->Build(spatialSplits);
+            objects.push_back(mesh);
+        } else if (Parse::WordEquals(keyword, keywordEnd, "geometry")) {
+            const char *name, *nameEnd, *materialName, *materialNameEnd, *fileName, *fileNameEnd;
+            if (!Parse::ParseWord(p, end, name, nameEnd) || !Parse::ParseWord(p, end, materialName, materialNameEnd)
+                || !Parse::ParseWord(p, end, fileName, fileNameEnd)) {
+                message = "expected geometry <name> <material> <file> [spatial]";
+                break;
+            }
+            bool spatialSplits = false;
+            const char *option, *optionEnd;
+            if (!AtLineEnd(p, end) && Parse::ParseWord(p, end, option, optionEnd)) {
+                if (!Parse::WordEquals(option, optionEnd, "spatial")) {
+                    message = "expected geometry <name> <material> <file> [spatial]";
+                    break;
+                }
+                spatialSplits = true;
+            }
+            uint32_t existing;
+            if (geometryNames.Find(name, nameEnd, existing)) {
+                message = "geometry defined twice";
+                detail.assign(name, nameEnd);
+                break;
+            }
+            if (!materialNames.Find(materialName, materialNameEnd, material)) {
+                message = "unknown material";
+                detail.assign(materialName, materialNameEnd);
+                break;
+            }
+            TriangleMesh *mesh = new TriangleMesh(material);
+            if (!LoadMesh(MeshPath(directory, fileName, fileNameEnd), *mesh, pool, &detail)) {
+                delete mesh;
+                message = "could not load mesh";
+                break;
+            }
+            mesh->Build(spatialSplits);
+            geometryNames.Add(name, nameEnd, (uint32_t)geometries.size());
+            geometries.push_back(mesh);
+        } else if (Parse::WordEquals(keyword, keywordEnd, "instance")) {
+            const char *name = p, *nameEnd = p;
+            uint32_t geometry;
+            if (!Parse::ParseWord(p, end, name, nameEnd) || !geometryNames.Find(name, nameEnd, geometry)) {
+                message = "unknown geometry";
+                detail.assign(name, nameEnd);
+                break;
+            }
+            // each option is applied after the ones before it
+            glm::mat4 transform(1.0f);
+            const char *option, *optionEnd;
+            while (!AtLineEnd(p, end) && Parse::ParseWord(p, end, option, optionEnd)) {
+                float scale, degrees;
+                glm::vec3 v;
+                bool valid = true;
+                if (Parse::WordEquals(option, optionEnd, "scale") && Parse::NextFloat(p, end, scale)) {
+                    transform = glm::scale(glm::mat4(1.0f), glm::vec3(scale)) * transform;
+                } else if (Parse::WordEquals(option, optionEnd, "rotate") && NextVec3(p, end, v) && Parse::NextFloat(p, end, degrees)
+                    && glm::length(v) > 0.0f) {
+                    transform = glm::rotate(glm::mat4(1.0f), degrees, v) * transform;
+                } else if (Parse::WordEquals(option, optionEnd, "translate") && NextVec3(p, end, v)) {
+                    transform = glm::translate(glm::mat4(1.0f), v) * transform;
+                } else {
+                    valid = false;
+                }
+                if (!valid) {
+                    message = "expected instance <geometry> [scale <s>] [rotate <axis x y z> <degrees>] [translate <x y z>]";
+                    break;
+                }
+            }
+            if (message) {
+                break;
+            }
+            objects.push_back(new Instance(geometries[geometry], transform));
+        } else {
+            message = "unknown keyword";
+            detail.assign(keyword, keywordEnd);
+            break;
+        }
+
+        if (!AtLineEnd(p, end)) {
+            message = "unexpected text at the end of the line";
+            break;
+        }
+    }
+
+    if (message) {
+        if (error) {
+            char lineNumber[32];
+            snprintf(lineNumber, sizeof(lineNumber), ":%d: ", Parse::LineNumber(file.Data(), line));
+            *error = path + lineNumber + message + (detail.empty() ? "" : " (" + detail + ")");
+        }
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <string>
+
+#include "ThreadPool.h"
+
+/*
+** Scene files describe a scene as text, one item per line, so it can be changed without
+** recompiling. Numbers and names are separated by spaces and # starts a comment:
+**
+**   camera <eye x y z> <center x y z> <up x y z> [vertical field of view in degrees]
+**   light <x y z> [<intensity r g b>]
+**   maxdepth <number of bounces>
+**   material <name> <ambient r g b> <diffuse r g b> <specular r g b> <glossiness> <reflection> <refraction> <refractive index>
+**   sphere <material> <center x y z> <radius>
+**   plane <material> <point x y z> <normal x y z>
+**   triangle <material> <x y z> <x y z> <x y z>
+**   mesh <material> <.obj or .ply file> [scale <s>] [translate <x y z>] [spatial]
+**   geometry <name> <material> <.obj or .ply file> [spatial]
+**   instance <geometry> [scale <s>] [rotate <axis x y z> <degrees>] [translate <x y z>]...
+**
+** A material has to be defined before it is used. Mesh files are looked for relative to the
+** directory of the scene file. A geometry is a mesh that is loaded once and not shown itself,
+** each instance of it shows a copy moved by its options, which are applied in the order given.
+** spatial builds the mesh's BVH with spatial splits, which takes longer but suits final renders
+** of meshes with big triangles next to small ones.
+*/
+
+/*
+** Reads a scene file into the objects, lights and camera of the ray tracer. The file is mapped
+** and parsed in place in one pass; names are looked up straight from the mapped text so nothing
+** is allocated per token. Meshes are loaded on the pool's threads if one is given.
+** On failure it returns false and, if error is not NULL, says what went wrong in it.
+*/
+bool LoadSceneFile(const std::string &path, ThreadPool *pool = NULL, std::string *error = NULL);
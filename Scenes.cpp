@@ -0,0 +1,251 @@
+#include "RayTracer.h"
+
+/*
+** The scenes that are compiled into the ray tracer. Each one pushes its objects into the
+** global objects vector, the objects are allocated with new and deleted again by cleanup().
+*/
+
+// The light all the built in scenes are lit by
+const Light sceneLight(glm::vec3(-150, 300, 10), glm::vec3(1, 1, 1));
+
+// The scene from the coursework: a few spheres and a triangle in the corner of a room
+void BuildDefaultScene() {
+	// this can be used as a global transform for every object if I'm feeling lazy
+	glm::mat4 transform1(1.0f);
+
+	MaterialID chrome = AddMaterial(Material(glm::vec3(0.01, 0.01, 0.01), glm::vec3(0.9, 0.9, 0.9), glm::vec3(0.8, 0.8, 1.0), 20, 0.0, 0.7, 1.4));
+	MaterialID glossGreen = AddMaterial(Material(glm::vec3(0.01, 0.05, 0.02), glm::vec3(0.4, 0.6, 0.3), glm::vec3(0.5, 0.5, 0.5), 30, 0.1, 0, 1.0));
+	MaterialID glossRed = AddMaterial(Material(glm::vec3(0.05, 0.03, 0.03), glm::vec3(1.0, 0.3, 0.3), glm::vec3(0.7, 0.7, 0.7), 10, 0.2, 0, 0));
+	MaterialID mirrorPink = AddMaterial(Material(glm::vec3(0.05, 0.03, 0.03), glm::vec3(1.0, 0.5, 0.7), glm::vec3(0.7, 0.7, 0.7), 10, 0.4, 0, 0));
+	MaterialID shinnyLightBlue = AddMaterial(Material(glm::vec3(0.01, 0.05, 0.02), glm::vec3(0.3, 0.3, 1.0), glm::vec3(0.2, 0.2, 0.2), 60, 0.3, 0, 1.0));
+	MaterialID whiteWall = AddMaterial(Material(glm::vec3(0.3, 0.3, 0.3), glm::vec3(0.7, 0.7, 0.7), glm::vec3(0.7, 0.7, 0.7), 20, 0.5, 0, 1.0));
+	MaterialID floorGreen = AddMaterial(Material(glm::vec3(0.03, 0.03, 0.03), glm::vec3(0.8, 1.0, 0.9), glm::vec3(0.5, 0.5, 0.5), 20, 0.0, 0, 1.0));
+
+	MaterialID extra1 = AddMaterial(Material(glm::vec3(0.03, 0.03, 0.03), glm::vec3(0.9, 0.6, 0.5), glm::vec3(0.3, 0.3, 0.3), 20, 0.4, 0.0, 1.0));
+	MaterialID extra2 = AddMaterial(Material(glm::vec3(0.03, 0.03, 0.03), glm::vec3(0.9, 0.4, 0.3), glm::vec3(0.3, 0.3, 0.3), 10, 0.1, 0.0, 1.0));
+	MaterialID extra3 = AddMaterial(Material(glm::vec3(0.03, 0.03, 0.03), glm::vec3(0.7, 0.7, 0.5), glm::vec3(0.3, 0.3, 0.3), 30, 0.0, 0.0, 1.0));
+	MaterialID extra4 = AddMaterial(Material(glm::vec3(0.03, 0.03, 0.03), glm::vec3(0.8, 0.9, 0.6), glm::vec3(0.3, 0.3, 0.3), 50, 0.5, 0.0, 1.0));
+	MaterialID extra5 = AddMaterial(Material(glm::vec3(0.03, 0.03, 0.03), glm::vec3(0.8, 0.2, 0.5), glm::vec3(0.3, 0.3, 0.3), 30, 0.8, 0.0, 1.0));
+	MaterialID extra6 = AddMaterial(Material(glm::vec3(0.03, 0.03, 0.03), glm::vec3(0.4, 0.6, 0.2), glm::vec3(0.3, 0.3, 0.3), 90, 0.5, 0.0, 1.0));
+	MaterialID extra7 = AddMaterial(Material(glm::vec3(0.03, 0.03, 0.03), glm::vec3(0.8, 0.5, 0.3), glm::vec3(0.3, 0.3, 0.3), 70, 0.3, 0.1, 1.0));
+
+	Sphere *sphere1 = new Sphere(transform1, chrome, glm::vec3(150, -170, -150), 30.0);
+	Sphere *sphere2 = new Sphere(transform1, glossRed, glm::vec3(140, -180, -90), 20.0);
+	Sphere *sphere3 = new Sphere(transform1, glossGreen, glm::vec3(190, -178, -110), 22.0);
+	Sphere *sphere4 = new Sphere(transform1, shinnyLightBlue, glm::vec3(220, -181, -160), 19.0);
+	Sphere *sphere5 = new Sphere(transform1, extra1, glm::vec3(210, -182, -220), 18.0);
+	Sphere *sphere6 = new Sphere(transform1, extra2, glm::vec3(170, -182, -200), 18.0);
+	Sphere *sphere7 = new Sphere(transform1, extra3, glm::vec3(140, -181, -230), 19.0);
+	Sphere *sphere8 = new Sphere(transform1, extra4, glm::vec3(100, -178, -200), 22.0);
+	Sphere *sphere9 = new Sphere(transform1, extra6, glm::vec3(50, -181, -150), 19.0);
+	Sphere *sphere10 = new Sphere(transform1, extra7, glm::vec3(90, -181, -100), 19.0);
+
+	Triangle *triangle = new Triangle(transform1, mirrorPink, glm::vec3(80, -200, -180), glm::vec3(120, -200, -120), glm::vec3(110, -140, -150));
+
+	Plane *plane1 = new Plane(transform1, whiteWall, glm::vec3(0, 0, -250), glm::vec3(0, 0, 1));
+	Plane *plane2 = new Plane(transform1, whiteWall, glm::vec3(250, 0, 0), glm::vec3(-1, 0, 0));
+	Plane *floorPlane = new Plane(transform1, whiteWall, glm::vec3(0, -200, 0), glm::vec3(0, 1, 0));
+	Plane *roofPlane = new Plane(transform1, whiteWall, glm::vec3(0, 500, 0), glm::vec3(0, -1, 0));
+
+	// use this to push objects into the vector
+	objects.push_back(sphere1);
+	objects.push_back(sphere2);
+	objects.push_back(sphere3);
+	objects.push_back(sphere4);
+	objects.push_back(sphere5);
+	objects.push_back(sphere6);
+	objects.push_back(sphere7);
+	objects.push_back(sphere8);
+	objects.push_back(sphere9);
+	objects.push_back(sphere10);
+
+	objects.push_back(triangle);
+
+	objects.push_back(plane1);
+	objects.push_back(plane2);
+	objects.push_back(floorPlane);
+	objects.push_back(roofPlane);
+
+	lights.push_back(sceneLight);
+}
+
+// A box of small spheres on the floor of the same room, for measuring how the ray tracer copes with large scenes
+void BuildParticlesScene() {
+	glm::mat4 transform1(1.0f);
+
+	MaterialID whiteWall = AddMaterial(Material(glm::vec3(0.3, 0.3, 0.3), glm::vec3(0.7, 0.7, 0.7), glm::vec3(0.7, 0.7, 0.7), 20, 0.5, 0, 1.0));
+	// all the particles go in one sphere set rather than being separate objects
+	SphereSet *particles = new SphereSet();
+	MaterialID particleMaterials[3] = {
+		AddMaterial(Material(glm::vec3(0.03, 0.03, 0.03), glm::vec3(0.9, 0.6, 0.5), glm::vec3(0.3, 0.3, 0.3), 20, 0.0, 0.0, 1.0)),
+		AddMaterial(Material(glm::vec3(0.03, 0.03, 0.03), glm::vec3(0.4, 0.6, 0.2), glm::vec3(0.3, 0.3, 0.3), 40, 0.2, 0.0, 1.0)),
+		AddMaterial(Material(glm::vec3(0.01, 0.05, 0.02), glm::vec3(0.3, 0.3, 1.0), glm::vec3(0.2, 0.2, 0.2), 60, 0.0, 0.0, 1.0))
+	};
+
+	// a fixed linear congruential generator so the scene is the same on every machine
+	unsigned int seed = 12345;
+	for (int x = 0; x < 40; ++x)
+		for (int y = 0; y < 20; ++y)
+			for (int z = 0; z < 40; ++z) {
+				float jitter[3];
+				for (int i = 0; i < 3; ++i) {
+					seed = seed * 1664525u + 1013904223u;
+					jitter[i] = (seed >> 8) / 16777216.0f;
+				}
+				glm::vec3 center(10 + (x + jitter[0]) * 5.5f, -196 + (y + jitter[1]) * 5.5f, -245 + (z + jitter[2]) * 5.5f);
+				particles->AddSphere(center, 2.0f, particleMaterials[(x + y + z) % 3]);
+			}
+	particles->Build();
+	objects.push_back(particles);
+
+	objects.push_back(new Plane(transform1, whiteWall, glm::vec3(0, 0, -250), glm::vec3(0, 0, 1)));
+	objects.push_back(new Plane(transform1, whiteWall, glm::vec3(250, 0, 0), glm::vec3(-1, 0, 0)));
+	objects.push_back(new Plane(transform1, whiteWall, glm::vec3(0, -200, 0), glm::vec3(0, 1, 0)));
+	objects.push_back(new Plane(transform1, whiteWall, glm::vec3(0, 500, 0), glm::vec3(0, -1, 0)));
+
+	lights.push_back(sceneLight);
+}
+
+/*
+** A ring lying flat around center, made of rings * sides quads split into triangles,
+** with smooth normals.
+*/
+TriangleMesh *MakeTorus(MaterialID material, const glm::vec3 &center, float ringRadius, float tubeRadius, int rings, int sides) {
+	TriangleMesh *mesh = new TriangleMesh(material);
+	for (int i = 0; i < rings; ++i) {
+		float ringAngle = 2.0f * (float)M_PI * i / rings;
+		glm::vec3 ringDirection(cosf(ringAngle), 0.0f, sinf(ringAngle));
+		for (int j = 0; j < sides; ++j) {
+			float sideAngle = 2.0f * (float)M_PI * j / sides;
+			glm::vec3 normal = cosf(sideAngle) * ringDirection + glm::vec3(0.0f, sinf(sideAngle), 0.0f);
+			mesh->positions.push_back(center + ringRadius * ringDirection + tubeRadius * normal);
+			mesh->normals.push_back(normal);
+			mesh->uvs.push_back(glm::vec2((float)i / rings, (float)j / sides));
+		}
+	}
+	for (int i = 0; i < rings; ++i) {
+		for (int j = 0; j < sides; ++j) {
+			uint32_t a = i * sides + j;
+			uint32_t b = ((i + 1) % rings) * sides + j;
+			uint32_t c = ((i + 1) % rings) * sides + (j + 1) % sides;
+			uint32_t d = i * sides + (j + 1) % sides;
+			uint32_t quad[6] = { a, b, c, a, c, d };
+			mesh->indices.insert(mesh->indices.end(), quad, quad + 6);
+		}
+	}
+	mesh->Build();
+	return mesh;
+}
+
+/*
+** Loads a mesh file and scales and moves it so it stands on the floor of the mesh scene where the
+** torus would be. Returns NULL if the file could not be loaded.
+*/
+TriangleMesh *LoadModel(const std::string &path, MaterialID material, ThreadPool *pool) {
+	TriangleMesh *mesh = new TriangleMesh(material);
+	std::string error;
+	if (!LoadMesh(path, *mesh, pool, &error) || mesh->positions.empty()) {
+		fprintf(stderr, "Could not load %s: %s\n", path.c_str(), error.empty() ? "it has no vertices" : error.c_str());
+		delete mesh;
+		return NULL;
+	}
+	AABB bounds;
+	for (size_t i = 0; i < mesh->positions.size(); ++i) {
+		bounds.Extend(mesh->positions[i]);
+	}
+	glm::vec3 extent = bounds.Extent();
+	float scale = 120.0f / std::max(std::max(extent.x, extent.y), std::max(extent.z, 1e-6f));
+	glm::vec3 base(bounds.Centroid().x, bounds.min.y, bounds.Centroid().z);
+	for (size_t i = 0; i < mesh->positions.size(); ++i) {
+		mesh->positions[i] = glm::vec3(150, -200, -150) + scale * (mesh->positions[i] - base);
+	}
+	mesh->Build();
+	return mesh;
+}
+
+// A finely tessellated torus, or a model loaded from a file, next to a mirror sphere in the room
+bool BuildMeshScene(const std::string &modelPath, ThreadPool *pool) {
+	glm::mat4 transform1(1.0f);
+
+	MaterialID whiteWall = AddMaterial(Material(glm::vec3(0.3, 0.3, 0.3), glm::vec3(0.7, 0.7, 0.7), glm::vec3(0.7, 0.7, 0.7), 20, 0.5, 0, 1.0));
+	MaterialID glossRed = AddMaterial(Material(glm::vec3(0.05, 0.03, 0.03), glm::vec3(1.0, 0.3, 0.3), glm::vec3(0.7, 0.7, 0.7), 10, 0.2, 0, 0));
+	MaterialID mirror = AddMaterial(Material(glm::vec3(0.01, 0.01, 0.01), glm::vec3(0.3, 0.3, 0.3), glm::vec3(0.8, 0.8, 0.8), 60, 0.8, 0, 1.0));
+
+	if (modelPath.empty()) {
+		objects.push_back(MakeTorus(glossRed, glm::vec3(150, -185, -150), 45.0f, 15.0f, 256, 128));
+	} else {
+		TriangleMesh *model = LoadModel(modelPath, glossRed, pool);
+		if (!model) {
+			return false;
+		}
+		objects.push_back(model);
+	}
+	objects.push_back(new Sphere(transform1, mirror, glm::vec3(80, -170, -200), 30.0f));
+
+	objects.push_back(new Plane(transform1, whiteWall, glm::vec3(0, 0, -250), glm::vec3(0, 0, 1)));
+	objects.push_back(new Plane(transform1, whiteWall, glm::vec3(250, 0, 0), glm::vec3(-1, 0, 0)));
+	objects.push_back(new Plane(transform1, whiteWall, glm::vec3(0, -200, 0), glm::vec3(0, 1, 0)));
+	objects.push_back(new Plane(transform1, whiteWall, glm::vec3(0, 500, 0), glm::vec3(0, -1, 0)));
+
+	lights.push_back(sceneLight);
+	return true;
+}
+
+/*
+** Thousands of copies of one small torus scattered over the floor of the room, each turned and sized
+** differently. The torus is built once as shared geometry and every copy is an Instance of it.
+*/
+void BuildInstancesScene() {
+	glm::mat4 transform1(1.0f);
+
+	MaterialID whiteWall = AddMaterial(Material(glm::vec3(0.3, 0.3, 0.3), glm::vec3(0.7, 0.7, 0.7), glm::vec3(0.7, 0.7, 0.7), 20, 0.5, 0, 1.0));
+	MaterialID glossRed = AddMaterial(Material(glm::vec3(0.05, 0.03, 0.03), glm::vec3(1.0, 0.3, 0.3), glm::vec3(0.7, 0.7, 0.7), 10, 0.2, 0, 0));
+
+	TriangleMesh *torus = MakeTorus(glossRed, glm::vec3(0.0f), 1.5f, 0.5f, 64, 32);
+	geometries.push_back(torus);
+
+	// the same generator as the particles scene, so the copies are placed the same way on every machine
+	unsigned int seed = 12345;
+	for (int x = 0; x < 48; ++x)
+		for (int z = 0; z < 48; ++z) {
+			float random[3];
+			for (int i = 0; i < 3; ++i) {
+				seed = seed * 1664525u + 1013904223u;
+				random[i] = (seed >> 8) / 16777216.0f;
+			}
+			float scale = 0.8f + 0.5f * random[0];
+			glm::mat4 transform = glm::translate(glm::mat4(1.0f), glm::vec3(10 + x * 4.7f, -198.0f + scale, -245 + z * 4.7f));
+			// this version of glm takes the angles in degrees
+			transform = glm::rotate(transform, 360.0f * random[1], glm::vec3(0, 1, 0));
+			transform = glm::rotate(transform, 90.0f * random[2], glm::vec3(1, 0, 0));
+			transform = glm::scale(transform, glm::vec3(scale));
+			objects.push_back(new Instance(torus, transform));
+		}
+
+	objects.push_back(new Plane(transform1, whiteWall, glm::vec3(0, 0, -250), glm::vec3(0, 0, 1)));
+	objects.push_back(new Plane(transform1, whiteWall, glm::vec3(250, 0, 0), glm::vec3(-1, 0, 0)));
+	objects.push_back(new Plane(transform1, whiteWall, glm::vec3(0, -200, 0), glm::vec3(0, 1, 0)));
+	objects.push_back(new Plane(transform1, whiteWall, glm::vec3(0, 500, 0), glm::vec3(0, -1, 0)));
+
+	lights.push_back(sceneLight);
+}
+
+/*
+** Fills the objects vector with the built in scene of the given name. The mesh scene shows the
+** model in modelPath if one is given, loading it on the pool's threads.
+** Returns false if there is no scene with that name or the model could not be loaded.
+*/
+bool LoadBuiltInScene(const std::string &name, const std::string &modelPath, ThreadPool *pool) {
+	if (name == "default") {
+		BuildDefaultScene();
+	} else if (name == "particles") {
+		BuildParticlesScene();
+	} else if (name == "mesh") {
+		return BuildMeshScene(modelPath, pool);
+	} else if (name == "instances") {
+		BuildInstancesScene();
+	} else {
+		return false;
+	}
+	return true;
+}
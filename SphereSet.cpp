@@ -0,0 +1,460 @@
+#include "SphereSet.h"
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define SPHERE_SET_AVX
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define SPHERE_SET_SSE
+#endif
+
+namespace {
+    // one SIMD register worth of spheres per leaf
+#if defined(SPHERE_SET_AVX)
+    const int LEAF_SIZE = 8;
+#else
+    const int LEAF_SIZE = 4;
+#endif
+
+    // a set only gets a grid when it has at least this many spheres, the largest radius is at most
+    // this many times the mean, and at least this share of the cells end up with spheres in them
+    const int GRID_MIN_SPHERES = 10000;
+    const float GRID_MAX_RADIUS_RATIO = 2.0f;
+    const float GRID_MIN_OCCUPANCY = 0.5f;
+    // aimed for resolution of the grid
+    const float GRID_CELLS_PER_SPHERE = 0.5f;
+}
+
+SphereSet::Accelerator SphereSet::accelerator = SphereSet::CHOOSE;
+
+SphereSet::SphereSet():
+    Object(glm::mat4(1.0f), 0),
+    centerXData(NULL),
+    centerYData(NULL),
+    centerZData(NULL),
+    radiusData(NULL),
+    materialIndexData(NULL),
+    numSpheres(0)
+  {}
+
+void SphereSet::AddSphere(const glm::vec3 &center, float r, MaterialID material) {
+    centerX.push_back(center.x);
+    centerY.push_back(center.y);
+    centerZ.push_back(center.z);
+    radius.push_back(r);
+    materialIndex.push_back(material);
+}
+
+void SphereSet::Build() {
+    int count = (int)materialIndex.size();
+    centerX.resize(count);
+    centerY.resize(count);
+    centerZ.resize(count);
+    radius.resize(count);
+    std::vector<AABB> bounds(count);
+    for (int i = 0; i < count; ++i) {
+        glm::vec3 center(centerX[i], centerY[i], centerZ[i]);
+        bounds[i] = AABB(center - glm::vec3(radius[i]), center + glm::vec3(radius[i]));
+    }
+
+    // where each sphere goes in the sorted arrays
+    std::vector<uint32_t> order;
+    if (BuildGrid(bounds)) {
+        bvh.UseNodes(NULL, 0);
+        // the spheres are numbered in the order the cells first list them, so the spheres of
+        // one cell are close together in memory
+        std::vector<uint32_t> newIndex(count, 0xffffffff);
+        order.reserve(count);
+        for (size_t i = 0; i < grid.items.size(); ++i) {
+            uint32_t &item = grid.items[i];
+            if (newIndex[item] == 0xffffffff) {
+                newIndex[item] = (uint32_t)order.size();
+                order.push_back(item);
+            }
+            item = newIndex[item];
+        }
+    } else {
+        bvh.Build(bounds, LEAF_SIZE);
+        order = bvh.indices;
+        for (int i = 0; i < count; ++i) {
+            bvh.indices[i] = (uint32_t)i;
+        }
+    }
+
+    // put the spheres in that order, for the BVH every leaf is then one contiguous run of the arrays
+    std::vector<float> sortedX(count + PADDING, 0.0f), sortedY(count + PADDING, 0.0f), sortedZ(count + PADDING, 0.0f);
+    std::vector<float> sortedRadius(count + PADDING, 0.0f);
+    std::vector<MaterialID> sortedMaterial(count + PADDING, 0);
+    for (int i = 0; i < count; ++i) {
+        uint32_t from = order[i];
+        sortedX[i] = centerX[from];
+        sortedY[i] = centerY[from];
+        sortedZ[i] = centerZ[from];
+        sortedRadius[i] = radius[from];
+        sortedMaterial[i] = materialIndex[from];
+    }
+    centerX.swap(sortedX);
+    centerY.swap(sortedY);
+    centerZ.swap(sortedZ);
+    radius.swap(sortedRadius);
+    materialIndex.swap(sortedMaterial);
+    // the padding is only needed in the arrays the kernels load from
+    materialIndex.resize(count);
+
+    centerXData = &centerX[0];
+    centerYData = &centerY[0];
+    centerZData = &centerZ[0];
+    radiusData = &radius[0];
+    materialIndexData = materialIndex.empty() ? NULL : &materialIndex[0];
+    numSpheres = count;
+}
+
+void SphereSet::UseArrays(int count, const float *x, const float *y, const float *z, const float *r,
+                          const MaterialID *materials, const BVHNode *nodes, size_t numNodes) {
+    centerX.clear();
+    centerY.clear();
+    centerZ.clear();
+    radius.clear();
+    materialIndex.clear();
+    centerXData = x;
+    centerYData = y;
+    centerZData = z;
+    radiusData = r;
+    materialIndexData = materials;
+    numSpheres = count;
+    bvh.UseNodes(nodes, numNodes);
+    grid = Grid();
+}
+
+void SphereSet::UseGrid(const AABB &box, const int32_t *resolution, const uint32_t *cellStart, const uint32_t *items) {
+    grid.UseArrays(box, resolution, cellStart, items);
+}
+
+bool SphereSet::BuildGrid(const std::vector<AABB> &bounds) {
+    grid = Grid();
+    if (accelerator == ALWAYS_BVH || bounds.empty()) {
+        return false;
+    }
+    if (accelerator == CHOOSE) {
+        // a grid suits lots of spheres of about the same size, which a few big ones would spoil
+        // by being listed in a great many cells
+        if ((int)bounds.size() < GRID_MIN_SPHERES) {
+            return false;
+        }
+        float totalRadius = 0.0f, maxRadius = 0.0f;
+        for (size_t i = 0; i < radius.size(); ++i) {
+            totalRadius += radius[i];
+            maxRadius = std::max(maxRadius, radius[i]);
+        }
+        if (maxRadius > GRID_MAX_RADIUS_RATIO * totalRadius / radius.size()) {
+            return false;
+        }
+    }
+    grid.Build(bounds, GRID_CELLS_PER_SPHERE);
+    // spheres bunched up in a few places leave most cells empty, and a ray would cross a lot of
+    // those for every sphere it tests, where the BVH skips the empty space in a few nodes
+    if (accelerator == CHOOSE && grid.Occupancy() < GRID_MIN_OCCUPANCY) {
+        grid = Grid();
+        return false;
+    }
+    return true;
+}
+
+/*
+** Every kernel below solves the same quadratic as Sphere::Intersect, written with the half b term:
+**   oc = origin - center, b = dot(oc, d), c = dot(oc, oc) - r^2, discriminant = b^2 - a c
+** and only the nearer root is used, a sphere the ray starts inside of is not hit.
+*/
+
+#if defined(SPHERE_SET_AVX)
+
+int SphereSet::IntersectRange(const Ray &ray, int first, int count, float &tMax) const {
+    float a = glm::dot(ray.direction, ray.direction);
+    __m256 ox = _mm256_set1_ps(ray.origin.x), oy = _mm256_set1_ps(ray.origin.y), oz = _mm256_set1_ps(ray.origin.z);
+    __m256 dx = _mm256_set1_ps(ray.direction.x), dy = _mm256_set1_ps(ray.direction.y), dz = _mm256_set1_ps(ray.direction.z);
+    __m256 va = _mm256_set1_ps(a), invA = _mm256_set1_ps(1.0f / a), zero = _mm256_setzero_ps();
+    __m256 best = _mm256_set1_ps(tMax);
+    __m256i bestIndex = _mm256_set1_epi32(-1);
+
+    for (int i = 0; i < count; i += 8) {
+        int base = first + i;
+        __m256 ocx = _mm256_sub_ps(ox, _mm256_loadu_ps(centerXData + base));
+        __m256 ocy = _mm256_sub_ps(oy, _mm256_loadu_ps(centerYData + base));
+        __m256 ocz = _mm256_sub_ps(oz, _mm256_loadu_ps(centerZData + base));
+        __m256 r = _mm256_loadu_ps(radiusData + base);
+        __m256 b = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, dx), _mm256_mul_ps(ocy, dy)), _mm256_mul_ps(ocz, dz));
+        __m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, ocx), _mm256_mul_ps(ocy, ocy)), _mm256_mul_ps(ocz, ocz)), _mm256_mul_ps(r, r));
+        __m256 discriminant = _mm256_sub_ps(_mm256_mul_ps(b, b), _mm256_mul_ps(va, c));
+        __m256 t = _mm256_mul_ps(_mm256_sub_ps(_mm256_sub_ps(zero, b), _mm256_sqrt_ps(_mm256_max_ps(discriminant, zero))), invA);
+
+        __m256 lanes = _mm256_set_ps(7, 6, 5, 4, 3, 2, 1, 0);
+        __m256 mask = _mm256_and_ps(_mm256_cmp_ps(discriminant, zero, _CMP_GE_OQ), _mm256_cmp_ps(t, zero, _CMP_GE_OQ));
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(t, best, _CMP_LT_OQ));
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(lanes, _mm256_set1_ps((float)(count - i)), _CMP_LT_OQ));
+
+        __m256i index = _mm256_setr_epi32(base, base + 1, base + 2, base + 3, base + 4, base + 5, base + 6, base + 7);
+        best = _mm256_blendv_ps(best, t, mask);
+        bestIndex = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(bestIndex), _mm256_castsi256_ps(index), mask));
+    }
+
+    float times[8];
+    int indices[8];
+    _mm256_storeu_ps(times, best);
+    _mm256_storeu_si256((__m256i *)indices, bestIndex);
+    int hit = -1;
+    for (int lane = 0; lane < 8; ++lane) {
+        if (indices[lane] >= 0 && times[lane] < tMax) {
+            tMax = times[lane];
+            hit = indices[lane];
+        }
+    }
+    return hit;
+}
+
+bool SphereSet::OccludedRange(const Ray &ray, int first, int count, float tMax) const {
+    float a = glm::dot(ray.direction, ray.direction);
+    __m256 ox = _mm256_set1_ps(ray.origin.x), oy = _mm256_set1_ps(ray.origin.y), oz = _mm256_set1_ps(ray.origin.z);
+    __m256 dx = _mm256_set1_ps(ray.direction.x), dy = _mm256_set1_ps(ray.direction.y), dz = _mm256_set1_ps(ray.direction.z);
+    __m256 va = _mm256_set1_ps(a), invA = _mm256_set1_ps(1.0f / a), zero = _mm256_setzero_ps();
+    __m256 maxTime = _mm256_set1_ps(tMax);
+
+    for (int i = 0; i < count; i += 8) {
+        int base = first + i;
+        __m256 ocx = _mm256_sub_ps(ox, _mm256_loadu_ps(centerXData + base));
+        __m256 ocy = _mm256_sub_ps(oy, _mm256_loadu_ps(centerYData + base));
+        __m256 ocz = _mm256_sub_ps(oz, _mm256_loadu_ps(centerZData + base));
+        __m256 r = _mm256_loadu_ps(radiusData + base);
+        __m256 b = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, dx), _mm256_mul_ps(ocy, dy)), _mm256_mul_ps(ocz, dz));
+        __m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, ocx), _mm256_mul_ps(ocy, ocy)), _mm256_mul_ps(ocz, ocz)), _mm256_mul_ps(r, r));
+        __m256 discriminant = _mm256_sub_ps(_mm256_mul_ps(b, b), _mm256_mul_ps(va, c));
+        __m256 t = _mm256_mul_ps(_mm256_sub_ps(_mm256_sub_ps(zero, b), _mm256_sqrt_ps(_mm256_max_ps(discriminant, zero))), invA);
+
+        __m256 lanes = _mm256_set_ps(7, 6, 5, 4, 3, 2, 1, 0);
+        __m256 mask = _mm256_and_ps(_mm256_cmp_ps(discriminant, zero, _CMP_GE_OQ), _mm256_cmp_ps(t, zero, _CMP_GE_OQ));
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(t, maxTime, _CMP_LT_OQ));
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(lanes, _mm256_set1_ps((float)(count - i)), _CMP_LT_OQ));
+        if (_mm256_movemask_ps(mask)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+#elif defined(SPHERE_SET_SSE)
+
+int SphereSet::IntersectRange(const Ray &ray, int first, int count, float &tMax) const {
+    float a = glm::dot(ray.direction, ray.direction);
+    __m128 ox = _mm_set1_ps(ray.origin.x), oy = _mm_set1_ps(ray.origin.y), oz = _mm_set1_ps(ray.origin.z);
+    __m128 dx = _mm_set1_ps(ray.direction.x), dy = _mm_set1_ps(ray.direction.y), dz = _mm_set1_ps(ray.direction.z);
+    __m128 va = _mm_set1_ps(a), invA = _mm_set1_ps(1.0f / a), zero = _mm_setzero_ps();
+    __m128 lanes = _mm_set_ps(3, 2, 1, 0);
+    __m128 best = _mm_set1_ps(tMax);
+    __m128i bestIndex = _mm_set1_epi32(-1);
+
+    for (int i = 0; i < count; i += 4) {
+        int base = first + i;
+        __m128 ocx = _mm_sub_ps(ox, _mm_loadu_ps(centerXData + base));
+        __m128 ocy = _mm_sub_ps(oy, _mm_loadu_ps(centerYData + base));
+        __m128 ocz = _mm_sub_ps(oz, _mm_loadu_ps(centerZData + base));
+        __m128 r = _mm_loadu_ps(radiusData + base);
+        __m128 b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, dx), _mm_mul_ps(ocy, dy)), _mm_mul_ps(ocz, dz));
+        __m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, ocx), _mm_mul_ps(ocy, ocy)), _mm_mul_ps(ocz, ocz)), _mm_mul_ps(r, r));
+        __m128 discriminant = _mm_sub_ps(_mm_mul_ps(b, b), _mm_mul_ps(va, c));
+        __m128 t = _mm_mul_ps(_mm_sub_ps(_mm_sub_ps(zero, b), _mm_sqrt_ps(_mm_max_ps(discriminant, zero))), invA);
+
+        __m128 mask = _mm_and_ps(_mm_cmpge_ps(discriminant, zero), _mm_cmpge_ps(t, zero));
+        mask = _mm_and_ps(mask, _mm_cmplt_ps(t, best));
+        mask = _mm_and_ps(mask, _mm_cmplt_ps(lanes, _mm_set1_ps((float)(count - i))));
+
+        __m128i index = _mm_setr_epi32(base, base + 1, base + 2, base + 3);
+        best = _mm_or_ps(_mm_and_ps(mask, t), _mm_andnot_ps(mask, best));
+        __m128i intMask = _mm_castps_si128(mask);
+        bestIndex = _mm_or_si128(_mm_and_si128(intMask, index), _mm_andnot_si128(intMask, bestIndex));
+    }
+
+    float times[4];
+    int indices[4];
+    _mm_storeu_ps(times, best);
+    _mm_storeu_si128((__m128i *)indices, bestIndex);
+    int hit = -1;
+    for (int lane = 0; lane < 4; ++lane) {
+        if (indices[lane] >= 0 && times[lane] < tMax) {
+            tMax = times[lane];
+            hit = indices[lane];
+        }
+    }
+    return hit;
+}
+
+bool SphereSet::OccludedRange(const Ray &ray, int first, int count, float tMax) const {
+    float a = glm::dot(ray.direction, ray.direction);
+    __m128 ox = _mm_set1_ps(ray.origin.x), oy = _mm_set1_ps(ray.origin.y), oz = _mm_set1_ps(ray.origin.z);
+    __m128 dx = _mm_set1_ps(ray.direction.x), dy = _mm_set1_ps(ray.direction.y), dz = _mm_set1_ps(ray.direction.z);
+    __m128 va = _mm_set1_ps(a), invA = _mm_set1_ps(1.0f / a), zero = _mm_setzero_ps();
+    __m128 lanes = _mm_set_ps(3, 2, 1, 0);
+    __m128 maxTime = _mm_set1_ps(tMax);
+
+    for (int i = 0; i < count; i += 4) {
+        int base = first + i;
+        __m128 ocx = _mm_sub_ps(ox, _mm_loadu_ps(centerXData + base));
+        __m128 ocy = _mm_sub_ps(oy, _mm_loadu_ps(centerYData + base));
+        __m128 ocz = _mm_sub_ps(oz, _mm_loadu_ps(centerZData + base));
+        __m128 r = _mm_loadu_ps(radiusData + base);
+        __m128 b = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, dx), _mm_mul_ps(ocy, dy)), _mm_mul_ps(ocz, dz));
+        __m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ocx, ocx), _mm_mul_ps(ocy, ocy)), _mm_mul_ps(ocz, ocz)), _mm_mul_ps(r, r));
+        __m128 discriminant = _mm_sub_ps(_mm_mul_ps(b, b), _mm_mul_ps(va, c));
+        __m128 t = _mm_mul_ps(_mm_sub_ps(_mm_sub_ps(zero, b), _mm_sqrt_ps(_mm_max_ps(discriminant, zero))), invA);
+
+        __m128 mask = _mm_and_ps(_mm_cmpge_ps(discriminant, zero), _mm_cmpge_ps(t, zero));
+        mask = _mm_and_ps(mask, _mm_cmplt_ps(t, maxTime));
+        mask = _mm_and_ps(mask, _mm_cmplt_ps(lanes, _mm_set1_ps((float)(count - i))));
+        if (_mm_movemask_ps(mask)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+#else
+
+int SphereSet::IntersectRange(const Ray &ray, int first, int count, float &tMax) const {
+    float a = glm::dot(ray.direction, ray.direction);
+    int hit = -1;
+    for (int i = first; i < first + count; ++i) {
+        glm::vec3 oc = ray.origin - glm::vec3(centerXData[i], centerYData[i], centerZData[i]);
+        float b = glm::dot(oc, ray.direction);
+        float c = glm::dot(oc, oc) - radiusData[i] * radiusData[i];
+        float discriminant = b * b - a * c;
+        if (discriminant < 0) {
+            continue;
+        }
+        float t = (-b - sqrtf(discriminant)) / a;
+        if (t >= 0 && t < tMax) {
+            tMax = t;
+            hit = i;
+        }
+    }
+    return hit;
+}
+
+bool SphereSet::OccludedRange(const Ray &ray, int first, int count, float tMax) const {
+    float t = tMax;
+    return IntersectRange(ray, first, count, t) >= 0;
+}
+
+#endif
+
+int SphereSet::IntersectList(const Ray &ray, const uint32_t *list, uint32_t count, float &tMax) const {
+    // multiplied by 1 / a like the SIMD kernels, so a ray leaving a sphere's surface finds the same
+    // hits whichever structure the set uses
+    float a = glm::dot(ray.direction, ray.direction), invA = 1.0f / a;
+    int hit = -1;
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t sphere = list[i];
+        glm::vec3 oc = ray.origin - glm::vec3(centerXData[sphere], centerYData[sphere], centerZData[sphere]);
+        float b = glm::dot(oc, ray.direction);
+        float c = glm::dot(oc, oc) - radiusData[sphere] * radiusData[sphere];
+        float discriminant = b * b - a * c;
+        if (discriminant < 0) {
+            continue;
+        }
+        float t = (-b - sqrtf(discriminant)) * invA;
+        if (t >= 0 && t < tMax) {
+            tMax = t;
+            hit = (int)sphere;
+        }
+    }
+    return hit;
+}
+
+bool SphereSet::OccludedList(const Ray &ray, const uint32_t *list, uint32_t count, float tMax) const {
+    float t = tMax;
+    return IntersectList(ray, list, count, t) >= 0;
+}
+
+bool SphereSet::Intersect(const Ray &ray, HitRecord &hit) const {
+    int closest = -1;
+    if (UsesGrid()) {
+        grid.IntersectCells(ray, hit.time, [&](const uint32_t *list, uint32_t count, float &closestTime) {
+            int sphere = IntersectList(ray, list, count, closestTime);
+            if (sphere >= 0) {
+                closest = sphere;
+                return true;
+            }
+            return false;
+        });
+    } else {
+        bvh.IntersectLeaves(ray, hit.time, [&](const BVHNode &leaf, float &closestTime) {
+            int sphere = IntersectRange(ray, leaf.offset, leaf.count, closestTime);
+            if (sphere >= 0) {
+                closest = sphere;
+                return true;
+            }
+            return false;
+        });
+    }
+    if (closest < 0) {
+        return false;
+    }
+    hit.object = this;
+    hit.primitive = (uint32_t)closest;
+    return true;
+}
+
+void SphereSet::GetSurface(const Ray &ray, const HitRecord &hit, IntersectInfo &info) const {
+    glm::vec3 center(centerXData[hit.primitive], centerYData[hit.primitive], centerZData[hit.primitive]);
+    info.hitPoint = ray(hit.time);
+    info.normal = glm::normalize(info.hitPoint - center);
+    info.materialID = materialIndexData[hit.primitive];
+    info.time = hit.time;
+}
+
+bool SphereSet::Occluded(const Ray &ray, float tMax) const {
+    if (UsesGrid()) {
+        return grid.OccludedCells(ray, tMax, [&](const uint32_t *list, uint32_t count, float maxTime) {
+            return OccludedList(ray, list, count, maxTime);
+        });
+    }
+    return bvh.OccludedLeaves(ray, tMax, [&](const BVHNode &leaf, float maxTime) {
+        return OccludedRange(ray, leaf.offset, leaf.count, maxTime);
+    });
+}
+
+void SphereSet::IntersectPacket(const RayPacket &packet, uint32_t lanes, HitRecord *hits) const {
+    // the rays of a packet walk the grid one at a time
+    if (UsesGrid()) {
+        Object::IntersectPacket(packet, lanes, hits);
+        return;
+    }
+    float tMax[RayPacket::MAX_SIZE];
+    for (int lane = 0; lane < packet.size; ++lane) {
+        tMax[lane] = hits[lane].time;
+    }
+    bvh.IntersectPacketLeaves(packet, tMax, lanes, [&](const BVHNode &leaf, uint32_t leafLanes) {
+        for (uint32_t bits = leafLanes; bits; bits &= bits - 1) {
+            int lane = LowestLane(bits);
+            int sphere = IntersectRange(packet.Get(lane), leaf.offset, leaf.count, tMax[lane]);
+            if (sphere >= 0) {
+                hits[lane].time = tMax[lane];
+                hits[lane].object = this;
+                hits[lane].primitive = (uint32_t)sphere;
+            }
+        }
+    });
+}
+
+uint32_t SphereSet::OccludedPacket(const RayPacket &packet, uint32_t lanes, const float *tMax) const {
+    if (UsesGrid()) {
+        return Object::OccludedPacket(packet, lanes, tMax);
+    }
+    return bvh.OccludedPacketLeaves(packet, tMax, lanes, [&](const BVHNode &leaf, uint32_t leafLanes) {
+        uint32_t occluded = 0;
+        for (uint32_t bits = leafLanes; bits; bits &= bits - 1) {
+            int lane = LowestLane(bits);
+            if (OccludedRange(packet.Get(lane), leaf.offset, leaf.count, tMax[lane])) {
+                occluded |= 1u << lane;
+            }
+        }
+        return occluded;
+    });
+}
@@ -0,0 +1,88 @@
+#pragma once
+
+#include "Object.h"
+#include "BVH.h"
+#include "Grid.h"
+
+/*
+** A large number of spheres packed into one object.
+** Instead of one heap allocated Sphere per sphere, the centres and radii are kept in flat float
+** arrays (structure of arrays) in the order of the leaves of the set's own BVH. Each leaf holds as
+** many spheres as fit in a SIMD register, 4 with SSE or 8 with AVX, which are tested at the same time.
+** A set of very many spheres of about the same size spread evenly through its box uses a uniform grid
+** instead of the BVH, which builds in linear time and is quicker to walk for that kind of set.
+*/
+class SphereSet : public Object {
+  public:
+    SphereSet();
+
+    /* Adds a sphere, Build() has to be called once all the spheres have been added */
+    void AddSphere(const glm::vec3 &center, float radius, MaterialID material);
+    /*
+    ** Builds the grid or the BVH over the spheres, whichever accelerator picks, and sorts the arrays
+    ** into the order of the cells or the leaves
+    */
+    void Build();
+
+    /*
+    ** Uses spheres and a BVH that were built earlier and are kept somewhere else, such as in a
+    ** mapped scene cache, instead of building them. The arrays are in leaf order and the centre
+    ** and radius arrays have PADDING unused entries on the end. Nothing is copied, so the memory
+    ** has to outlive the set.
+    */
+    void UseArrays(int count, const float *x, const float *y, const float *z, const float *r,
+                   const MaterialID *materials, const BVHNode *nodes, size_t numNodes);
+    /* Uses a grid kept somewhere else instead of the BVH, after UseArrays() with no nodes, see Grid::UseArrays() */
+    void UseGrid(const AABB &box, const int32_t *resolution, const uint32_t *cellStart, const uint32_t *items);
+
+    int Size() const { return numSpheres; }
+    bool UsesGrid() const { return !grid.IsEmpty(); }
+
+    virtual bool Intersect(const Ray &ray, HitRecord &hit) const;
+    virtual void GetSurface(const Ray &ray, const HitRecord &hit, IntersectInfo &info) const;
+    virtual bool Occluded(const Ray &ray, float tMax) const;
+    virtual void IntersectPacket(const RayPacket &packet, uint32_t lanes, HitRecord *hits) const;
+    virtual uint32_t OccludedPacket(const RayPacket &packet, uint32_t lanes, const float *tMax) const;
+    virtual AABB Bounds() const { return UsesGrid() ? grid.Bounds() : bvh.Bounds(); }
+
+    /*
+    ** Tests spheres [first, first + count) against the ray. Returns the index of the nearest one hit
+    ** closer than tMax and lowers tMax to its distance, or -1 if none of them is hit.
+    */
+    int IntersectRange(const Ray &ray, int first, int count, float &tMax) const;
+    /* Returns true if any of spheres [first, first + count) is hit closer than tMax */
+    bool OccludedRange(const Ray &ray, int first, int count, float tMax) const;
+    /* The same for the spheres listed in one grid cell */
+    int IntersectList(const Ray &ray, const uint32_t *list, uint32_t count, float &tMax) const;
+    bool OccludedList(const Ray &ray, const uint32_t *list, uint32_t count, float tMax) const;
+
+    // the kernels always load a full SIMD width, so once the set is built the centre and radius
+    // arrays have this many unused spheres on the end
+    static const int PADDING = 8;
+
+    // which structure Build() puts over the spheres, set by -g
+    enum Accelerator { CHOOSE, ALWAYS_BVH, ALWAYS_GRID };
+    static Accelerator accelerator;
+
+  private:
+    friend class SceneCache;
+
+    std::vector<float> centerX, centerY, centerZ;
+    std::vector<float> radius;
+    // each sphere has its own material, from the scene's material table
+    std::vector<MaterialID> materialIndex;
+    BVH bvh;
+    // not empty when the set uses a grid in place of the BVH
+    Grid grid;
+    // what the kernels read, either the vectors above once built or arrays given to UseArrays()
+    const float *centerXData, *centerYData, *centerZData;
+    const float *radiusData;
+    const MaterialID *materialIndexData;
+    int numSpheres;
+
+    /* Builds the grid if the spheres suit one, otherwise leaves it empty and returns false */
+    bool BuildGrid(const std::vector<AABB> &bounds);
+
+    SphereSet(const SphereSet &);
+    SphereSet &operator =(const SphereSet &);
+};
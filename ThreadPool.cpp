@@ -0,0 +1,117 @@
+#include "ThreadPool.h"
+
+ThreadPool::ThreadPool(int numThreads):
+    task(NULL),
+    remaining(0),
+    generation(0),
+    stopping(false)
+  {
+    if (numThreads <= 0) {
+        numThreads = (int)std::thread::hardware_concurrency();
+    }
+    if (numThreads <= 0) {
+        numThreads = 1;
+    }
+    for (int i = 0; i < numThreads; ++i) {
+        queues.push_back(new WorkQueue());
+    }
+    // queue 0 belongs to the thread that calls ParallelFor
+    for (int i = 1; i < numThreads; ++i) {
+        threads.push_back(std::thread(&ThreadPool::WorkerLoop, this, i));
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (size_t i = 0; i < threads.size(); ++i) {
+        threads[i].join();
+    }
+    for (size_t i = 0; i < queues.size(); ++i) {
+        delete queues[i];
+    }
+}
+
+void ThreadPool::ParallelFor(int count, const std::function<void(int)> &work) {
+    if (count <= 0) {
+        return;
+    }
+    int numWorkers = NumThreads();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        task = &work;
+        remaining = count;
+        // give every worker a contiguous block, neighbouring items tend to cost about the same
+        for (int w = 0; w < numWorkers; ++w) {
+            std::lock_guard<std::mutex> queueLock(queues[w]->mutex);
+            for (int i = (int)((long long)count * w / numWorkers); i < (int)((long long)count * (w + 1) / numWorkers); ++i) {
+                queues[w]->items.push_back(i);
+            }
+        }
+        generation++;
+    }
+    wake.notify_all();
+
+    RunItems(0);
+
+    std::unique_lock<std::mutex> lock(mutex);
+    while (remaining > 0) {
+        finished.wait(lock);
+    }
+    task = NULL;
+}
+
+void ThreadPool::WorkerLoop(int worker) {
+    unsigned int seenGeneration = 0;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (!stopping && generation == seenGeneration) {
+                wake.wait(lock);
+            }
+            if (stopping) {
+                return;
+            }
+            seenGeneration = generation;
+        }
+        RunItems(worker);
+    }
+}
+
+void ThreadPool::RunItems(int worker) {
+    int item;
+    while (PopOrSteal(worker, item)) {
+        (*task)(item);
+        if (--remaining == 0) {
+            // take the lock so the notify cannot slip in between the caller's check and its wait
+            std::lock_guard<std::mutex> lock(mutex);
+            finished.notify_all();
+        }
+    }
+}
+
+bool ThreadPool::PopOrSteal(int worker, int &item) {
+    {
+        WorkQueue &own = *queues[worker];
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.items.empty()) {
+            item = own.items.back();
+            own.items.pop_back();
+            return true;
+        }
+    }
+    int numWorkers = NumThreads();
+    for (int i = 1; i < numWorkers; ++i) {
+        WorkQueue &victim = *queues[(worker + i) % numWorkers];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.items.empty()) {
+            item = victim.items.front();
+            victim.items.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+** A fixed set of worker threads which share out work by stealing.
+** ParallelFor() deals the items out evenly into one queue per worker. Each worker takes items from
+** the back of its own queue, and when that runs dry it steals from the front of the other queues,
+** so workers that were given cheap items help out with the expensive ones instead of sitting idle.
+** The thread calling ParallelFor() works as well, so a pool of one thread runs everything inline.
+*/
+class ThreadPool {
+  public:
+    // numThreads <= 0 uses one thread for every core
+    explicit ThreadPool(int numThreads = 0);
+    ~ThreadPool();
+
+    int NumThreads() const { return (int)queues.size(); }
+
+    /* Calls task(i) for every i in [0, count) and returns once all of them have finished */
+    void ParallelFor(int count, const std::function<void(int)> &task);
+
+  private:
+    struct WorkQueue {
+        std::mutex mutex;
+        std::deque<int> items;
+    };
+
+    void WorkerLoop(int worker);
+    void RunItems(int worker);
+    bool PopOrSteal(int worker, int &item);
+
+    std::vector<std::thread> threads;
+    std::vector<WorkQueue*> queues;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable finished;
+    const std::function<void(int)> *task;
+    std::atomic<int> remaining;
+    unsigned int generation;
+    bool stopping;
+
+    ThreadPool(const ThreadPool &);
+    ThreadPool &operator =(const ThreadPool &);
+};
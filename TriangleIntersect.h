@@ -0,0 +1,53 @@
+#pragma once
+
+#include "Ray.h"
+
+// A triangle in the form the intersection test wants it: one corner, the two edges leaving it
+// and the unit normal, all worked out once when the triangle is made.
+struct TriangleData {
+    glm::vec3 vertex0;
+    glm::vec3 edge1;
+    glm::vec3 edge2;
+    glm::vec3 normal;
+
+    TriangleData() {}
+    TriangleData(const glm::vec3 &p1, const glm::vec3 &p2, const glm::vec3 &p3):
+        vertex0(p1),
+        edge1(p2 - p1),
+        edge2(p3 - p1),
+        normal(glm::normalize(glm::cross(p2 - p1, p3 - p1)))
+    {}
+};
+
+/*
+** Moller-Trumbore ray/triangle intersection. Both sides of the triangle can be hit, points on the
+** edges count as inside. On a hit in (0, tMax) it returns true with the distance t along the ray
+** and the barycentric coordinates (u, v) of the hit point relative to vertex1 and vertex2.
+*/
+inline bool IntersectTriangle(const Ray &ray, const glm::vec3 &vertex0, const glm::vec3 &edge1, const glm::vec3 &edge2,
+                              float tMax, float &t, float &u, float &v) {
+    glm::vec3 p = glm::cross(ray.direction, edge2);
+    float determinant = glm::dot(edge1, p);
+    // the ray is parallel to the triangle
+    if (determinant == 0.0f) {
+        return false;
+    }
+    float invDeterminant = 1.0f / determinant;
+
+    glm::vec3 s = ray.origin - vertex0;
+    u = glm::dot(s, p) * invDeterminant;
+    if (u < 0.0f || u > 1.0f) {
+        return false;
+    }
+    glm::vec3 q = glm::cross(s, edge1);
+    v = glm::dot(ray.direction, q) * invDeterminant;
+    if (v < 0.0f || u + v > 1.0f) {
+        return false;
+    }
+    t = glm::dot(edge2, q) * invDeterminant;
+    return t > 0.0f && t < tMax;
+}
+
+inline bool IntersectTriangle(const Ray &ray, const TriangleData &triangle, float tMax, float &t, float &u, float &v) {
+    return IntersectTriangle(ray, triangle.vertex0, triangle.edge1, triangle.edge2, tMax, t, u, v);
+}
@@ -0,0 +1,187 @@
+#include "TriangleMesh.h"
+#include "TriangleIntersect.h"
+
+TriangleMesh::TriangleMesh(MaterialID material):
+    Object(glm::mat4(1.0f), material),
+    positionData(NULL),
+    normalData(NULL),
+    uvData(NULL),
+    indexData(NULL),
+    numVertices(0),
+    numIndices(0)
+  {}
+
+void TriangleMesh::Build(bool spatialSplits) {
+    int count = (int)(indices.size() / 3);
+    std::vector<AABB> bounds(count);
+    for (int i = 0; i < count; ++i) {
+        bounds[i].Extend(positions[indices[3 * i]]);
+        bounds[i].Extend(positions[indices[3 * i + 1]]);
+        bounds[i].Extend(positions[indices[3 * i + 2]]);
+    }
+    if (spatialSplits) {
+        bvh.BuildSpatial(bounds, [this](uint32_t triangle, const AABB &, int axis, float position, AABB &left, AABB &right) {
+            // the corners on each side, and the points where the edges cross the plane on both
+            left = AABB();
+            right = AABB();
+            for (int corner = 0; corner < 3; ++corner) {
+                const glm::vec3 &from = positions[indices[3 * triangle + corner]];
+                const glm::vec3 &to = positions[indices[3 * triangle + (corner + 1) % 3]];
+                if (from[axis] <= position) {
+                    left.Extend(from);
+                }
+                if (from[axis] >= position) {
+                    right.Extend(from);
+                }
+                if ((from[axis] < position && to[axis] > position) || (from[axis] > position && to[axis] < position)) {
+                    glm::vec3 crossing = glm::mix(from, to, (position - from[axis]) / (to[axis] - from[axis]));
+                    crossing[axis] = position;
+                    left.Extend(crossing);
+                    right.Extend(crossing);
+                }
+            }
+        });
+    } else {
+        bvh.Build(bounds);
+    }
+
+    // reorder the triangles so each leaf is a contiguous run of the index buffer, after that
+    // the leaves are enough to find the triangles and the BVH's own index list can go
+    std::vector<uint32_t> sorted(3 * bvh.indices.size());
+    for (size_t i = 0; i < bvh.indices.size(); ++i) {
+        uint32_t from = bvh.indices[i];
+        sorted[3 * i] = indices[3 * from];
+        sorted[3 * i + 1] = indices[3 * from + 1];
+        sorted[3 * i + 2] = indices[3 * from + 2];
+    }
+    indices.swap(sorted);
+    bvh.DropIndices();
+
+    positionData = positions.empty() ? NULL : &positions[0];
+    normalData = normals.empty() ? NULL : &normals[0];
+    uvData = uvs.empty() ? NULL : &uvs[0];
+    indexData = indices.empty() ? NULL : &indices[0];
+    numVertices = (uint32_t)positions.size();
+    numIndices = (uint32_t)indices.size();
+}
+
+void TriangleMesh::UseArrays(uint32_t vertexCount, const glm::vec3 *positionArray, const glm::vec3 *normalArray, const glm::vec2 *uvArray,
+                             uint32_t indexCount, const uint32_t *indexArray, const BVHNode *nodes, size_t numNodes) {
+    positions.clear();
+    normals.clear();
+    uvs.clear();
+    indices.clear();
+    positionData = positionArray;
+    normalData = normalArray;
+    uvData = uvArray;
+    indexData = indexArray;
+    numVertices = vertexCount;
+    numIndices = indexCount;
+    bvh.UseNodes(nodes, numNodes);
+}
+
+size_t TriangleMesh::MemoryUsage() const {
+    return positions.capacity() * sizeof(glm::vec3) + normals.capacity() * sizeof(glm::vec3)
+        + uvs.capacity() * sizeof(glm::vec2) + indices.capacity() * sizeof(uint32_t)
+        + bvh.nodes.capacity() * sizeof(BVHNode) + bvh.wideNodes.capacity() * sizeof(WideBVHNode) + sizeof(*this);
+}
+
+bool TriangleMesh::Intersect(const Ray &ray, HitRecord &hit) const {
+    int closest = -1;
+    float closestU = 0, closestV = 0;
+    bvh.IntersectLeaves(ray, hit.time, [&](const BVHNode &leaf, float &closestTime) {
+        bool found = false;
+        for (uint32_t i = leaf.offset; i < leaf.offset + leaf.count; ++i) {
+            const glm::vec3 &p0 = positionData[indexData[3 * i]];
+            float t, u, v;
+            if (IntersectTriangle(ray, p0, positionData[indexData[3 * i + 1]] - p0, positionData[indexData[3 * i + 2]] - p0, closestTime, t, u, v)) {
+                closestTime = t;
+                closest = (int)i;
+                closestU = u;
+                closestV = v;
+                found = true;
+            }
+        }
+        return found;
+    });
+    if (closest < 0) {
+        return false;
+    }
+    hit.object = this;
+    hit.primitive = (uint32_t)closest;
+    hit.u = closestU;
+    hit.v = closestV;
+    return true;
+}
+
+void TriangleMesh::GetSurface(const Ray &ray, const HitRecord &hit, IntersectInfo &info) const {
+    uint32_t i0 = indexData[3 * hit.primitive], i1 = indexData[3 * hit.primitive + 1], i2 = indexData[3 * hit.primitive + 2];
+    info.hitPoint = ray(hit.time);
+    if (normalData) {
+        info.normal = glm::normalize((1.0f - hit.u - hit.v) * normalData[i0] + hit.u * normalData[i1] + hit.v * normalData[i2]);
+    } else {
+        info.normal = glm::normalize(glm::cross(positionData[i1] - positionData[i0], positionData[i2] - positionData[i0]));
+    }
+    info.materialID = materialID;
+    info.time = hit.time;
+}
+
+bool TriangleMesh::Occluded(const Ray &ray, float tMax) const {
+    return bvh.OccludedLeaves(ray, tMax, [&](const BVHNode &leaf, float maxTime) {
+        for (uint32_t i = leaf.offset; i < leaf.offset + leaf.count; ++i) {
+            const glm::vec3 &p0 = positionData[indexData[3 * i]];
+            float t, u, v;
+            if (IntersectTriangle(ray, p0, positionData[indexData[3 * i + 1]] - p0, positionData[indexData[3 * i + 2]] - p0, maxTime, t, u, v)) {
+                return true;
+            }
+        }
+        return false;
+    });
+}
+
+void TriangleMesh::IntersectPacket(const RayPacket &packet, uint32_t lanes, HitRecord *hits) const {
+    float tMax[RayPacket::MAX_SIZE];
+    for (int lane = 0; lane < packet.size; ++lane) {
+        tMax[lane] = hits[lane].time;
+    }
+    bvh.IntersectPacketLeaves(packet, tMax, lanes, [&](const BVHNode &leaf, uint32_t leafLanes) {
+        // each triangle is fetched once for all the rays that reach the leaf
+        for (uint32_t i = leaf.offset; i < leaf.offset + leaf.count; ++i) {
+            const glm::vec3 &p0 = positionData[indexData[3 * i]];
+            glm::vec3 edge1 = positionData[indexData[3 * i + 1]] - p0;
+            glm::vec3 edge2 = positionData[indexData[3 * i + 2]] - p0;
+            for (uint32_t bits = leafLanes; bits; bits &= bits - 1) {
+                int lane = LowestLane(bits);
+                float t, u, v;
+                if (IntersectTriangle(packet.Get(lane), p0, edge1, edge2, tMax[lane], t, u, v)) {
+                    tMax[lane] = t;
+                    HitRecord &hit = hits[lane];
+                    hit.time = t;
+                    hit.object = this;
+                    hit.primitive = i;
+                    hit.u = u;
+                    hit.v = v;
+                }
+            }
+        }
+    });
+}
+
+uint32_t TriangleMesh::OccludedPacket(const RayPacket &packet, uint32_t lanes, const float *tMax) const {
+    return bvh.OccludedPacketLeaves(packet, tMax, lanes, [&](const BVHNode &leaf, uint32_t leafLanes) {
+        uint32_t occluded = 0;
+        for (uint32_t i = leaf.offset; i < leaf.offset + leaf.count && occluded != leafLanes; ++i) {
+            const glm::vec3 &p0 = positionData[indexData[3 * i]];
+            glm::vec3 edge1 = positionData[indexData[3 * i + 1]] - p0;
+            glm::vec3 edge2 = positionData[indexData[3 * i + 2]] - p0;
+            for (uint32_t bits = leafLanes & ~occluded; bits; bits &= bits - 1) {
+                int lane = LowestLane(bits);
+                float t, u, v;
+                if (IntersectTriangle(packet.Get(lane), p0, edge1, edge2, tMax[lane], t, u, v)) {
+                    occluded |= 1u << lane;
+                }
+            }
+        }
+        return occluded;
+    });
+}
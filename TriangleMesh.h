@@ -0,0 +1,69 @@
+#pragma once
+
+#include "Object.h"
+#include "BVH.h"
+
+/*
+** A mesh of triangles which share their vertices.
+** The vertex attributes are kept in shared arrays and every triangle is three 32 bit indices into
+** them, with one material for the whole mesh. The mesh is a single object in the scene with its
+** own BVH over its triangles, so however many triangles it has it only costs one entry in the
+** scene's hierarchy.
+*/
+class TriangleMesh : public Object {
+  public:
+    TriangleMesh(MaterialID material = 0);
+
+    // Shared vertex data, normals and uvs are optional and are either empty or one per position
+    std::vector<glm::vec3> positions;
+    std::vector<glm::vec3> normals;
+    std::vector<glm::vec2> uvs;
+    // Three indices into the vertex arrays per triangle
+    std::vector<uint32_t> indices;
+
+    /*
+    ** Builds the BVH, call this once the arrays have been filled. The triangles are reordered.
+    ** With spatialSplits the BVH is an SBVH, which takes longer to build but traces faster when big
+    ** triangles lie next to small ones. Triangles it cuts are listed once for each leaf they are in.
+    */
+    void Build(bool spatialSplits = false);
+
+    /*
+    ** Uses a mesh and BVH that were built earlier and are kept somewhere else, such as in a
+    ** mapped scene cache, instead of the arrays above. normals and uvs may be NULL. Nothing is
+    ** copied, so the memory has to outlive the mesh.
+    */
+    void UseArrays(uint32_t numVertices, const glm::vec3 *positionArray, const glm::vec3 *normalArray, const glm::vec2 *uvArray,
+                   uint32_t numTriangleIndices, const uint32_t *indexArray, const BVHNode *nodes, size_t numNodes);
+
+    // counting each triangle once for every leaf it is in
+    int NumTriangles() const { return (int)(numIndices / 3); }
+    int NumVertices() const { return (int)numVertices; }
+    const glm::vec3 *PositionData() const { return positionData; }
+    const glm::vec3 *NormalData() const { return normalData; }
+    const glm::vec2 *UVData() const { return uvData; }
+    const uint32_t *IndexData() const { return indexData; }
+    const BVH &Hierarchy() const { return bvh; }
+    /* The memory used by the mesh and its BVH, in bytes */
+    size_t MemoryUsage() const;
+
+    virtual bool Intersect(const Ray &ray, HitRecord &hit) const;
+    virtual void GetSurface(const Ray &ray, const HitRecord &hit, IntersectInfo &info) const;
+    virtual bool Occluded(const Ray &ray, float tMax) const;
+    virtual void IntersectPacket(const RayPacket &packet, uint32_t lanes, HitRecord *hits) const;
+    virtual uint32_t OccludedPacket(const RayPacket &packet, uint32_t lanes, const float *tMax) const;
+    virtual AABB Bounds() const { return bvh.Bounds(); }
+
+  private:
+    BVH bvh;
+    // what the intersection tests read, either the vectors above once built or arrays given to UseArrays()
+    const glm::vec3 *positionData;
+    const glm::vec3 *normalData;
+    const glm::vec2 *uvData;
+    const uint32_t *indexData;
+    uint32_t numVertices;
+    uint32_t numIndices;
+
+    TriangleMesh(const TriangleMesh &);
+    TriangleMesh &operator =(const TriangleMesh &);
+};
@@ -0,0 +1,161 @@
+#include "RayTracer.h"
+#include "Wavefront.h"
+
+namespace {
+
+// A ray of the current wave, along with the pixel of the tile it adds its colour to
+struct WaveRay {
+    WaveRay(const Ray &ray, float weight, int pixel, int numBounces, float refractiveIndex):
+        ray(ray),
+        weight(weight),
+        pixel(pixel),
+        numBounces(numBounces),
+        refractiveIndex(refractiveIndex)
+    {}
+
+    Ray ray;
+    float weight;
+    int pixel;
+    int numBounces;
+    float refractiveIndex;
+};
+
+// A ray of the wave that hit something, and where
+struct WaveHit {
+    IntersectInfo info;
+    uint32_t ray;
+};
+
+// Everything the waves of one tile use, kept together so the vectors are only allocated once per tile
+struct WaveQueues {
+    std::vector<WaveRay> wave;
+    std::vector<WaveRay> nextWave;
+    std::vector<WaveHit> hits;
+    std::vector<glm::vec3> hitPoints;
+    std::vector<char> shadowed;
+};
+
+/*
+** Intersects every ray of the wave, leaving the ones that hit something in hits in the order of the wave.
+** Neighbouring rays of the wave are traced together as packets, which is where the primary rays of a
+** block of pixels are, and where the reflections off the same material end up after the sort.
+*/
+void IntersectWave(WaveQueues &queues) {
+    queues.hits.clear();
+    if (packetSize <= 1) {
+        for (size_t i = 0; i < queues.wave.size(); ++i) {
+            WaveHit hit;
+            if (CheckIntersection(queues.wave[i].ray, hit.info)) {
+                hit.ray = (uint32_t)i;
+                queues.hits.push_back(hit);
+            }
+        }
+        return;
+    }
+    for (size_t first = 0; first < queues.wave.size(); first += packetSize) {
+        RayPacket packet;
+        packet.size = (int)std::min((size_t)packetSize, queues.wave.size() - first);
+        for (int lane = 0; lane < packet.size; ++lane) {
+            packet.Set(lane, queues.wave[first + lane].ray);
+        }
+        packet.ComputeBounds();
+        IntersectInfo info[RayPacket::MAX_SIZE];
+        uint32_t hitLanes = CheckIntersectionPacket(packet, info);
+        for (int lane = 0; lane < packet.size; ++lane) {
+            if (hitLanes >> lane & 1) {
+                WaveHit hit;
+                hit.info = info[lane];
+                hit.ray = (uint32_t)(first + lane);
+                queues.hits.push_back(hit);
+            }
+        }
+    }
+}
+
+/* Finds out which lights every hit can see, the shadow rays towards each light are traced as packets */
+void TraceShadowRays(WaveQueues &queues) {
+    queues.hitPoints.resize(queues.hits.size());
+    for (size_t h = 0; h < queues.hits.size(); ++h) {
+        queues.hitPoints[h] = queues.hits[h].info.hitPoint;
+    }
+    queues.shadowed.resize(queues.hits.size() * lights.size());
+    FindShadows(queues.hitPoints.data(), (int)queues.hitPoints.size(), queues.shadowed.data());
+}
+
+}
+
+void RenderTileWavefront(int x0, int y0, int x1, int y1, Framebuffer &frame) {
+    int width = x1 - x0;
+    int numPixels = width * (y1 - y0);
+    std::vector<glm::vec3> colors(numPixels, glm::vec3(0.0f));
+    std::vector<uint32_t> randomStates(numPixels);
+    // pixels whose primary ray hits nothing show the background
+    std::vector<char> background(numPixels, 1);
+
+    WaveQueues queues;
+    queues.wave.reserve(numPixels);
+    // the first wave goes block by block, so each packet of it is the rays of a small block of pixels
+    int blockWidth = PacketBlockWidth(packetSize);
+    int blockHeight = std::max(1, packetSize / blockWidth);
+    std::vector<RayBatch> rows(blockHeight);
+    for (int blockY = y0; blockY < y1; blockY += blockHeight) {
+        int numRows = std::min(blockHeight, y1 - blockY);
+        for (int row = 0; row < numRows; ++row) {
+            camera.GenerateRays(x0, blockY + row, width, rows[row]);
+        }
+        for (int blockX = x0; blockX < x1; blockX += blockWidth) {
+            for (int y = blockY; y < blockY + numRows; ++y) {
+                for (int x = blockX; x < std::min(blockX + blockWidth, x1); ++x) {
+                    int pixel = (y - y0) * width + (x - x0);
+                    randomStates[pixel] = PixelSeed(x, y);
+                    queues.wave.push_back(WaveRay(rows[y - blockY].Get(x - x0), 1.0f, pixel, 0, 1.0f));
+                }
+            }
+        }
+    }
+
+    for (bool primary = true; !queues.wave.empty(); primary = false) {
+        IntersectWave(queues);
+        if (primary) {
+            for (size_t h = 0; h < queues.hits.size(); ++h) {
+                background[queues.wave[queues.hits[h].ray].pixel] = 0;
+            }
+        }
+
+        // hits on the same material are shaded one after the other, the sort is stable so the
+        // rays of each material stay in wave order and the image does not depend on the sort
+        std::stable_sort(queues.hits.begin(), queues.hits.end(), [](const WaveHit &a, const WaveHit &b) {
+            return a.info.materialID < b.info.materialID;
+        });
+        TraceShadowRays(queues);
+
+        queues.nextWave.clear();
+        for (size_t h = 0; h < queues.hits.size(); ++h) {
+            const WaveHit &hit = queues.hits[h];
+            const WaveRay &current = queues.wave[hit.ray];
+            const Material &material = materials[hit.info.materialID];
+
+            glm::vec3 surfaceColour;
+            Bounce bounce = Shade(current.ray, hit.info, current.weight, current.numBounces, current.refractiveIndex, true,
+                &queues.shadowed[h * lights.size()], surfaceColour);
+            colors[current.pixel] += bounce.surfaceWeight * surfaceColour;
+            uint32_t &randomState = randomStates[current.pixel];
+            if (KeepRay(bounce.reflectionWeight, randomState)) {
+                queues.nextWave.push_back(WaveRay(GetReflectionRay(current.ray, hit.info), bounce.reflectionWeight, current.pixel,
+                    current.numBounces + 1, current.refractiveIndex));
+            }
+            if (KeepRay(bounce.refractionWeight, randomState)) {
+                queues.nextWave.push_back(WaveRay(bounce.refractionRay, bounce.refractionWeight, current.pixel,
+                    current.numBounces + 1, material.refractiveIndex));
+            }
+        }
+        queues.wave.swap(queues.nextWave);
+    }
+
+    for (int y = y0; y < y1; ++y) {
+        for (int x = x0; x < x1; ++x) {
+            int pixel = (y - y0) * width + (x - x0);
+            frame.At(x, y) = background[pixel] ? glm::vec3(1, 0, 0) : colors[pixel];
+        }
+    }
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include "Framebuffer.h"
+
+// Width and height of the tiles the wavefront renderer works on, bigger than the normal tiles
+// so each wave has enough rays in it to be worth sorting
+const int WAVEFRONT_TILE_SIZE = 64;
+
+/*
+** Renders the rectangle [x0, x1) x [y0, y1) of the frame one wave of rays at a time, instead of
+** following each pixel's rays to the end before starting the next pixel like CastRay does.
+** The first wave is every primary ray of the tile. Each wave is intersected with the scene as one
+** stream, the rays that hit something are sorted by material, their shadow rays are traced as
+** another stream, and then they are shaded together, material by material, putting their
+** reflection and refraction rays into the next wave. The colours are the ones CastRay gives up to
+** the rounding of adding them up in a different order.
+*/
+void RenderTileWavefront(int x0, int y0, int x1, int y1, Framebuffer &frame);
@@ -0,0 +1,210 @@
+/*
+** Checks BVH::Update() against testing every primitive. Boxes are moved a little at a time, so most
+** frames only refit, and every so often a group of them is thrown across the scene, which makes the
+** subtrees they are in expensive enough to be rebuilt. After every frame the tree has to hold each
+** primitive once in a leaf whose box contains it, fit in the traversal stack, and give the same
+** closest hits and shadow rays as a brute force search. This is done for the SAH build, the linear
+** build with and without treelet reoptimization, and for each of them widened.
+** Build and run it with make test.
+*/
+#include "BVH.h"
+#include "ThreadPool.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+
+namespace {
+    const int NUM_PRIMITIVES = 10000;
+    const int NUM_FRAMES = 40;
+    const int RAYS_PER_FRAME = 200;
+    const float SCENE_SIZE = 100.0f;
+    const float HALF_SIZE = 0.3f;
+
+    uint32_t randomState = 1;
+
+    float Random() {
+        randomState = randomState * 1664525u + 1013904223u;
+        return (randomState >> 8) / 16777216.0f;
+    }
+
+    glm::vec3 RandomPoint() {
+        return glm::vec3(Random(), Random(), Random()) * SCENE_SIZE;
+    }
+
+    bool Contains(const AABB &outer, const AABB &inner) {
+        return inner.IsEmpty() || (glm::all(glm::lessThanEqual(outer.min, inner.min)) && glm::all(glm::greaterThanEqual(outer.max, inner.max)));
+    }
+
+    /* The time the ray enters the box, if it does before tMax */
+    bool HitBox(const Ray &ray, const AABB &box, float tMax, float &t) {
+        glm::vec3 invDirection = 1.0f / ray.direction;
+        glm::vec3 near = (box.min - ray.origin) * invDirection;
+        glm::vec3 far = (box.max - ray.origin) * invDirection;
+        glm::vec3 low = glm::min(near, far), high = glm::max(near, far);
+        float tEnter = std::max(std::max(low.x, low.y), std::max(low.z, 0.0f));
+        float tExit = std::min(std::min(high.x, high.y), high.z);
+        if (tEnter > tExit || tEnter >= tMax) {
+            return false;
+        }
+        t = tEnter;
+        return true;
+    }
+
+    /* Returns a description of what is wrong with the tree, or NULL if nothing is */
+    const char *CheckStructure(const BVH &bvh, const std::vector<AABB> &bounds) {
+        const BVHNode *nodes = bvh.NodeData();
+        std::vector<int> seen(bounds.size(), 0);
+        std::vector<std::pair<uint32_t, int> > stack(1, std::make_pair(0u, 1));
+        while (!stack.empty()) {
+            uint32_t node = stack.back().first;
+            int depth = stack.back().second;
+            stack.pop_back();
+            if (depth > BVH::STACK_SIZE) {
+                return "the tree is deeper than the traversal stack";
+            }
+            const BVHNode &n = nodes[node];
+            if (n.count > 0) {
+                for (uint32_t i = n.offset; i < n.offset + n.count; ++i) {
+                    uint32_t primitive = bvh.IndexData()[i];
+                    if (primitive >= bounds.size()) {
+                        return "a leaf lists a primitive that does not exist";
+                    }
+                    seen[primitive]++;
+                    if (!Contains(n.bounds, bounds[primitive])) {
+                        return "a leaf's box does not contain its primitive";
+                    }
+                }
+            } else {
+                if (!Contains(n.bounds, nodes[node + 1].bounds) || !Contains(n.bounds, nodes[n.offset].bounds)) {
+                    return "a node's box does not contain its children";
+                }
+                stack.push_back(std::make_pair(node + 1, depth + 1));
+                stack.push_back(std::make_pair(n.offset, depth + 1));
+            }
+        }
+        for (size_t i = 0; i < seen.size(); ++i) {
+            if (seen[i] != 1) {
+                return "a primitive is not in exactly one leaf";
+            }
+        }
+        return NULL;
+    }
+
+    /* Returns the number of rays the BVH gets a different answer for than testing every primitive */
+    int CheckRays(const BVH &bvh, const std::vector<AABB> &bounds) {
+        int mismatches = 0;
+        for (int r = 0; r < RAYS_PER_FRAME; ++r) {
+            Ray ray(RandomPoint(), glm::normalize(glm::vec3(Random(), Random(), Random()) - 0.5f));
+            auto hitPrimitive = [&](uint32_t index, float &tMax) {
+                float t;
+                if (HitBox(ray, bounds[index], tMax, t)) {
+                    tMax = t;
+                    return true;
+                }
+                return false;
+            };
+            float closest = std::numeric_limits<float>::infinity();
+            for (size_t i = 0; i < bounds.size(); ++i) {
+                hitPrimitive((uint32_t)i, closest);
+            }
+            float found = std::numeric_limits<float>::infinity();
+            bvh.Intersect(ray, found, hitPrimitive);
+            if (found != closest) {
+                mismatches++;
+            }
+
+            float tMax = Random() * SCENE_SIZE;
+            bool occluded = bvh.Occluded(ray, tMax, [&](uint32_t index, float tMax) {
+                float t;
+                return HitBox(ray, bounds[index], tMax, t);
+            });
+            if (occluded != (closest < tMax)) {
+                mismatches++;
+            }
+        }
+        return mismatches;
+    }
+
+    /* Moves the boxes about and checks the tree after every Update(), returns the number of failures */
+    int RunCase(const char *name) {
+        randomState = 1;
+        std::vector<glm::vec3> centres(NUM_PRIMITIVES), velocities(NUM_PRIMITIVES);
+        std::vector<AABB> bounds(NUM_PRIMITIVES);
+        for (int i = 0; i < NUM_PRIMITIVES; ++i) {
+            centres[i] = RandomPoint();
+            velocities[i] = (glm::vec3(Random(), Random(), Random()) - 0.5f) * 0.5f;
+            bounds[i] = AABB(centres[i] - HALF_SIZE, centres[i] + HALF_SIZE);
+        }
+        BVH bvh;
+        bvh.Build(bounds);
+
+        int failures = 0;
+        for (int frame = 0; frame < NUM_FRAMES; ++frame) {
+            std::vector<uint32_t> changed;
+            // a few hundred boxes drift, and every fifth frame a tight group of them jumps somewhere else
+            for (int i = 0; i < 300; ++i) {
+                uint32_t index = (uint32_t)(Random() * NUM_PRIMITIVES) % NUM_PRIMITIVES;
+                centres[index] += velocities[index];
+                changed.push_back(index);
+            }
+            if (frame % 5 == 4) {
+                glm::vec3 target = RandomPoint();
+                uint32_t first = (uint32_t)(Random() * NUM_PRIMITIVES) % (NUM_PRIMITIVES - 200);
+                for (uint32_t index = first; index < first + 200; ++index) {
+                    centres[index] = target + (glm::vec3(Random(), Random(), Random()) - 0.5f) * 5.0f;
+                    changed.push_back(index);
+                }
+            }
+            for (size_t i = 0; i < changed.size(); ++i) {
+                bounds[changed[i]] = AABB(centres[changed[i]] - HALF_SIZE, centres[changed[i]] + HALF_SIZE);
+            }
+            bvh.Update(bounds, changed);
+
+            const char *problem = CheckStructure(bvh, bounds);
+            if (problem) {
+                printf("%s, frame %d: %s\n", name, frame, problem);
+                failures++;
+                break;
+            }
+            if (BVH::buildWideNodes != bvh.IsWide()) {
+                printf("%s, frame %d: the tree is %s\n", name, frame, bvh.IsWide() ? "wide" : "not wide");
+                failures++;
+                break;
+            }
+            int mismatches = CheckRays(bvh, bounds);
+            if (mismatches > 0) {
+                printf("%s, frame %d: %d rays do not match testing every primitive\n", name, frame, mismatches);
+                failures++;
+                break;
+            }
+        }
+        printf("%s: %s\n", name, failures ? "FAILED" : "ok");
+        return failures;
+    }
+}
+
+int main() {
+    ThreadPool pool(4);
+    BVH::buildPool = &pool;
+    int failures = 0;
+    for (int wide = 0; wide < 2; ++wide) {
+        BVH::buildWideNodes = wide != 0;
+        const char *suffix = wide ? ", wide" : "";
+        char name[64];
+
+        BVH::buildLinear = false;
+        snprintf(name, sizeof(name), "sah%s", suffix);
+        failures += RunCase(name);
+
+        BVH::buildLinear = true;
+        BVH::treeletPasses = 0;
+        snprintf(name, sizeof(name), "lbvh%s", suffix);
+        failures += RunCase(name);
+
+        BVH::treeletPasses = 2;
+        snprintf(name, sizeof(name), "lbvh with treelets%s", suffix);
+        failures += RunCase(name);
+    }
+    return failures > 0 ? 1 : 0;
+}